@@ -61,13 +61,6 @@
 template<bool FixIsLight>
 class BSDF
 {
-    struct ComponentProbabilities
-    {
-        float diffProb;
-        float phongProb;
-        float reflProb;
-        float refrProb;
-    };
 public:
     enum Events
     {
@@ -107,10 +100,38 @@ public:
             return;
         }
 
-        const Material &mat = aScene.GetMaterial(aIsect.matID);
-        GetComponentProbabilities(mat, mProbabilities);
+        const MaterialSampling &sampling = aScene.GetMaterialSampling(aIsect.matID);
+
+        if(!sampling.mUsesFresnel && !sampling.mIsTextured)
+        {
+            // Precomputed, nothing depends on the incident direction
+            const Material &mat = aScene.GetMaterial(aIsect.matID);
+            mDiffuseReflectance = mat.mDiffuseReflectance;
+            mPhongReflectance   = mat.mPhongReflectance;
+            mProbabilities      = sampling.mProbabilities;
+            mContinuationProb   = sampling.mContinuationProb;
+            mIsDelta            = sampling.mIsDelta;
+            mType               = sampling.mType;
+            mReflectCoeff       = 1.f;
+        }
+        else
+        {
+            const Material mat = sampling.mIsTextured ?
+                aScene.GetTexturedMaterial(aIsect.matID,
+                    aRay.org + aRay.dir * aIsect.dist) :
+                aScene.GetMaterial(aIsect.matID);
+
+            mDiffuseReflectance = mat.mDiffuseReflectance;
+            mPhongReflectance   = mat.mPhongReflectance;
+            mReflectCoeff = FresnelDielectric(mLocalDirFix.z, mat.mIOR);
+            mat.GetSamplingProbabilities(mReflectCoeff, mProbabilities, mContinuationProb);
+
+            mIsDelta = (mProbabilities.diffProb == 0) && (mProbabilities.phongProb == 0);
 
-        mIsDelta = (mProbabilities.diffProb == 0) && (mProbabilities.phongProb == 0);
+            // Fast path of the material, black materials sample nothing
+            // and stay generic
+            mType = (mContinuationProb > 0) ? mat.mType : Material::kGeneric;
+        }
 
         // now it becomes valid
         mMaterialID = aIsect.matID;
@@ -146,6 +167,17 @@ public:
 
         const Material &mat = aScene.GetMaterial(mMaterialID);
 
+        switch(mType)
+        {
+        case Material::kPureDiffuse:
+            return EvaluateDiffuse(mat, localDirGen, oDirectPdfW, oReversePdfW);
+        case Material::kPureMirror:
+        case Material::kGlass:
+            return result;
+        default:
+            break;
+        }
+
         result += EvaluateDiffuse(mat, localDirGen, oDirectPdfW, oReversePdfW);
         result += EvaluatePhong(mat, localDirGen, oDirectPdfW, oReversePdfW);
 
@@ -173,8 +205,19 @@ public:
         float directPdfW  = 0;
         float reversePdfW = 0;
 
-        PdfDiffuse(mat, localDirGen, &directPdfW, &reversePdfW);
-        PdfPhong(mat, localDirGen, &directPdfW, &reversePdfW);
+        switch(mType)
+        {
+        case Material::kPureDiffuse:
+            PdfDiffuse(mat, localDirGen, &directPdfW, &reversePdfW);
+            break;
+        case Material::kPureMirror:
+        case Material::kGlass:
+            break;
+        default:
+            PdfDiffuse(mat, localDirGen, &directPdfW, &reversePdfW);
+            PdfPhong(mat, localDirGen, &directPdfW, &reversePdfW);
+            break;
+        }
 
         return aEvalRevPdf ? reversePdfW : directPdfW;
     }
@@ -195,6 +238,85 @@ public:
         float       &oPdfW,
         float       &oCosThetaGen,
         uint        *oSampledEvent = NULL) const
+    {
+        const Material &mat = aScene.GetMaterial(mMaterialID);
+
+        oPdfW = 0;
+        Vec3f result(0);
+        Vec3f localDirGen;
+        uint  sampledEvent;
+
+        // Fast paths only consider the components the material has
+        switch(mType)
+        {
+        case Material::kPureDiffuse:
+            sampledEvent = kDiffuse;
+            result = SampleDiffuse(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            break;
+        case Material::kPureMirror:
+            sampledEvent = kReflect;
+            result = SampleReflect(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            break;
+        case Material::kDiffuseGlossy:
+            if(aRndTriplet.z < mProbabilities.diffProb)
+            {
+                sampledEvent = kDiffuse;
+                result = SampleDiffuse(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+                if(!result.IsZero())
+                    result += EvaluatePhong(mat, localDirGen, &oPdfW);
+            }
+            else
+            {
+                sampledEvent = kPhong;
+                result = SamplePhong(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+                if(!result.IsZero())
+                    result += EvaluateDiffuse(mat, localDirGen, &oPdfW);
+            }
+            break;
+        case Material::kGlass:
+            sampledEvent = (aRndTriplet.z < mProbabilities.reflProb) ? kReflect : kRefract;
+            result = (sampledEvent == kReflect) ?
+                SampleReflect(mat, aRndTriplet.GetXY(), localDirGen, oPdfW) :
+                SampleRefract(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            break;
+        default:
+            return SampleGeneric(mat, aRndTriplet, oWorldDirGen, oPdfW, oCosThetaGen,
+                oSampledEvent);
+        }
+
+        if(oSampledEvent)
+            *oSampledEvent = sampledEvent;
+
+        if(result.IsZero())
+            return Vec3f(0);
+
+        oCosThetaGen   = std::abs(localDirGen.z);
+        if(oCosThetaGen < EPS_COSINE)
+            return Vec3f(0.f);
+
+        oWorldDirGen = mFrame.ToWorld(localDirGen);
+        return result;
+    }
+
+
+    bool  IsValid() const           { return mMaterialID >= 0;             }
+    bool  IsDelta() const           { return mIsDelta;                     }
+    bool  HasSpecular() const       { return mProbabilities.reflProb + mProbabilities.refrProb > 0; }
+    float ContinuationProb() const  { return mContinuationProb;            }
+    float CosThetaFix() const       { return mLocalDirFix.z;               }
+    Vec3f WorldDirFix() const       { return mFrame.ToWorld(mLocalDirFix); }
+
+private:
+
+    // Sample() for materials mixing diffuse, Phong, reflection, and
+    // refraction, picks the component by z of the random triplet
+    Vec3f SampleGeneric(
+        const Material &aMaterial,
+        const Vec3f    &aRndTriplet,
+        Vec3f          &oWorldDirGen,
+        float          &oPdfW,
+        float          &oCosThetaGen,
+        uint           *oSampledEvent) const
     {
         uint sampledEvent;
 
@@ -210,40 +332,38 @@ public:
         if(oSampledEvent)
             *oSampledEvent = sampledEvent;
 
-        const Material &mat = aScene.GetMaterial(mMaterialID);
-
         oPdfW = 0;
         Vec3f result(0);
         Vec3f localDirGen;
 
         if(sampledEvent == kDiffuse)
         {
-            result += SampleDiffuse(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            result += SampleDiffuse(aMaterial, aRndTriplet.GetXY(), localDirGen, oPdfW);
             
             if(result.IsZero())
                 return Vec3f(0);
             
-            result += EvaluatePhong(mat, localDirGen, &oPdfW);
+            result += EvaluatePhong(aMaterial, localDirGen, &oPdfW);
         }
         else if(sampledEvent == kPhong)
         {
-            result += SamplePhong(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            result += SamplePhong(aMaterial, aRndTriplet.GetXY(), localDirGen, oPdfW);
             
             if(result.IsZero())
                 return Vec3f(0);
             
-            result += EvaluateDiffuse(mat, localDirGen, &oPdfW);
+            result += EvaluateDiffuse(aMaterial, localDirGen, &oPdfW);
         }
         else if(sampledEvent == kReflect)
         {
-            result += SampleReflect(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            result += SampleReflect(aMaterial, aRndTriplet.GetXY(), localDirGen, oPdfW);
 
             if(result.IsZero())
                 return Vec3f(0);
         }
         else
         {
-            result += SampleRefract(mat, aRndTriplet.GetXY(), localDirGen, oPdfW);
+            result += SampleRefract(aMaterial, aRndTriplet.GetXY(), localDirGen, oPdfW);
             if(result.IsZero())
                 return Vec3f(0);
         }
@@ -256,15 +376,6 @@ public:
         return result;
     }
 
-
-    bool  IsValid() const           { return mMaterialID >= 0;             }
-    bool  IsDelta() const           { return mIsDelta;                     }
-    float ContinuationProb() const  { return mContinuationProb;            }
-    float CosThetaFix() const       { return mLocalDirFix.z;               }
-    Vec3f WorldDirFix() const       { return mFrame.ToWorld(mLocalDirFix); }
-
-private:
-
     ////////////////////////////////////////////////////////////////////////////
     // Sampling methods
     // All sampling methods take material, 2 random numbers [0-1[,
@@ -284,7 +395,7 @@ private:
         oLocalDirGen = SampleCosHemisphereW(aRndTuple, &unweightedPdfW);
         oPdfW += unweightedPdfW * mProbabilities.diffProb;
 
-        return aMaterial.mDiffuseReflectance * INV_PI_F;
+        return mDiffuseReflectance * INV_PI_F;
     }
 
     Vec3f SamplePhong(
@@ -311,7 +422,7 @@ private:
 
         PdfPhong(aMaterial, oLocalDirGen, &oPdfW);
 
-        const Vec3f rho = aMaterial.mPhongReflectance *
+        const Vec3f rho = mPhongReflectance *
             (aMaterial.mPhongExponent + 2.f) * 0.5f * INV_PI_F;
 
         return rho * std::pow(dot_R_Wi, aMaterial.mPhongExponent);
@@ -408,7 +519,7 @@ private:
         if(oReversePdfW)
             *oReversePdfW += mProbabilities.diffProb * std::max(0.f, mLocalDirFix.z * INV_PI_F);
 
-        return aMaterial.mDiffuseReflectance * INV_PI_F;
+        return mDiffuseReflectance * INV_PI_F;
     }
 
     Vec3f EvaluatePhong(
@@ -443,7 +554,7 @@ private:
                 *oReversePdfW += pdfW;
         }
 
-        const Vec3f rho = aMaterial.mPhongReflectance *
+        const Vec3f rho = mPhongReflectance *
             (aMaterial.mPhongExponent + 2.f) * 0.5f * INV_PI_F;
 
         return rho * std::pow(dot_R_Wi, aMaterial.mPhongExponent);
@@ -501,75 +612,14 @@ private:
         }
     }
 
-    ////////////////////////////////////////////////////////////////////////////
-    // Albedo methods
-    ////////////////////////////////////////////////////////////////////////////
-
-    float AlbedoDiffuse(const Material& aMaterial) const
-    {
-        return Luminance(aMaterial.mDiffuseReflectance);
-    }
-
-    float AlbedoPhong(const Material& aMaterial) const
-    {
-        return Luminance(aMaterial.mPhongReflectance);
-    }
-
-    float AlbedoReflect(const Material& aMaterial) const
-    {
-        return Luminance(aMaterial.mMirrorReflectance);
-    }
-
-    float AlbedoRefract(const Material& aMaterial) const
-    {
-        return aMaterial.mIOR > 0.f ? 1.f : 0.f;
-    }
-
-    void GetComponentProbabilities(
-        const Material         &aMaterial,
-        ComponentProbabilities &oProbabilities)
-    {
-        mReflectCoeff = FresnelDielectric(mLocalDirFix.z, aMaterial.mIOR);
-
-        const float albedoDiffuse = AlbedoDiffuse(aMaterial);
-        const float albedoPhong   = AlbedoPhong(aMaterial);
-        const float albedoReflect = mReflectCoeff         * AlbedoReflect(aMaterial);
-        const float albedoRefract = (1.f - mReflectCoeff) * AlbedoRefract(aMaterial);
-
-        const float totalAlbedo = albedoDiffuse + albedoPhong + albedoReflect + albedoRefract;
-
-        if(totalAlbedo < 1e-9f)
-        {
-            oProbabilities.diffProb  = 0.f;
-            oProbabilities.phongProb = 0.f;
-            oProbabilities.reflProb  = 0.f;
-            oProbabilities.refrProb  = 0.f;
-            mContinuationProb = 0.f;
-        }
-        else
-        {
-            oProbabilities.diffProb  = albedoDiffuse / totalAlbedo;
-            oProbabilities.phongProb = albedoPhong   / totalAlbedo;
-            oProbabilities.reflProb  = albedoReflect / totalAlbedo;
-            oProbabilities.refrProb  = albedoRefract / totalAlbedo;
-            // The continuation probability is max component from reflectance.
-            // That way the weight of sample will never rise.
-            // Luminance is another very valid option.
-            mContinuationProb =
-                (aMaterial.mDiffuseReflectance +
-                aMaterial.mPhongReflectance +
-                mReflectCoeff * aMaterial.mMirrorReflectance).Max() +
-                (1.f - mReflectCoeff);
-
-            mContinuationProb = std::min(1.f, std::max(0.f, mContinuationProb));
-        }
-    }
-
 private:
     int   mMaterialID;       //!< Id of scene material, < 0 ~ invalid
     Frame mFrame;            //!< Local frame of reference
     Vec3f mLocalDirFix;      //!< Incoming (fixed) direction, in local
+    Vec3f mDiffuseReflectance; //!< Of the material at the hit, textured
+    Vec3f mPhongReflectance;   //!< Of the material at the hit, textured
     bool  mIsDelta;          //!< True when material is purely specular
+    Material::Type mType;    //!< Picks the fast path of Evaluate(), Pdf(), Sample()
     ComponentProbabilities mProbabilities; //!< Sampling probabilities
     float mContinuationProb; //!< Russian roulette probability
     float mReflectCoeff;     //!< Fresnel reflection coefficient (for glass)
@@ -0,0 +1,1161 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __BVH_HXX__
+#define __BVH_HXX__
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "mappedfile.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Compressed 4-wide bounding volume hierarchy
+//
+// A node stores the bounds of its four children quantized to 8 bits per
+// plane, relative to the bounds of the node itself (origin and step per
+// axis). A node is 64 bytes, one cache line, where a node with float
+// bounds takes 112. Quantized bounds are rounded outwards, so they stay
+// conservative. Traversal dequantizes and slab-tests all four children in
+// fixed size loops that the compiler vectorizes, and visits the children
+// that were hit nearest first.
+//
+// Construction splits primitives by the surface area heuristic evaluated
+// on bins of centroids. Large ranges are binned by all threads, in chunks.
+// The top of the tree is built until ranges get small, then the remaining
+// subtrees are built in parallel, each into its own node array, and are
+// appended to the top.
+//
+// Built hierarchies can be kept in a cache directory. The file is named by
+// a hash of the primitive bounds (all the build looks at) and the build
+// parameters, and later runs with the same geometry map it instead of
+// building.
+//
+// When primitives move but stay the same (animation), Update refits the
+// node bounds bottom-up instead of building again. Refitting keeps the
+// tree, which gets worse the more things moved, so it rebuilds once the
+// surface area cost grew too much over the cost right after the build.
+
+class WideBVH : public AbstractGeometry
+{
+public:
+
+    enum { kWidth       = 4 };
+    // Primitives per leaf, at most 7. Parts are whole objects or blocks
+    // of mesh triangles, costly enough to get a leaf each.
+    enum { kMaxLeafSize = 1 };
+    enum { kStackSize   = 256 };  //!< Of traversal, fits trees over 80 levels deep
+
+    enum { kBinCount        = 16 };      //!< SAH candidates per axis, plus one
+    enum { kParallelBinning = 1 << 16 }; //!< Ranges binned by all threads from this size
+    enum { kSubtreeSize     = 1 << 12 }; //!< Subtrees from this size down are built in parallel
+    enum { kMaxDepth        = 64 };      //!< Deeper nodes split at the median, bounds the stack
+    enum { kMinBinnedSize   = 16 };      //!< Smaller ranges split at the median, binning costs more
+
+    // Takes ownership of aGeometry, its parts (see GetParts) are the
+    // primitives of the hierarchy. With aCacheDir, the hierarchy is
+    // loaded from there if it was built before, or saved there.
+    explicit WideBVH(
+        AbstractGeometry  *aGeometry,
+        const std::string &aCacheDir = "") :
+        mGeometry(aGeometry),
+        mNodeData(NULL),
+        mNodeCount(0),
+        mFromCache(false),
+        mBuildCost(0.f)
+    {
+        const double startT = omp_get_wtime();
+
+        std::vector<AbstractGeometry*> parts;
+        mGeometry->GetParts(parts);
+
+        std::vector<BuildPrimitive> prims;
+        GetBuildPrimitives(parts, prims);
+
+        if(aCacheDir.empty())
+        {
+            Build(parts, prims);
+        }
+        else
+        {
+            const unsigned long long key = GetCacheKey(prims);
+            char name[32];
+            sprintf(name, "bvh_%016llx.bin", key);
+
+            std::string cacheFile = aCacheDir;
+            if(cacheFile[cacheFile.length()-1] != '/' &&
+               cacheFile[cacheFile.length()-1] != '\\')
+                cacheFile += '/';
+            cacheFile += name;
+
+            mFromCache = LoadCache(cacheFile, key, parts);
+
+            if(!mFromCache)
+            {
+                Build(parts, prims);
+                SaveCache(cacheFile, key, prims);
+            }
+        }
+
+        mBuildCost = RefitNodes(false);
+        mBuildTime = float(omp_get_wtime() - startT);
+    }
+
+    // Adapts the hierarchy to primitives that moved. Refits it, unless that
+    // makes its cost more than aMaxCostRatio times the cost after the last
+    // build; then builds it again. Returns true when it was built.
+    bool Update(const float aMaxCostRatio)
+    {
+        const double startT = omp_get_wtime();
+        bool rebuilt = false;
+
+        // Mapped nodes are read-only
+        if(mFromCache)
+        {
+            mNodes.assign(mNodeData, mNodeData + mNodeCount);
+            mNodeData = mNodes.empty() ? NULL : &mNodes[0];
+            mCacheFile.Close();
+            mFromCache = false;
+        }
+
+        if(RefitNodes(true) > aMaxCostRatio * mBuildCost)
+        {
+            std::vector<AbstractGeometry*> parts;
+            mGeometry->GetParts(parts);
+
+            std::vector<BuildPrimitive> prims;
+            GetBuildPrimitives(parts, prims);
+            Build(parts, prims);
+
+            mBuildCost = RefitNodes(false);
+            rebuilt    = true;
+        }
+
+        mBuildTime = float(omp_get_wtime() - startT);
+        return rebuilt;
+    }
+
+    virtual ~WideBVH()
+    {
+        delete mGeometry;
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mNodeCount == 0)
+            return false;
+
+        const Vec3f invDir = Vec3f(1.f) / aRay.dir;
+        bool anyIntersection = false;
+
+        int   stack[kStackSize];
+        float stackDist[kStackSize];
+        int   stackSize = 1;
+        stack[0]     = 0;
+        stackDist[0] = aRay.tmin;
+
+        while(stackSize > 0)
+        {
+            stackSize--;
+
+            // Skips what got farther than the closest hit meanwhile
+            if(stackDist[stackSize] > oResult.dist)
+                continue;
+
+            const int ref = stack[stackSize];
+
+            if(ref < 0)
+            {
+                if(IntersectLeaf(ref, aRay, oResult))
+                    anyIntersection = true;
+                continue;
+            }
+
+            float dist[kWidth];
+            int   hit[kWidth];
+            IntersectChildren(mNodeData[ref], aRay, invDir, oResult.dist, dist, hit);
+
+            // Pushes children farthest first (insertion sort of the few
+            // that were hit), so that the nearest is popped first
+            const int first = stackSize;
+            for(int i=0; i<kWidth; i++)
+            {
+                if(!hit[i])
+                    continue;
+
+                int k = stackSize++;
+                for(; k > first && stackDist[k-1] < dist[i]; k--)
+                {
+                    stack[k]     = stack[k-1];
+                    stackDist[k] = stackDist[k-1];
+                }
+
+                stack[k]     = mNodeData[ref].mChild[i];
+                stackDist[k] = dist[i];
+            }
+        }
+
+        return anyIntersection;
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mNodeCount == 0)
+            return false;
+
+        const Vec3f invDir = Vec3f(1.f) / aRay.dir;
+
+        int stack[kStackSize];
+        int stackSize = 1;
+        stack[0] = 0;
+
+        while(stackSize > 0)
+        {
+            const int ref = stack[--stackSize];
+
+            if(ref < 0)
+            {
+                if(IntersectLeafP(ref, aRay, oResult))
+                    return true;
+                continue;
+            }
+
+            float dist[kWidth];
+            int   hit[kWidth];
+            IntersectChildren(mNodeData[ref], aRay, invDir, oResult.dist, dist, hit);
+
+            for(int i=0; i<kWidth; i++)
+            {
+                if(hit[i])
+                    stack[stackSize++] = mNodeData[ref].mChild[i];
+            }
+        }
+
+        return false;
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        mGeometry->GrowBBox(aoBBoxMin, aoBBoxMax);
+    }
+
+    int    GetPrimitiveCount() const { return (int)mPrimitives.size(); }
+    int    GetNodeCount()      const { return mNodeCount; }
+    size_t GetNodeBytes()      const { return mNodeCount * sizeof(Node); }
+    float  GetBuildTime()      const { return mBuildTime; }  //!< In seconds, or of loading or update
+    bool   IsFromCache()       const { return mFromCache; }
+
+private:
+
+    // Child reference is a node index (> 0, root is never a child),
+    // kEmpty, or for leaves -(first primitive * 8 + primitive count)
+    enum { kEmpty = 0 };
+
+    struct Node
+    {
+        Vec3f         mOrigin;          //!< Minimum of node bounds
+        Vec3f         mStep;            //!< Node bounds size / 255
+        unsigned char mMin[3][kWidth];  //!< Child bounds in steps, per axis
+        unsigned char mMax[3][kWidth];
+        int           mChild[kWidth];
+    };
+
+    struct Bounds
+    {
+        void Reset()
+        {
+            mMin = Vec3f( 1e36f);
+            mMax = Vec3f(-1e36f);
+        }
+
+        void Grow(const Vec3f &aPoint)
+        {
+            for(int j=0; j<3; j++)
+            {
+                mMin.Get(j) = std::min(mMin.Get(j), aPoint.Get(j));
+                mMax.Get(j) = std::max(mMax.Get(j), aPoint.Get(j));
+            }
+        }
+
+        void Grow(const Bounds &aBounds)
+        {
+            Grow(aBounds.mMin);
+            Grow(aBounds.mMax);
+        }
+
+        // Half of the surface area, zero when empty
+        float HalfArea() const
+        {
+            const Vec3f size = mMax - mMin;
+            if(size.x < 0.f)
+                return 0.f;
+            return size.x * size.y + size.y * size.z + size.z * size.x;
+        }
+
+        Vec3f mMin, mMax;
+    };
+
+    struct BuildPrimitive
+    {
+        Bounds mBounds;
+        Vec3f  mCentroid;
+        int    mIndex;
+    };
+
+    // Primitive counts and bounds per bin of centroids, for each axis
+    struct Bins
+    {
+        void Reset()
+        {
+            for(int j=0; j<3; j++)
+            {
+                for(int b=0; b<kBinCount; b++)
+                {
+                    mBounds[j][b].Reset();
+                    mCount[j][b] = 0;
+                }
+            }
+        }
+
+        void Add(const Bins &aBins)
+        {
+            for(int j=0; j<3; j++)
+            {
+                for(int b=0; b<kBinCount; b++)
+                {
+                    mBounds[j][b].Grow(aBins.mBounds[j][b]);
+                    mCount[j][b] += aBins.mCount[j][b];
+                }
+            }
+        }
+
+        Bounds mBounds[3][kBinCount];
+        int    mCount[3][kBinCount];
+    };
+
+    // Maps centroids to bins along one axis
+    struct BinMapping
+    {
+        BinMapping(const Bounds &aCentroidBounds, int aAxis) :
+            mAxis(aAxis),
+            mMin(aCentroidBounds.mMin.Get(aAxis))
+        {
+            const float extent = aCentroidBounds.mMax.Get(aAxis) - mMin;
+            mScale = (extent > 0.f) ? kBinCount * (1.f - 1e-6f) / extent : 0.f;
+        }
+
+        int operator()(const Vec3f &aCentroid) const
+        {
+            const int bin = int((aCentroid.Get(mAxis) - mMin) * mScale);
+            return std::min(std::max(bin, 0), kBinCount - 1);
+        }
+
+        int   mAxis;
+        float mMin, mScale;
+    };
+
+    // Primitive goes left of a split after bin mLastLeft
+    struct LeftOfSplit
+    {
+        LeftOfSplit(const BinMapping &aMapping, int aLastLeft) :
+            mMapping(aMapping), mLastLeft(aLastLeft) {}
+
+        bool operator()(const BuildPrimitive &aPrim) const
+        {
+            return mMapping(aPrim.mCentroid) <= mLastLeft;
+        }
+
+        BinMapping mMapping;
+        int        mLastLeft;
+    };
+
+    // Orders primitives by centroid along one axis
+    struct CentroidLess
+    {
+        CentroidLess(int aAxis) : mAxis(aAxis) {}
+
+        bool operator()(const BuildPrimitive &a, const BuildPrimitive &b) const
+        {
+            return a.mCentroid.Get(mAxis) < b.mCentroid.Get(mAxis);
+        }
+
+        int mAxis;
+    };
+
+    // Subtree left for the parallel phase of construction, its root
+    // becomes child aSlot of node mParent
+    struct SubtreeJob
+    {
+        int mBegin, mEnd;
+        int mDepth;
+        int mParent, mSlot;
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // Traversal
+
+    // Slab test of all children at once, loops over children are innermost
+    // so that they vectorize. oDist gets entry distances.
+    static void IntersectChildren(
+        const Node  &aNode,
+        const Ray   &aRay,
+        const Vec3f &aInvDir,
+        const float aMaxDist,
+        float       *oDist,
+        int         *oHit)
+    {
+        float tNear[kWidth], tFar[kWidth];
+        for(int i=0; i<kWidth; i++)
+        {
+            tNear[i] = aRay.tmin;
+            tFar[i]  = aMaxDist;
+        }
+
+        for(int j=0; j<3; j++)
+        {
+            const float origin = aNode.mOrigin.Get(j);
+            const float step   = aNode.mStep.Get(j);
+            const float rayOrg = aRay.org.Get(j);
+            const float invDir = aInvDir.Get(j);
+
+            for(int i=0; i<kWidth; i++)
+            {
+                const float lo = origin + step * float(aNode.mMin[j][i]);
+                const float hi = origin + step * float(aNode.mMax[j][i]);
+                const float t0 = (lo - rayOrg) * invDir;
+                const float t1 = (hi - rayOrg) * invDir;
+
+                // Far plane slightly conservative, so that rounding does
+                // not lose hits at the bounds
+                const float tMin = t0 < t1 ? t0 : t1;
+                const float tMax = (t0 < t1 ? t1 : t0) * 1.0000004f;
+
+                tNear[i] = tNear[i] < tMin ? tMin : tNear[i];
+                tFar[i]  = tFar[i]  > tMax ? tMax : tFar[i];
+            }
+        }
+
+        for(int i=0; i<kWidth; i++)
+        {
+            oDist[i] = tNear[i];
+            oHit[i]  = (tNear[i] <= tFar[i]) & (aNode.mChild[i] != kEmpty);
+        }
+    }
+
+    bool IntersectLeaf(
+        const int aRef,
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const int first = (-aRef) >> 3;
+        const int last  = first + ((-aRef) & 7);
+        bool anyIntersection = false;
+
+        for(int i=first; i<last; i++)
+        {
+            if(mPrimitives[i]->Intersect(aRay, oResult))
+                anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    bool IntersectLeafP(
+        const int aRef,
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const int first = (-aRef) >> 3;
+        const int last  = first + ((-aRef) & 7);
+
+        for(int i=first; i<last; i++)
+        {
+            if(mPrimitives[i]->IntersectP(aRay, oResult))
+                return true;
+        }
+
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Construction
+
+    static void GetBuildPrimitives(
+        const std::vector<AbstractGeometry*> &aParts,
+        std::vector<BuildPrimitive>          &oPrims)
+    {
+        const int primCount = (int)aParts.size();
+        oPrims.resize(primCount);
+
+#pragma omp parallel for
+        for(int i=0; i<primCount; i++)
+        {
+            BuildPrimitive &prim = oPrims[i];
+            prim.mBounds.Reset();
+            aParts[i]->GrowBBox(prim.mBounds.mMin, prim.mBounds.mMax);
+            prim.mCentroid = (prim.mBounds.mMin + prim.mBounds.mMax) * 0.5f;
+            prim.mIndex    = i;
+        }
+    }
+
+    // Leaves aoPrims in leaf order
+    void Build(
+        const std::vector<AbstractGeometry*> &aParts,
+        std::vector<BuildPrimitive>          &aoPrims)
+    {
+        std::vector<BuildPrimitive> &prims = aoPrims;
+        const int primCount = (int)prims.size();
+
+        mNodes.clear();
+
+        if(primCount > 0)
+        {
+            // Top of the tree, leaving small subtrees for later
+            std::vector<SubtreeJob> jobs;
+            BuildNode(prims, 0, primCount, 0, mNodes, &jobs);
+
+            const int jobCount = (int)jobs.size();
+            std::vector<std::vector<Node> > subtreeNodes(jobCount);
+
+#pragma omp parallel for schedule(dynamic)
+            for(int i=0; i<jobCount; i++)
+            {
+                BuildNode(prims, jobs[i].mBegin, jobs[i].mEnd, jobs[i].mDepth,
+                    subtreeNodes[i], NULL);
+            }
+
+            // Appends subtrees, their node indices shift by the offset
+            for(int i=0; i<jobCount; i++)
+            {
+                const int offset = (int)mNodes.size();
+
+                for(size_t k=0; k<subtreeNodes[i].size(); k++)
+                {
+                    Node node = subtreeNodes[i][k];
+                    for(int c=0; c<kWidth; c++)
+                    {
+                        if(node.mChild[c] > 0)
+                            node.mChild[c] += offset;
+                    }
+                    mNodes.push_back(node);
+                }
+
+                mNodes[jobs[i].mParent].mChild[jobs[i].mSlot] = offset;
+            }
+        }
+
+        mNodeData  = mNodes.empty() ? NULL : &mNodes[0];
+        mNodeCount = (int)mNodes.size();
+
+        // Leaves refer to ranges of primitives in build order
+        mPrimitives.resize(primCount);
+        for(int i=0; i<primCount; i++)
+            mPrimitives[i] = aParts[prims[i].mIndex];
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Refitting
+
+    // Computes bounds of all nodes from current bounds of the primitives,
+    // and with aQuantize stores them in the nodes. Returns the surface area
+    // cost: areas of nodes plus areas of leaves times their primitives,
+    // relative to the root.
+    float RefitNodes(const bool aQuantize)
+    {
+        const int primCount = (int)mPrimitives.size();
+        std::vector<Bounds> primBounds(primCount);
+
+#pragma omp parallel for
+        for(int i=0; i<primCount; i++)
+        {
+            primBounds[i].Reset();
+            mPrimitives[i]->GrowBBox(primBounds[i].mMin, primBounds[i].mMax);
+        }
+
+        std::vector<Bounds> nodeBounds(mNodeCount);
+        float cost = 0.f;
+
+        // Children always come after their parent, see BuildNode
+        for(int i=mNodeCount-1; i>=0; i--)
+        {
+            const Node &node = mNodeData[i];
+            Vec3f childMin[kWidth], childMax[kWidth];
+            int   childCount = 0;
+
+            nodeBounds[i].Reset();
+
+            for(int c=0; c<kWidth; c++)
+            {
+                const int ref = node.mChild[c];
+                Bounds bounds;
+
+                if(ref == kEmpty)
+                    continue;
+
+                if(ref < 0)
+                {
+                    const int first = (-ref) >> 3;
+                    const int count = (-ref) & 7;
+
+                    bounds.Reset();
+                    for(int k=first; k<first+count; k++)
+                        bounds.Grow(primBounds[k]);
+
+                    cost += bounds.HalfArea() * count;
+                }
+                else
+                {
+                    bounds = nodeBounds[ref];
+                }
+
+                nodeBounds[i].Grow(bounds);
+                childMin[childCount] = bounds.mMin;
+                childMax[childCount] = bounds.mMax;
+                childCount++;
+            }
+
+            cost += nodeBounds[i].HalfArea();
+
+            // Non-empty children come first
+            if(aQuantize)
+                Quantize(childMin, childMax, node.mChild, childCount, mNodes[i]);
+        }
+
+        return (mNodeCount > 0) ? cost / std::max(nodeBounds[0].HalfArea(), 1e-20f) : 0.f;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Cache
+
+    enum { kCacheVersion = 1 };
+
+    // Cache file starts with this, followed by nodes and then indices of
+    // parts in leaf order
+    struct CacheHeader
+    {
+        char               mMagic[8];
+        unsigned long long mKey;
+        int                mNodeCount;
+        int                mPrimitiveCount;
+        char               mPadding[40];    //!< Nodes start at a cache line
+    };
+
+    // FNV-1a hash of everything the build depends on
+    static unsigned long long GetCacheKey(const std::vector<BuildPrimitive> &aPrims)
+    {
+        const int params[] = {kCacheVersion, (int)sizeof(Node), kWidth, kMaxLeafSize,
+            kBinCount, kMaxDepth, kMinBinnedSize, (int)aPrims.size()};
+
+        unsigned long long key = HashBytes(kHashSeed, params, sizeof(params));
+
+        for(size_t i=0; i<aPrims.size(); i++)
+            key = HashBytes(key, &aPrims[i].mBounds, sizeof(Bounds));
+
+        return key;
+    }
+
+    // Writes to a temporary file first, so that concurrent runs never see
+    // a partial file
+    void SaveCache(
+        const std::string                 &aCacheFile,
+        const unsigned long long          aKey,
+        const std::vector<BuildPrimitive> &aPrims) const
+    {
+        CacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.mMagic, "SVCMBVH", 8);
+        header.mKey            = aKey;
+        header.mNodeCount      = mNodeCount;
+        header.mPrimitiveCount = (int)aPrims.size();
+
+        std::vector<int> order(aPrims.size());
+        for(size_t i=0; i<aPrims.size(); i++)
+            order[i] = aPrims[i].mIndex;
+
+        char suffix[32];
+        sprintf(suffix, ".%x.tmp", (unsigned)(omp_get_wtime() * 1e6));
+        const std::string tempFile = aCacheFile + suffix;
+
+        FILE *file = fopen(tempFile.c_str(), "wb");
+        bool ok = file != NULL;
+
+        if(ok)
+        {
+            ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            if(ok && mNodeCount > 0)
+                ok = fwrite(mNodeData, sizeof(Node), mNodeCount, file) == size_t(mNodeCount);
+            if(ok && !order.empty())
+                ok = fwrite(&order[0], sizeof(int), order.size(), file) == order.size();
+            ok = (fclose(file) == 0) && ok;
+        }
+
+        // Another run may have saved the same file meanwhile
+        if(ok && rename(tempFile.c_str(), aCacheFile.c_str()) != 0)
+        {
+            remove(aCacheFile.c_str());
+            ok = rename(tempFile.c_str(), aCacheFile.c_str()) == 0;
+        }
+
+        if(!ok)
+        {
+            remove(tempFile.c_str());
+            printf("Cannot write BVH cache %s\n", aCacheFile.c_str());
+        }
+    }
+
+    // Maps the cache file, returns false when it is missing or does not
+    // match the parts
+    bool LoadCache(
+        const std::string                    &aCacheFile,
+        const unsigned long long             aKey,
+        const std::vector<AbstractGeometry*> &aParts)
+    {
+        if(!mCacheFile.Open(aCacheFile.c_str(), false))
+            return false;
+
+        const CacheHeader *header = (const CacheHeader*)mCacheFile.GetData();
+        const int primCount = (int)aParts.size();
+
+        if(mCacheFile.GetSize() < sizeof(CacheHeader) ||
+           memcmp(header->mMagic, "SVCMBVH", 8) != 0 ||
+           header->mKey != aKey || header->mPrimitiveCount != primCount ||
+           header->mNodeCount < 0 || mCacheFile.GetSize() != sizeof(CacheHeader) +
+           size_t(header->mNodeCount) * sizeof(Node) + size_t(primCount) * sizeof(int))
+        {
+            mCacheFile.Close();
+            return false;
+        }
+
+        const Node *nodes = (const Node*)(mCacheFile.GetData() + sizeof(CacheHeader));
+        const int  *order = (const int*)(nodes + header->mNodeCount);
+        bool ok = true;
+
+        // Damaged files must not make traversal leave the arrays, or loop
+        // and overflow its stack. Build puts children after their parent,
+        // so depths are known in node order. Traversal holds up to
+        // kWidth - 1 siblings per level above a node, and its children.
+        std::vector<int> depth(header->mNodeCount, 0);
+        for(int i=0; ok && i<header->mNodeCount; i++)
+        {
+            ok = depth[i] * (kWidth - 1) + kWidth <= kStackSize;
+
+            for(int c=0; ok && c<kWidth; c++)
+            {
+                const int ref = nodes[i].mChild[c];
+                if(ref > 0)
+                {
+                    ok = ref > i && ref < header->mNodeCount;
+                    if(ok)
+                        depth[ref] = std::max(depth[ref], depth[i] + 1);
+                }
+                else if(ref < 0)
+                    ok = ((-ref) >> 3) + ((-ref) & 7) <= primCount;
+            }
+        }
+
+        mPrimitives.resize(primCount);
+        for(int i=0; ok && i<primCount; i++)
+        {
+            ok = order[i] >= 0 && order[i] < primCount;
+            mPrimitives[i] = ok ? aParts[order[i]] : NULL;
+        }
+
+        if(!ok)
+        {
+            mCacheFile.Close();
+            mPrimitives.clear();
+            return false;
+        }
+
+        mNodeData  = nodes;
+        mNodeCount = header->mNodeCount;
+        return true;
+    }
+
+    // Builds node over primitives [aBegin, aEnd) into aoNodes, returns its
+    // index. With aoJobs, children of at most kSubtreeSize primitives are
+    // not built but appended to aoJobs.
+    static int BuildNode(
+        std::vector<BuildPrimitive> &aoPrims,
+        const int               aBegin,
+        const int               aEnd,
+        const int               aDepth,
+        std::vector<Node>       &aoNodes,
+        std::vector<SubtreeJob> *aoJobs)
+    {
+        // Splits the largest range until there are kWidth of them,
+        // or all are small enough for leaves
+        int ranges[kWidth + 1] = {aBegin, aEnd};
+        int rangeCount = 1;
+
+        while(rangeCount < kWidth)
+        {
+            int largest = -1;
+            for(int i=0; i<rangeCount; i++)
+            {
+                const int size = ranges[i+1] - ranges[i];
+                if(size > 1 && (largest < 0 || size > ranges[largest+1] - ranges[largest]))
+                    largest = i;
+            }
+
+            if(largest < 0 || (rangeCount > 1 &&
+               ranges[largest+1] - ranges[largest] <= kMaxLeafSize))
+                break;
+
+            const int mid = SplitRange(aoPrims, ranges[largest], ranges[largest+1],
+                aDepth);
+
+            for(int i=rangeCount; i>largest; i--)
+                ranges[i+1] = ranges[i];
+            ranges[largest+1] = mid;
+            rangeCount++;
+        }
+
+        const int nodeIdx = (int)aoNodes.size();
+        aoNodes.push_back(Node());
+
+        Vec3f childMin[kWidth], childMax[kWidth];
+        int   child[kWidth];
+
+        for(int i=0; i<kWidth; i++)
+        {
+            child[i] = kEmpty;
+
+            if(i >= rangeCount)
+                continue;
+
+            Bounds bounds, centroidBounds;
+            ComputeBounds(aoPrims, ranges[i], ranges[i+1], bounds, centroidBounds);
+            childMin[i] = bounds.mMin;
+            childMax[i] = bounds.mMax;
+
+            const int count = ranges[i+1] - ranges[i];
+            if(count <= kMaxLeafSize)
+            {
+                child[i] = -(ranges[i] * 8 + count);
+            }
+            else if(aoJobs && count <= kSubtreeSize)
+            {
+                const SubtreeJob job = {ranges[i], ranges[i+1], aDepth + 1, nodeIdx, i};
+                aoJobs->push_back(job);
+            }
+            else
+            {
+                child[i] = BuildNode(aoPrims, ranges[i], ranges[i+1], aDepth + 1,
+                    aoNodes, aoJobs);
+            }
+        }
+
+        Quantize(childMin, childMax, child, rangeCount, aoNodes[nodeIdx]);
+        return nodeIdx;
+    }
+
+    // Partitions primitives [aBegin, aEnd) by the cheapest split of the
+    // surface area heuristic and returns the middle. Falls back to the
+    // median centroid along the longest axis when binning cannot separate
+    // them, for small ranges, or when the tree gets too deep.
+    static int SplitRange(
+        std::vector<BuildPrimitive> &aoPrims,
+        const int aBegin,
+        const int aEnd,
+        const int aDepth)
+    {
+        Bounds bounds, centroidBounds;
+        ComputeBounds(aoPrims, aBegin, aEnd, bounds, centroidBounds);
+
+        const Vec3f extent = centroidBounds.mMax - centroidBounds.mMin;
+        int axis = 0;
+        if(extent.y > extent.Get(axis)) axis = 1;
+        if(extent.z > extent.Get(axis)) axis = 2;
+
+        if(extent.Get(axis) > 0.f && aDepth < kMaxDepth &&
+           aEnd - aBegin >= kMinBinnedSize)
+        {
+            Bins bins;
+            BinRange(aoPrims, aBegin, aEnd, centroidBounds, bins);
+
+            float bestCost = 1e36f;
+            int   bestAxis = -1, bestLastLeft = 0;
+
+            for(int j=0; j<3; j++)
+            {
+                if(extent.Get(j) <= 0.f)
+                    continue;
+
+                // Right side costs of splits after each bin, swept from
+                // the right, then left sides swept from the left
+                float  rightCost[kBinCount];
+                Bounds side;
+                int    count = 0;
+
+                side.Reset();
+                for(int b=kBinCount-1; b>0; b--)
+                {
+                    side.Grow(bins.mBounds[j][b]);
+                    count += bins.mCount[j][b];
+                    rightCost[b-1] = side.HalfArea() * count;
+                }
+
+                side.Reset();
+                count = 0;
+                for(int b=0; b<kBinCount-1; b++)
+                {
+                    side.Grow(bins.mBounds[j][b]);
+                    count += bins.mCount[j][b];
+
+                    const float cost = side.HalfArea() * count + rightCost[b];
+                    if(count > 0 && count < aEnd - aBegin && cost < bestCost)
+                    {
+                        bestCost     = cost;
+                        bestAxis     = j;
+                        bestLastLeft = b;
+                    }
+                }
+            }
+
+            if(bestAxis >= 0)
+            {
+                const BinMapping mapping(centroidBounds, bestAxis);
+                BuildPrimitive *mid = std::partition(&aoPrims[0] + aBegin,
+                    &aoPrims[0] + aEnd, LeftOfSplit(mapping, bestLastLeft));
+                return int(mid - &aoPrims[0]);
+            }
+        }
+
+        const int mid = (aBegin + aEnd) / 2;
+        std::nth_element(aoPrims.begin() + aBegin, aoPrims.begin() + mid,
+            aoPrims.begin() + aEnd, CentroidLess(axis));
+        return mid;
+    }
+
+    // Chunks that large ranges are processed in by all threads
+    static int GetChunkCount(const int aBegin, const int aEnd)
+    {
+        return (aEnd - aBegin >= kParallelBinning) ? omp_get_max_threads() : 1;
+    }
+
+    // Start of chunk aChunk of aChunkCount
+    static int GetChunkBegin(
+        const int aBegin,
+        const int aEnd,
+        const int aChunk,
+        const int aChunkCount)
+    {
+        return aBegin + int((long long)(aEnd - aBegin) * aChunk / aChunkCount);
+    }
+
+    static void ComputeBounds(
+        const std::vector<BuildPrimitive> &aPrims,
+        const int aBegin,
+        const int aEnd,
+        Bounds    &oBounds,
+        Bounds    &oCentroidBounds)
+    {
+        const int chunkCount = GetChunkCount(aBegin, aEnd);
+
+        if(chunkCount == 1)
+        {
+            ComputeChunkBounds(aPrims, aBegin, aEnd, oBounds, oCentroidBounds);
+            return;
+        }
+
+        std::vector<Bounds> chunkBounds(chunkCount), chunkCentroidBounds(chunkCount);
+
+#pragma omp parallel for
+        for(int c=0; c<chunkCount; c++)
+        {
+            ComputeChunkBounds(aPrims, GetChunkBegin(aBegin, aEnd, c, chunkCount),
+                GetChunkBegin(aBegin, aEnd, c + 1, chunkCount),
+                chunkBounds[c], chunkCentroidBounds[c]);
+        }
+
+        oBounds         = chunkBounds[0];
+        oCentroidBounds = chunkCentroidBounds[0];
+        for(int c=1; c<chunkCount; c++)
+        {
+            oBounds.Grow(chunkBounds[c]);
+            oCentroidBounds.Grow(chunkCentroidBounds[c]);
+        }
+    }
+
+    static void ComputeChunkBounds(
+        const std::vector<BuildPrimitive> &aPrims,
+        const int aBegin,
+        const int aEnd,
+        Bounds    &oBounds,
+        Bounds    &oCentroidBounds)
+    {
+        oBounds.Reset();
+        oCentroidBounds.Reset();
+
+        for(int k=aBegin; k<aEnd; k++)
+        {
+            oBounds.Grow(aPrims[k].mBounds);
+            oCentroidBounds.Grow(aPrims[k].mCentroid);
+        }
+    }
+
+    static void BinRange(
+        const std::vector<BuildPrimitive> &aPrims,
+        const int    aBegin,
+        const int    aEnd,
+        const Bounds &aCentroidBounds,
+        Bins         &oBins)
+    {
+        const int chunkCount = GetChunkCount(aBegin, aEnd);
+
+        if(chunkCount == 1)
+        {
+            BinChunk(aPrims, aBegin, aEnd, aCentroidBounds, oBins);
+            return;
+        }
+
+        std::vector<Bins> chunkBins(chunkCount);
+
+#pragma omp parallel for
+        for(int c=0; c<chunkCount; c++)
+        {
+            BinChunk(aPrims, GetChunkBegin(aBegin, aEnd, c, chunkCount),
+                GetChunkBegin(aBegin, aEnd, c + 1, chunkCount),
+                aCentroidBounds, chunkBins[c]);
+        }
+
+        oBins = chunkBins[0];
+        for(int c=1; c<chunkCount; c++)
+            oBins.Add(chunkBins[c]);
+    }
+
+    static void BinChunk(
+        const std::vector<BuildPrimitive> &aPrims,
+        const int    aBegin,
+        const int    aEnd,
+        const Bounds &aCentroidBounds,
+        Bins         &oBins)
+    {
+        const BinMapping mappings[3] = {BinMapping(aCentroidBounds, 0),
+            BinMapping(aCentroidBounds, 1), BinMapping(aCentroidBounds, 2)};
+
+        oBins.Reset();
+
+        for(int k=aBegin; k<aEnd; k++)
+        {
+            for(int j=0; j<3; j++)
+            {
+                const int bin = mappings[j](aPrims[k].mCentroid);
+                oBins.mBounds[j][bin].Grow(aPrims[k].mBounds);
+                oBins.mCount[j][bin]++;
+            }
+        }
+    }
+
+    // Stores children quantized against the union of their bounds,
+    // rounding outwards
+    static void Quantize(
+        const Vec3f *aChildMin,
+        const Vec3f *aChildMax,
+        const int   *aChild,
+        const int   aChildCount,
+        Node        &oNode)
+    {
+        Vec3f nodeMin( 1e36f);
+        Vec3f nodeMax(-1e36f);
+        for(int i=0; i<aChildCount; i++)
+        {
+            for(int j=0; j<3; j++)
+            {
+                nodeMin.Get(j) = std::min(nodeMin.Get(j), aChildMin[i].Get(j));
+                nodeMax.Get(j) = std::max(nodeMax.Get(j), aChildMax[i].Get(j));
+            }
+        }
+
+        oNode.mOrigin = nodeMin;
+
+        for(int j=0; j<3; j++)
+        {
+            // Step such that 255 steps reach the maximum
+            float step = (nodeMax.Get(j) - nodeMin.Get(j)) / 255.f;
+            while(nodeMin.Get(j) + step * 255.f < nodeMax.Get(j))
+                step *= 1.0000001f;
+            oNode.mStep.Get(j) = step;
+
+            for(int i=0; i<kWidth; i++)
+            {
+                oNode.mChild[i] = aChild[i];
+
+                if(i >= aChildCount)
+                {
+                    oNode.mMin[j][i] = 255;
+                    oNode.mMax[j][i] = 0;
+                    continue;
+                }
+
+                int lo = 0, hi = 255;
+                if(step > 0)
+                {
+                    lo = (int)std::floor((aChildMin[i].Get(j) - nodeMin.Get(j)) / step);
+                    hi = (int)std::ceil ((aChildMax[i].Get(j) - nodeMin.Get(j)) / step);
+                    lo = std::min(std::max(lo, 0), 255);
+                    hi = std::min(std::max(hi, 0), 255);
+
+                    // Same expression as in traversal, must not shrink
+                    while(lo > 0   && nodeMin.Get(j) + step * float(lo) > aChildMin[i].Get(j))
+                        lo--;
+                    while(hi < 255 && nodeMin.Get(j) + step * float(hi) < aChildMax[i].Get(j))
+                        hi++;
+                }
+
+                oNode.mMin[j][i] = (unsigned char)lo;
+                oNode.mMax[j][i] = (unsigned char)hi;
+            }
+        }
+    }
+
+private:
+
+    AbstractGeometry               *mGeometry;   //!< Owned, holds the primitives
+    std::vector<AbstractGeometry*> mPrimitives;  //!< Parts of mGeometry, in leaf order
+    std::vector<Node>              mNodes;       //!< Root first, when built
+    const Node                     *mNodeData;   //!< mNodes, or in mCacheFile
+    int                            mNodeCount;
+    MappedFile                     mCacheFile;   //!< When loaded from cache
+    bool                           mFromCache;
+    float                          mBuildCost;   //!< Of nodes after the last build
+    float                          mBuildTime;
+};
+
+#endif //__BVH_HXX__
@@ -30,6 +30,42 @@
 #include "math.hxx"
 #include "ray.hxx"
 
+// Camera samples of a run of pixels (or preview blocks) and their rays,
+// in structure of arrays layout for Camera::GenerateRays()
+class CameraRayBatch
+{
+public:
+
+    enum { kSize = 8 };
+
+    Ray GetRay(const int aIndex) const
+    {
+        Ray res;
+        res.org  = mOrigin;
+        res.dir  = Vec3f(mDirX[aIndex], mDirY[aIndex], mDirZ[aIndex]);
+        res.tmin = 0;
+        return res;
+    }
+
+    Vec2f GetSample(const int aIndex) const
+    {
+        return Vec2f(mRasterX[aIndex], mRasterY[aIndex]);
+    }
+
+public:
+
+    int   mCount;              //!< Valid entries, the rest are padding
+    Vec3f mOrigin;
+    Vec2i mBlockMin[kSize];
+    Vec2i mBlockSize[kSize];
+    float mRasterX[kSize];
+    float mRasterY[kSize];
+    float mDirX[kSize];
+    float mDirY[kSize];
+    float mDirZ[kSize];
+    float mPdfW[kSize];        //!< Solid angle pdf of a unit pixel area sample
+};
+
 class Camera
 {
 public:
@@ -45,9 +81,10 @@ public:
         const Vec3f up      = Normalize(Cross(aUp, -forward));
         const Vec3f left    = Cross(-forward, up);
 
-        mPosition   = aPosition;
-        mForward    = forward;
-        mResolution = aResolution;
+        mPosition      = aPosition;
+        mForward       = forward;
+        mResolution    = aResolution;
+        mHorizontalFOV = aHorizontalFOV;
 
         const Vec3f pos(
             Dot(up, aPosition),
@@ -73,18 +110,75 @@ public:
 
         const float tanHalfAngle = std::tan(aHorizontalFOV * PI_F / 360.f);
         mImagePlaneDist = aResolution.x / (2.f * tanHalfAngle);
+
+        // Directions to the image plane at mImagePlaneDist are affine in the
+        // raster position, batches step them by per-column and per-row deltas
+        mImagePlaneOrigin = ImagePlaneDir(Vec2f(0.f, 0.f));
+        mImagePlaneDx     = (ImagePlaneDir(Vec2f(aResolution.x, 0.f)) -
+            mImagePlaneOrigin) / Vec3f(aResolution.x);
+        mImagePlaneDy     = (ImagePlaneDir(Vec2f(0.f, aResolution.y)) -
+            mImagePlaneOrigin) / Vec3f(aResolution.y);
+
+        // By default the whole image is rendered
+        SetCropWindow(Vec2i(0, 0), Vec2i(int(aResolution.x), int(aResolution.y)));
+    }
+
+    // Restricts rendering to pixels [aMin, aMax), clamped to the image.
+    // Empty window resets it to the whole image.
+    void SetCropWindow(
+        const Vec2i &aMin,
+        const Vec2i &aMax)
+    {
+        const int resX = int(mResolution.x);
+        const int resY = int(mResolution.y);
+
+        mCropMin.x = std::max(0, std::min(aMin.x, resX));
+        mCropMin.y = std::max(0, std::min(aMin.y, resY));
+        mCropMax.x = std::max(0, std::min(aMax.x, resX));
+        mCropMax.y = std::max(0, std::min(aMax.y, resY));
+
+        if(mCropMin.x >= mCropMax.x || mCropMin.y >= mCropMax.y)
+        {
+            mCropMin = Vec2i(0, 0);
+            mCropMax = Vec2i(resX, resY);
+        }
     }
 
-    int RasterToIndex(const Vec2f &aPixelCoords) const
+    // Number of aBlockSize x aBlockSize pixel blocks covering the crop window
+    int CropBlockCount(const int aBlockSize) const
     {
-        return int(std::floor(aPixelCoords.x) + std::floor(aPixelCoords.y) * mResolution.x);
+        const int blocksX = (mCropMax.x - mCropMin.x + aBlockSize - 1) / aBlockSize;
+        const int blocksY = (mCropMax.y - mCropMin.y + aBlockSize - 1) / aBlockSize;
+        return blocksX * blocksY;
     }
 
-    Vec2f IndexToRaster(const int &aPixelIndex) const
+    // Maps block index within the crop window to the block's first pixel and
+    // its size. Blocks at the window border can be smaller than aBlockSize.
+    void CropIndexToBlock(
+        const int aBlockIndex,
+        const int aBlockSize,
+        Vec2i     &oBlockMin,
+        Vec2i     &oBlockSize) const
     {
-        const float y = std::floor(aPixelIndex / mResolution.x);
-        const float x = float(aPixelIndex) - y * mResolution.x;
-        return Vec2f(x, y);
+        const int blocksX = (mCropMax.x - mCropMin.x + aBlockSize - 1) / aBlockSize;
+
+        oBlockMin.x  = mCropMin.x + (aBlockIndex % blocksX) * aBlockSize;
+        oBlockMin.y  = mCropMin.y + (aBlockIndex / blocksX) * aBlockSize;
+        oBlockSize.x = std::min(aBlockSize, mCropMax.x - oBlockMin.x);
+        oBlockSize.y = std::min(aBlockSize, mCropMax.y - oBlockMin.y);
+    }
+
+    // Finds the block of the crop window that contains given raster position
+    void CropRasterToBlock(
+        const Vec2f &aRasterPos,
+        const int   aBlockSize,
+        Vec2i       &oBlockMin,
+        Vec2i       &oBlockSize) const
+    {
+        oBlockMin.x  = mCropMin.x + ((int(aRasterPos.x) - mCropMin.x) / aBlockSize) * aBlockSize;
+        oBlockMin.y  = mCropMin.y + ((int(aRasterPos.y) - mCropMin.y) / aBlockSize) * aBlockSize;
+        oBlockSize.x = std::min(aBlockSize, mCropMax.x - oBlockMin.x);
+        oBlockSize.y = std::min(aBlockSize, mCropMax.y - oBlockMin.y);
     }
 
     Vec3f RasterToWorld(const Vec2f &aRasterXY) const
@@ -105,6 +199,13 @@ public:
             aRasterPos.x < mResolution.x && aRasterPos.y < mResolution.y;
     }
 
+    // returns false when raster position is outside the crop window
+    bool CheckCrop(const Vec2f &aRasterPos) const
+    {
+        return aRasterPos.x >= mCropMin.x && aRasterPos.y >= mCropMin.y &&
+            aRasterPos.x < mCropMax.x && aRasterPos.y < mCropMax.y;
+    }
+
     Ray GenerateRay(const Vec2f &aRasterXY) const
     {
         const Vec3f worldRaster = RasterToWorld(aRasterXY);
@@ -116,14 +217,58 @@ public:
         return res;
     }
 
+    // Generates rays of all kSize raster positions of the batch, and their
+    // solid angle pdfs. A direction d through the image plane has length
+    // dist / cos, so the image area to solid angle factor dist^2 / cos^3
+    // is |d|^3 / dist. The fixed size loops are vectorized by the compiler.
+    void GenerateRays(CameraRayBatch &aoBatch) const
+    {
+        const float invPlaneDist = 1.f / mImagePlaneDist;
+        aoBatch.mOrigin = mPosition;
+
+        for(int i=0; i<CameraRayBatch::kSize; i++)
+        {
+            const float x = aoBatch.mRasterX[i];
+            const float y = aoBatch.mRasterY[i];
+
+            const float dx = mImagePlaneOrigin.x + x * mImagePlaneDx.x + y * mImagePlaneDy.x;
+            const float dy = mImagePlaneOrigin.y + x * mImagePlaneDx.y + y * mImagePlaneDy.y;
+            const float dz = mImagePlaneOrigin.z + x * mImagePlaneDx.z + y * mImagePlaneDy.z;
+
+            const float lenSqr = dx * dx + dy * dy + dz * dz;
+            const float len    = std::sqrt(lenSqr);
+            const float invLen = 1.f / len;
+
+            aoBatch.mDirX[i] = dx * invLen;
+            aoBatch.mDirY[i] = dy * invLen;
+            aoBatch.mDirZ[i] = dz * invLen;
+            aoBatch.mPdfW[i] = lenSqr * len * invPlaneDist;
+        }
+    }
+
+private:
+
+    // Direction through raster position, ending on the image plane
+    Vec3f ImagePlaneDir(const Vec2f &aRasterXY) const
+    {
+        const Vec3f dir = RasterToWorld(aRasterXY) - mPosition;
+        return dir * (mImagePlaneDist / Dot(mForward, dir));
+    }
+
 public:
 
     Vec3f mPosition;
     Vec3f mForward;
     Vec2f mResolution;
+    float mHorizontalFOV; //!< In degrees
     Mat4f mRasterToWorld;
     Mat4f mWorldToRaster;
     float mImagePlaneDist;
+    Vec2i mCropMin;  //!< First pixel of the crop window
+    Vec2i mCropMax;  //!< One past the last pixel of the crop window
+    Vec3f mImagePlaneOrigin; //!< Image plane direction of raster (0, 0)
+    Vec3f mImagePlaneDx;     //!< Image plane direction step per column
+    Vec3f mImagePlaneDy;     //!< Image plane direction step per row
 };
 
 #endif //__CAMERA_HXX__
\ No newline at end of file
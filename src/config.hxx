@@ -37,8 +37,10 @@
 #include "scene.hxx"
 #include "eyelight.hxx"
 #include "pathtracer.hxx"
+#include "wavefront.hxx"
 #include "bsdf.hxx"
 #include "vertexcm.hxx"
+#include "denoiser.hxx"
 #include "html_writer.hxx"
 
 #include <omp.h>
@@ -97,12 +99,31 @@ struct Config
     float       mRadiusFactor;
     float       mRadiusAlpha;
     Framebuffer *mFramebuffer;
+    FeatureBuffers *mFeatures; // when not NULL, features (AOVs) are gathered
     int         mNumThreads;
     int         mBaseSeed;
     uint        mMaxPathLength;
     uint        mMinPathLength;
     std::string mOutputName;
     Vec2i       mResolution;
+    Vec2i       mCropMin;    // crop window [mCropMin, mCropMax), empty is whole image
+    Vec2i       mCropMax;
+    int         mPreviewBlockSize; // > 1 renders coarse preview first, see render()
+    bool        mDenoise;    // run the denoiser on the rendered image
+    bool        mSaveAovs;   // save features and per-technique images
+    bool        mGuide;      // guide camera sub-paths by learned radiance
+    bool        mAdaptEmission; // emit light sub-paths where they contribute
+    bool        mAdaptRadius;   // per-pixel merging radius
+    int         mCameraPaths;   // camera paths per pixel per light pass
+    bool        mWavefront;     // path tracing advances a pool of paths by stages
+    bool        mSortMerges;    // merging deferred and sorted by grid cell
+    std::string mTextureFile;   // .pfm texture of the floor, empty is none
+    int         mTextureCacheMB; // memory budget of the texture tile cache
+    std::string mMeshFile;      // .obj mesh added to the scene, empty is none
+    std::string mAccelCacheDir; // directory keeping built BVHs, empty is none
+    int         mFrames;        // > 0 renders an animation of the mesh
+    std::string mKeyframesFile; // animation of mesh and camera, empty is a twist
+    bool        mAutoAlgorithm; // algorithm picked by pilot renders (-a auto)
     bool        mFullReport; // ignore scene and algorithm and do html report instead
 };
 
@@ -118,21 +139,26 @@ AbstractRenderer* CreateRenderer(
     case Config::kEyeLight:
         return new EyeLight(scene, aSeed);
     case Config::kPathTracing:
+        if(aConfig.mWavefront)
+            return new WavefrontPathTracer(scene, aSeed);
         return new PathTracer(scene, aSeed);
     case Config::kLightTracing:
-        return new VertexCM(scene, VertexCM::kLightTrace,
+        return new VertexCM<kLightTrace>(scene,
             aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
     case Config::kProgressivePhotonMapping:
-        return new VertexCM(scene, VertexCM::kPpm,
+        if(!PpmSupportsScene(scene))
+            return new VertexCM<kBpm>(scene,
+                aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
+        return new VertexCM<kPpm>(scene,
             aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
     case Config::kBidirectionalPhotonMapping:
-        return new VertexCM(scene, VertexCM::kBpm,
+        return new VertexCM<kBpm>(scene,
             aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
     case Config::kBidirectionalPathTracing:
-        return new VertexCM(scene, VertexCM::kBpt,
+        return new VertexCM<kBpt>(scene,
             aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
     case Config::kVertexConnectionMerging:
-        return new VertexCM(scene, VertexCM::kVcm,
+        return new VertexCM<kVcm>(scene,
             aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
     default:
         printf("Unknown algorithm!!\n");
@@ -151,7 +177,7 @@ uint g_SceneConfigs[] = {
 std::string DefaultFilename(
     const uint              aSceneConfig,
     const Scene             &aScene,
-    const Config::Algorithm aAlgorithm)
+    const char              *aAlgorithmAcronym)
 {
     std::string filename;
     // if scene has glossy floor, name will be prefixed by g
@@ -163,7 +189,7 @@ std::string DefaultFilename(
 
     // We add acronym of the used algorithm
     filename += "_";
-    filename += Config::GetAcronym(aAlgorithm);
+    filename += aAlgorithmAcronym;
 
     // And it will be written as bmp
     filename += ".bmp";
@@ -194,7 +220,14 @@ void PrintHelp(const char *argv[])
 {
     printf("\n");
     printf("Usage: %s [ -s <scene_id> | -a <algorithm> |\n", argv[0]);
-    printf("           -t <time> | -i <iteration> | -o <output_name> | --report ]\n\n");
+    printf("           -t <time> | -i <iteration> | -o <output_name> |\n");
+    printf("           --crop <x0> <y0> <x1> <y1> | --preview <block_size> |\n");
+    printf("           --denoise | --aov | --guide | --adapt-emission |\n");
+    printf("           --adapt-radius | --camera-paths <count> | --wavefront |\n");
+    printf("           --sort-merges | --texture <file.pfm> |\n");
+    printf("           --texture-cache <MB> | --mesh <file.obj> |\n");
+    printf("           --accel-cache <dir> | --frames <count> |\n");
+    printf("           --keyframes <file> | --report ]\n\n");
     printf("    -s  Selects the scene (default 0):\n");
 
     for(int i = 0; i < SizeOfArray(g_SceneConfigs); i++)
@@ -207,9 +240,79 @@ void PrintHelp(const char *argv[])
             Config::GetAcronym(Config::Algorithm(i)),
             Config::GetName(Config::Algorithm(i)));
 
+    printf("          auto picks the one of pt, bpt, bpm, and vcm with least predicted error,\n");
+    printf("               from noise, missing light, and speed in short pilot renders\n");
+    printf("               of the image middle, taking a tenth of -t (2 iterations with -i).\n");
+    printf("               With -i, it runs as many iterations as fit in the time of\n");
+    printf("               that many of pt\n");
     printf("    -t  Number of seconds to run the algorithm\n");
     printf("    -i  Number of iterations to run the algorithm (default 1)\n");
     printf("    -o  User specified output name, with extension .bmp or .hdr (default .bmp)\n");
+    printf("    --crop\n");
+    printf("        Renders only pixels x0 <= x < x1, y0 <= y < y1 (default whole image).\n");
+    printf("        Light paths are still splatted into the window, the rest stays black.\n");
+    printf("    --preview\n");
+    printf("        First renders quick iterations with one path per block_size^2 pixels,\n");
+    printf("        halving the block size down to 2, and saves them as <output_name>_preview.\n");
+    printf("        These iterations are not used in the final image.\n");
+    printf("    --denoise\n");
+    printf("        Filters the result with an edge-aware denoiser guided by albedo, normal,\n");
+    printf("        and depth. The unfiltered image is saved as <output_name>_noisy.\n");
+    printf("    --aov\n");
+    printf("        Also saves output variables as .pfm files next to the image: albedo,\n");
+    printf("        normal, depth, and material ID (+1) at the first non-specular camera hit,\n");
+    printf("        and the image split by technique: direct (camera path hits or samples\n");
+    printf("        light), vc (vertex connection and light tracing), vm (vertex merging).\n");
+    printf("    --guide\n");
+    printf("        Guides camera sub-paths (pt, bpm, bpt, vcm) by incident radiance learned\n");
+    printf("        during the first 31 iterations (SD-tree), mixed with BSDF sampling.\n");
+    printf("        Each thread learns on its own.\n");
+    printf("    --adapt-emission\n");
+    printf("        Emits light sub-paths (lt, ppm, bpm, bpt, vcm) from the light positions\n");
+    printf("        and directions that contributed to the image in previous iterations.\n");
+    printf("        Each thread learns on its own.\n");
+    printf("    --adapt-radius\n");
+    printf("        Merging (ppm, bpm, vcm) uses a radius per pixel, shrinking with the light\n");
+    printf("        vertices found there as in stochastic progressive photon mapping.\n");
+    printf("    --camera-paths\n");
+    printf("        Each iteration traces count camera paths per pixel (ppm, bpm, bpt, vcm)\n");
+    printf("        against the same light sub-paths, sharing their cost (default 1).\n");
+    printf("    --wavefront\n");
+    printf("        Path tracing (pt) advances a pool of paths one bounce at a time, by stages\n");
+    printf("        over queues: extend, shade sorted by material, shadow, scatter, accumulate.\n");
+    printf("        Extend and shadow test each object of the scene against 64 rays at once.\n");
+    printf("    --sort-merges\n");
+    printf("        Merging (ppm, bpm, vcm) is deferred: camera vertices are queued, sorted\n");
+    printf("        by grid cell in Morton order, and merged in batches for coherent access.\n");
+    printf("    --texture\n");
+    printf("        Textures the floor with a little-endian .pfm image, planar mapped. Tiles of\n");
+    printf("        its mip-map levels are loaded from the file on demand.\n");
+    printf("    --texture-cache\n");
+    printf("        Memory budget of the texture tile cache in megabytes (default 256),\n");
+    printf("        tiles not used since a clock hand last passed them (second chance) are\n");
+    printf("        evicted when it is full.\n");
+    printf("    --mesh\n");
+    printf("        Adds a Wavefront .obj mesh standing on the back of the floor. Triangles are\n");
+    printf("        written to <file.obj>.pages in page-sized blocks of nearby triangles, and\n");
+    printf("        the file is mapped, so only pages that rays reach are in memory.\n");
+    printf("    --accel-cache\n");
+    printf("        Saves the BVH built over large scenes (as with --mesh) into dir, named by\n");
+    printf("        a hash of the geometry, and the --mesh paging file, named by a hash of\n");
+    printf("        the .obj. Later runs with the same geometry map the files instead of\n");
+    printf("        building them. Also used by --report.\n");
+    printf("    --frames\n");
+    printf("        Renders count frames of an animation, saved as <output_name>_<frame>. By\n");
+    printf("        default the --mesh twists about its vertical axis up to half a turn. The\n");
+    printf("        BVH is refit to every frame, and built again only when that made it a\n");
+    printf("        third slower (by SAH).\n");
+    printf("    --keyframes\n");
+    printf("        Animates --frames by the keys in file instead, one per line (time from 0\n");
+    printf("        at the first frame to 1 at the last, angles in degrees, '#' comments):\n");
+    printf("          mesh   <time> <move x y z> <angle> <scale> <twist>\n");
+    printf("          camera <time> <position x y z> <target x y z>\n");
+    printf("        The mesh turns about its vertical axis, by twist more at its top, scales\n");
+    printf("        about its bottom and moves. Poses are interpolated linearly between keys,\n");
+    printf("        what has no keys stays as loaded.\n");
     printf("    --report\n");
     printf("        Renders all scenes using all algorithms and generates an index.html file\n");
     printf("        that displays all images. Obeys the -t and -i options, ignores the rest.\n");
@@ -233,6 +336,24 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
     oConfig.mMaxPathLength = 10;
     oConfig.mMinPathLength = 0;
     oConfig.mResolution    = Vec2i(512, 512);
+    oConfig.mCropMin       = Vec2i(0, 0);           // [cmd]
+    oConfig.mCropMax       = Vec2i(0, 0);           // [cmd]
+    oConfig.mPreviewBlockSize = 0;                  // [cmd]
+    oConfig.mDenoise       = false;                 // [cmd]
+    oConfig.mSaveAovs      = false;                 // [cmd]
+    oConfig.mGuide         = false;                 // [cmd]
+    oConfig.mAdaptEmission = false;                 // [cmd]
+    oConfig.mAdaptRadius   = false;                 // [cmd]
+    oConfig.mCameraPaths   = 1;                     // [cmd]
+    oConfig.mWavefront     = false;                 // [cmd]
+    oConfig.mSortMerges    = false;                 // [cmd]
+    oConfig.mTextureFile   = "";                    // [cmd]
+    oConfig.mTextureCacheMB = 256;                  // [cmd]
+    oConfig.mMeshFile      = "";                    // [cmd]
+    oConfig.mAccelCacheDir = "";                    // [cmd]
+    oConfig.mFrames        = 0;                     // [cmd]
+    oConfig.mKeyframesFile = "";                    // [cmd]
+    oConfig.mAutoAlgorithm = false;                 // [cmd]
     oConfig.mFullReport    = false;
     oConfig.mRadiusFactor  = 0.003f;
     oConfig.mRadiusAlpha   = 0.75f;
@@ -260,6 +381,164 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
         {
             oConfig.mFullReport = true;
         }
+        else if(arg == "--denoise")
+        {
+            oConfig.mDenoise = true;
+        }
+        else if(arg == "--aov")
+        {
+            oConfig.mSaveAovs = true;
+        }
+        else if(arg == "--guide")
+        {
+            oConfig.mGuide = true;
+        }
+        else if(arg == "--adapt-emission")
+        {
+            oConfig.mAdaptEmission = true;
+        }
+        else if(arg == "--adapt-radius")
+        {
+            oConfig.mAdaptRadius = true;
+        }
+        else if(arg == "--wavefront")
+        {
+            oConfig.mWavefront = true;
+        }
+        else if(arg == "--sort-merges")
+        {
+            oConfig.mSortMerges = true;
+        }
+        else if(arg == "--texture") // floor texture
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file.pfm> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mTextureFile = argv[i];
+        }
+        else if(arg == "--texture-cache") // texture cache budget
+        {
+            if(++i == argc)
+            {
+                printf("Missing <MB> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mTextureCacheMB;
+
+            if(iss.fail() || oConfig.mTextureCacheMB < 1)
+            {
+                printf("Invalid <MB> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--mesh") // mesh to add
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file.obj> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mMeshFile = argv[i];
+        }
+        else if(arg == "--accel-cache") // BVH cache directory
+        {
+            if(++i == argc)
+            {
+                printf("Missing <dir> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mAccelCacheDir = argv[i];
+        }
+        else if(arg == "--frames") // animation
+        {
+            if(++i == argc)
+            {
+                printf("Missing <count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mFrames;
+
+            if(iss.fail() || oConfig.mFrames < 1)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--keyframes") // animation keys
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mKeyframesFile = argv[i];
+        }
+        else if(arg == "--crop") // crop window
+        {
+            if(i + 4 >= argc)
+            {
+                printf("Missing <x0> <y0> <x1> <y1> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(std::string(argv[i+1]) + " " + argv[i+2] + " " +
+                argv[i+3] + " " + argv[i+4]);
+            iss >> oConfig.mCropMin.x >> oConfig.mCropMin.y
+                >> oConfig.mCropMax.x >> oConfig.mCropMax.y;
+            i += 4;
+
+            if(iss.fail() ||
+               oConfig.mCropMin.x < 0 || oConfig.mCropMin.x >= oConfig.mCropMax.x ||
+               oConfig.mCropMin.y < 0 || oConfig.mCropMin.y >= oConfig.mCropMax.y)
+            {
+                printf("Invalid <x0> <y0> <x1> <y1> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--preview") // progressive preview
+        {
+            if(++i == argc)
+            {
+                printf("Missing <block_size> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mPreviewBlockSize;
+
+            if(iss.fail() || oConfig.mPreviewBlockSize < 2)
+            {
+                printf("Invalid <block_size> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--camera-paths") // camera paths per pixel
+        {
+            if(++i == argc)
+            {
+                printf("Missing <count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mCameraPaths;
+
+            if(iss.fail() || oConfig.mCameraPaths < 1)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return;
+            }
+        }
         else if(arg == "-s") // scene to load
         {
             if(++i == argc)
@@ -286,6 +565,10 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
             }
 
             std::string alg(argv[i]);
+            oConfig.mAutoAlgorithm = (alg == "auto");
+            oConfig.mAlgorithm     = oConfig.mAutoAlgorithm ?
+                Config::kVertexConnectionMerging : Config::kAlgorithmMax;
+
             for(int i=0; i<Config::kAlgorithmMax; i++)
                 if(alg == Config::GetAcronym(Config::Algorithm(i)))
                     oConfig.mAlgorithm = Config::Algorithm(i);
@@ -360,10 +643,64 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
         oConfig.mAlgorithm = Config::kVertexConnectionMerging;
     }
 
+    if(oConfig.mFrames > 0 && oConfig.mMeshFile.length() == 0 &&
+       oConfig.mKeyframesFile.length() == 0)
+    {
+        printf("Animation (--frames) moves the mesh, please add --mesh or --keyframes\n");
+        return;
+    }
+
+    if(oConfig.mKeyframesFile.length() > 0 && oConfig.mFrames == 0)
+    {
+        printf("Keyframes (--keyframes) are of an animation, please add --frames\n");
+        return;
+    }
+
+    // Crop window must overlap the image, it would render all of it otherwise
+    const bool hasCrop = oConfig.mCropMax.x > 0 || oConfig.mCropMax.y > 0;
+    if(hasCrop && (oConfig.mCropMin.x >= oConfig.mResolution.x ||
+                   oConfig.mCropMin.y >= oConfig.mResolution.y))
+    {
+        printf("Invalid <x0> <y0> <x1> <y1> argument, please see help (-h)\n");
+        return;
+    }
+
     // Load scene
     Scene *scene = new Scene;
     scene->LoadCornellBox(oConfig.mResolution, g_SceneConfigs[sceneID]);
+
+    if(oConfig.mMeshFile.length() > 0 && !scene->LoadMesh(
+        oConfig.mMeshFile.c_str(), oConfig.mAccelCacheDir))
+    {
+        delete scene;
+        return;
+    }
+
+    scene->BuildAccelerator(oConfig.mAccelCacheDir);
     scene->BuildSceneSphere();
+    scene->mCamera.SetCropWindow(oConfig.mCropMin, oConfig.mCropMax);
+
+    if(oConfig.mKeyframesFile.length() > 0 &&
+       !scene->mKeyframes.Load(oConfig.mKeyframesFile.c_str()))
+    {
+        delete scene;
+        return;
+    }
+
+    if(oConfig.mTextureFile.length() > 0)
+    {
+        scene->mTextureCache.SetBudget(size_t(oConfig.mTextureCacheMB) << 20);
+        const int texture =
+            scene->mTextureCache.AddTexture(oConfig.mTextureFile.c_str());
+
+        if(texture < 0)
+        {
+            delete scene;
+            return;
+        }
+
+        scene->SetFloorTexture(texture);
+    }
 
     oConfig.mScene = scene;
 
@@ -371,7 +708,8 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
     if(oConfig.mOutputName.length() == 0)
     {
         oConfig.mOutputName = DefaultFilename(g_SceneConfigs[sceneID],
-            *oConfig.mScene, oConfig.mAlgorithm);
+            *oConfig.mScene, oConfig.mAutoAlgorithm ? "auto" :
+            Config::GetAcronym(oConfig.mAlgorithm));
     }
 
     // Check if output name has valid extension (.bmp or .hdr) and if not add .bmp
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __DENOISER_HXX__
+#define __DENOISER_HXX__
+
+#include <vector>
+#include <cmath>
+#include <omp.h>
+#include "math.hxx"
+#include "utils.hxx"
+#include "framebuffer.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Edge-avoiding a-trous wavelet denoiser, as described in
+//
+//   "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering"
+//   Holger Dammertz, Daniel Sewtz, Johannes Hanika, Hendrik P.A. Lensch
+//   High Performance Graphics 2010
+//
+// Every pass filters the image with a 5x5 B3 spline kernel, with taps spaced
+// 2^pass pixels apart, so a few passes cover a large footprint at a small
+// cost. Each tap is weighted down when its color, albedo, normal, or depth
+// differs from the center pixel, which keeps the edges the features see.
+// The feature buffers are gathered by the renderers (see FeatureBuffers).
+//
+// The color weights would also keep isolated fireflies intact, therefore
+// pixels much brighter than all their neighbours are clamped beforehand.
+
+class Denoiser
+{
+public:
+
+    Denoiser()
+    {
+        mPasses      = 5;
+        mSigmaColor  = 0.5f;
+        mSigmaAlbedo = 0.1f;
+        mSigmaNormal = 0.3f;
+        mSigmaDepth  = 0.05f;
+        mFireflyRatio = 4.f;
+    }
+
+    // Denoises the image in place. Rows are filtered in parallel.
+    void Denoise(
+        Framebuffer          &aoColor,
+        const FeatureBuffers &aFeatures) const
+    {
+        Framebuffer filtered = aoColor;
+        float sigmaColor = mSigmaColor;
+
+        RemoveFireflies(aoColor, filtered);
+        std::swap(aoColor, filtered);
+
+        for(int pass = 0; pass < mPasses; pass++)
+        {
+            FilterPass(aoColor, aFeatures, 1 << pass, sigmaColor, filtered);
+            std::swap(aoColor, filtered);
+
+            // Each pass removes noise, so the color can be trusted more
+            sigmaColor *= 0.5f;
+        }
+    }
+
+private:
+
+    void FilterPass(
+        const Framebuffer    &aInput,
+        const FeatureBuffers &aFeatures,
+        const int            aStep,
+        const float          aSigmaColor,
+        Framebuffer          &oOutput) const
+    {
+        // B3 spline, indexed by distance from the center tap
+        static const float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+        const int resX = aInput.GetResX();
+        const int resY = aInput.GetResY();
+
+        const float invSigmaColor2  = 1.f / Sqr(aSigmaColor);
+        const float invSigmaAlbedo2 = 1.f / Sqr(mSigmaAlbedo);
+        const float invSigmaNormal2 = 1.f / Sqr(mSigmaNormal);
+        // Depth changes with the distance of the taps on slanted surfaces
+        const float invSigmaDepth2  = 1.f / Sqr(mSigmaDepth * aStep);
+
+#pragma omp parallel for
+        for(int y = 0; y < resY; y++)
+        {
+            for(int x = 0; x < resX; x++)
+            {
+                const Vec3f centerColor  = ToneMap(aInput.GetColor(x, y));
+                const Vec3f centerAlbedo = aFeatures.mAlbedo.GetColor(x, y);
+                const Vec3f centerNormal = aFeatures.mNormal.GetColor(x, y);
+                const float centerDepth  = aFeatures.mDepth.GetColor(x, y).x;
+                // Relative depth difference, background has zero depth
+                const float invDepth     = 1.f / std::max(centerDepth, 1e-4f);
+
+                Vec3f colorSum(0);
+                float weightSum = 0;
+
+                for(int j = -2; j <= 2; j++)
+                {
+                    const int qy = y + j * aStep;
+                    if(qy < 0 || qy >= resY)
+                        continue;
+
+                    for(int i = -2; i <= 2; i++)
+                    {
+                        const int qx = x + i * aStep;
+                        if(qx < 0 || qx >= resX)
+                            continue;
+
+                        const Vec3f &color = aInput.GetColor(qx, qy);
+
+                        const float distColor  =
+                            (ToneMap(color) - centerColor).LenSqr();
+                        const float distAlbedo =
+                            (aFeatures.mAlbedo.GetColor(qx, qy) - centerAlbedo).LenSqr();
+                        const float distNormal =
+                            (aFeatures.mNormal.GetColor(qx, qy) - centerNormal).LenSqr();
+                        const float distDepth  =
+                            Sqr((aFeatures.mDepth.GetColor(qx, qy).x - centerDepth) * invDepth);
+
+                        const float weight = kernel[std::abs(i)] * kernel[std::abs(j)] *
+                            std::exp(-(distColor  * invSigmaColor2  +
+                                       distAlbedo * invSigmaAlbedo2 +
+                                       distNormal * invSigmaNormal2 +
+                                       distDepth  * invSigmaDepth2));
+
+                        colorSum  += Vec3f(weight) * color;
+                        weightSum += weight;
+                    }
+                }
+
+                // The center tap always has non-zero weight
+                oOutput.GetColor(x, y) = colorSum / Vec3f(weightSum);
+            }
+        }
+    }
+
+    // Scales down pixels whose luminance exceeds mFireflyRatio times
+    // the luminance of their brightest neighbour
+    void RemoveFireflies(
+        const Framebuffer &aInput,
+        Framebuffer       &oOutput) const
+    {
+        const int resX = aInput.GetResX();
+        const int resY = aInput.GetResY();
+
+#pragma omp parallel for
+        for(int y = 0; y < resY; y++)
+        {
+            for(int x = 0; x < resX; x++)
+            {
+                const Vec3f &color = aInput.GetColor(x, y);
+                const float lum    = Luminance(color);
+
+                float maxLum = 0;
+                for(int qy = std::max(y-1, 0); qy <= std::min(y+1, resY-1); qy++)
+                    for(int qx = std::max(x-1, 0); qx <= std::min(x+1, resX-1); qx++)
+                        if(qx != x || qy != y)
+                            maxLum = std::max(maxLum, Luminance(aInput.GetColor(qx, qy)));
+
+                const float limit = mFireflyRatio * maxLum;
+                oOutput.GetColor(x, y) = (lum > limit) ?
+                    color * Vec3f(limit / lum) : color;
+            }
+        }
+    }
+
+    // Compresses high dynamic range, so that a few bright samples
+    // do not dominate the color distance
+    static Vec3f ToneMap(const Vec3f &aColor)
+    {
+        return aColor / Vec3f(1.f + Luminance(aColor));
+    }
+
+public:
+
+    int   mPasses;      //!< Number of a-trous passes, footprint is 2^(mPasses+2)
+    float mSigmaColor;  //!< Color tolerance of the first pass, halved every pass
+    float mSigmaAlbedo; //!< Albedo tolerance
+    float mSigmaNormal; //!< Normal tolerance
+    float mSigmaDepth;  //!< Relative depth tolerance per pixel of tap distance
+    float mFireflyRatio; //!< Max luminance ratio of a pixel to its brightest neighbour
+};
+
+#endif //__DENOISER_HXX__
@@ -44,20 +44,25 @@ public:
 
     virtual void RunIteration(int aIteration)
     {
-        const int resX = int(mScene.mCamera.mResolution.x);
-        const int resY = int(mScene.mCamera.mResolution.y);
+        // Only pixels within the crop window are traced,
+        // in preview iterations one ray per block of pixels
+        const int pixelCount = mScene.mCamera.CropBlockCount(mBlockSize);
+        CameraRayBatch cameraRays;
 
-        for(int pixID = 0; pixID < resX * resY; pixID++)
+        for(int pixID = 0; pixID < pixelCount; pixID++)
         {
             //////////////////////////////////////////////////////////////////////////
-            // Generate ray
-            const int x = pixID % resX;
-            const int y = pixID / resX;
+            // Generate ray, a batch at a time
+            const int batchIdx = pixID % CameraRayBatch::kSize;
+            if(batchIdx == 0)
+                GenerateCameraBatch(pixID, pixelCount, 1, aIteration == 1,
+                    mRng, cameraRays);
 
-            const Vec2f sample = Vec2f(float(x), float(y)) +
-                (aIteration == 1 ? Vec2f(0.5f) : mRng.GetVec2f());
+            const Vec2i &blockMin  = cameraRays.mBlockMin[batchIdx];
+            const Vec2i &blockSize = cameraRays.mBlockSize[batchIdx];
+            const Vec2f sample     = cameraRays.GetSample(batchIdx);
 
-            Ray   ray = mScene.mCamera.GenerateRay(sample);
+            Ray   ray = cameraRays.GetRay(batchIdx);
             Isect isect;
             isect.dist = 1e36f;
 
@@ -66,9 +71,9 @@ public:
                 float dotLN = Dot(isect.normal, -ray.dir);
 
                 if(dotLN > 0)
-                    mFramebuffer.AddColor(sample, Vec3f(dotLN));
+                    AddSampleColor(blockMin, blockSize, sample, Vec3f(dotLN));
                 else
-                    mFramebuffer.AddColor(sample, Vec3f(-dotLN, 0, 0));
+                    AddSampleColor(blockMin, blockSize, sample, Vec3f(-dotLN, 0, 0));
             }
         }
 
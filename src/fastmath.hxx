@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __FASTMATH_HXX__
+#define __FASTMATH_HXX__
+
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Fast math approximations
+//
+// Polynomial replacements of std::sin/cos, std::exp/log and std::pow for
+// the samplers. They have no branches and no table lookups, so loops
+// calling them over arrays are vectorized by the compiler (SSE or AVX, as
+// the target allows), see the batch versions below and in utils.hxx.
+// The stated maximum errors were measured against the std versions
+// in double precision, tests/fastmath_test.cxx checks them (make test).
+
+// Bit casts between float and its integer representation
+inline int FloatAsInt(const float aValue)
+{
+    int bits;
+    memcpy(&bits, &aValue, sizeof(bits));
+    return bits;
+}
+
+inline float IntAsFloat(const int aValue)
+{
+    float value;
+    memcpy(&value, &aValue, sizeof(value));
+    return value;
+}
+
+// Returns aTrue or aFalse by masking their bits. Conditionals choosing
+// between computed floats stay branches, which stop loop vectorization.
+inline float SelectFloat(
+    const bool  aCondition,
+    const float aTrue,
+    const float aFalse)
+{
+    const int mask = -int(aCondition);
+    return IntAsFloat((FloatAsInt(aTrue) & mask) | (FloatAsInt(aFalse) & ~mask));
+}
+
+// Sine and cosine for |aX| < 8192. Reduces the argument to an octant by
+// a three part Cody-Waite subtraction of multiples of PI/4, then uses the
+// minimax polynomials of Cephes. Max absolute error 8e-8 for |aX| < 64.
+inline void FastSinCos(
+    const float aX,
+    float       &oSin,
+    float       &oCos)
+{
+    const float absX = std::abs(aX);
+
+    // Even octant index, the reduced argument is in [-PI/4, PI/4]
+    const int   octant = (int(absX * (4.f / PI_F)) + 1) & ~1;
+    const float y      = float(octant);
+    const float x      = ((absX - y * 0.78515625f) - y * 2.4187564849853515625e-4f) -
+        y * 3.77489497744594108e-8f;
+    const float z      = x * x;
+
+    const float s = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z -
+        1.6666654611e-1f) * z * x + x;
+    const float c = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z +
+        4.166664568298827e-2f) * z * z - 0.5f * z + 1.f;
+
+    // Octants 2 and 6 swap the polynomials, the sign of each result
+    // flips in two of the four even octants
+    const bool  swap    = (octant & 2) != 0;
+    const float sinSign = ((octant & 4) != 0) != (aX < 0.f) ? -1.f : 1.f;
+    const float cosSign = ((octant + 2) & 4) != 0 ? -1.f : 1.f;
+
+    oSin = sinSign * SelectFloat(swap, c, s);
+    oCos = cosSign * SelectFloat(swap, s, c);
+}
+
+// Base 2 logarithm of normal positive numbers, -126 for zero. The mantissa
+// is brought to [sqrt(1/2), sqrt(2)), where ln(m) = 2 atanh((m-1)/(m+1))
+// converges fast. Max error 1.4e-7, absolute for |result| <= 1 and
+// relative above.
+inline float FastLog2(const float aX)
+{
+    // Clamped to the smallest normal in the integer domain, which orders
+    // like the floats for positive values
+    const int   bits  = std::max(FloatAsInt(aX), 0x00800000);
+    const float small = IntAsFloat((bits & 0x007fffff) | 0x3f800000);
+    const bool  halve = small > 1.41421356f;
+    const float m     = SelectFloat(halve, small * 0.5f, small);
+    const float e     = float(((bits >> 23) & 0xff) - 127 + (halve ? 1 : 0));
+
+    const float t  = (m - 1.f) / (m + 1.f);
+    const float t2 = t * t;
+    const float lnM = 2.f * t * (1.f + t2 * (1.f / 3.f + t2 * (1.f / 5.f +
+        t2 * (1.f / 7.f + t2 * (1.f / 9.f)))));
+
+    return e + lnM * 1.44269504f;
+}
+
+// exp(aG) for |aG| <= ln(2)/2, degree 7 Taylor polynomial
+inline float ExpPolynomial(const float aG)
+{
+    return 1.f + aG * (1.f + aG * (1.f / 2.f + aG * (1.f / 6.f +
+        aG * (1.f / 24.f + aG * (1.f / 120.f + aG * (1.f / 720.f +
+        aG * (1.f / 5040.f)))))));
+}
+
+// 2 to the power aX, flushes to zero below -126 and clamps above 127.49
+// (to 2.4e38). Splits off the nearest integer, which goes to the exponent
+// bits, and evaluates the rest with ExpPolynomial. Max relative error 1e-7.
+inline float FastExp2(const float aX)
+{
+    // Clamped by selects, std::min and std::max get branches here. Above
+    // 127.5 the nearest integer would be 128, an infinite exponent.
+    const float x = SelectFloat(aX < -127.f, -127.f,
+        SelectFloat(aX > 127.49f, 127.49f, aX));
+
+    // Rounds to nearest, the shifted value is positive so truncation floors
+    const int   i = int(x + 127.5f) - 127;
+    const float g = (x - float(i)) * 0.693147181f;
+
+    // The clamp leaves zero exponent bits, i.e. zero, for i = -127
+    return ExpPolynomial(g) * IntAsFloat((i + 127) << 23);
+}
+
+// e to the power aX, flushes to zero below -87.3 and clamps above 88.37,
+// as FastExp2. The remainder is taken from aX itself by subtracting i ln(2)
+// in two parts (the first exact), so that rounding aX / ln(2) does not
+// grow the error with |aX|. Max relative error 1.1e-7.
+inline float FastExp(const float aX)
+{
+    const float x = SelectFloat(aX < -88.03f, -88.03f,
+        SelectFloat(aX > 88.37f, 88.37f, aX));
+
+    const int   i = int(x * 1.44269504f + 127.5f) - 127;
+    const float g = (x - float(i) * 0.693359375f) + float(i) * 2.12194440e-4f;
+
+    return ExpPolynomial(g) * IntAsFloat((i + 127) << 23);
+}
+
+// Max error 1.5e-7, absolute for |result| <= 1 and relative above
+inline float FastLog(const float aX)
+{
+    return FastLog2(aX) * 0.693147181f;
+}
+
+// aX to the power aY for aX >= 0, aY > 0. The relative error is that
+// of FastExp2 plus about 1e-7 * |aY log2(aX)|, from the logarithm. Max
+// relative error 1.5e-6 where |aY log2(aX)| < 8.
+inline float FastPow(
+    const float aX,
+    const float aY)
+{
+    return SelectFloat(aX > 0.f, FastExp2(aY * FastLog2(aX)), 0.f);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Batch versions, over arrays of aCount values
+
+void FastSinCos(
+    const float *aX,
+    float       *oSin,
+    float       *oCos,
+    const int   aCount)
+{
+    for(int i=0; i<aCount; i++)
+        FastSinCos(aX[i], oSin[i], oCos[i]);
+}
+
+void FastExp(
+    const float *aX,
+    float       *oExp,
+    const int   aCount)
+{
+    for(int i=0; i<aCount; i++)
+        oExp[i] = FastExp(aX[i]);
+}
+
+void FastLog(
+    const float *aX,
+    float       *oLog,
+    const int   aCount)
+{
+    for(int i=0; i<aCount; i++)
+        oLog[i] = FastLog(aX[i]);
+}
+
+void FastPow(
+    const float *aX,
+    const float aY,
+    float       *oPow,
+    const int   aCount)
+{
+    for(int i=0; i<aCount; i++)
+        oPow[i] = FastPow(aX[i], aY);
+}
+
+#endif //__FASTMATH_HXX__
@@ -56,6 +56,37 @@ public:
         mColor[x + y * mResX] = mColor[x + y * mResX] + aColor;
     }
 
+    // Overwrites the color, for values that must not be averaged
+    void SetColor(
+        const Vec2f& aSample,
+        const Vec3f& aColor)
+    {
+        if(aSample.x < 0 || aSample.x >= mResolution.x)
+            return;
+
+        if(aSample.y < 0 || aSample.y >= mResolution.y)
+            return;
+
+        int x = int(aSample.x);
+        int y = int(aSample.y);
+
+        mColor[x + y * mResX] = aColor;
+    }
+
+    // Adds the color to all pixels of a block, used for coarse previews
+    void AddColorBlock(
+        const Vec2i& aBlockMin,
+        const Vec2i& aBlockSize,
+        const Vec3f& aColor)
+    {
+        const int maxX = std::min(aBlockMin.x + aBlockSize.x, mResX);
+        const int maxY = std::min(aBlockMin.y + aBlockSize.y, mResY);
+
+        for(int y = std::max(aBlockMin.y, 0); y < maxY; y++)
+            for(int x = std::max(aBlockMin.x, 0); x < maxX; x++)
+                mColor[x + y * mResX] = mColor[x + y * mResX] + aColor;
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Methods for framebuffer operations
     void Setup(const Vec2f& aResolution)
@@ -84,6 +115,14 @@ public:
             mColor[i] = mColor[i] * Vec3f(aScale);
     }
 
+    //////////////////////////////////////////////////////////////////////////
+    // Pixel access
+    int GetResX() const { return mResX; }
+    int GetResY() const { return mResY; }
+
+    const Vec3f& GetColor(int aX, int aY) const { return mColor[aX + aY * mResX]; }
+    Vec3f&       GetColor(int aX, int aY)       { return mColor[aX + aY * mResX]; }
+
     //////////////////////////////////////////////////////////////////////////
     // Statistics
     float TotalLuminance()
@@ -141,8 +180,12 @@ public:
         ppm << mResX << " " << mResY << std::endl;
         ppm << "-1" << std::endl;
 
-        ppm.write(reinterpret_cast<const char*>(&mColor[0]),
-            mColor.size() * sizeof(Vec3f));
+        // pfm is stored from bottom up
+        for(int y=mResY-1; y>=0; y--)
+        {
+            ppm.write(reinterpret_cast<const char*>(&mColor[y*mResX]),
+                mResX * sizeof(Vec3f));
+        }
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -258,4 +301,83 @@ private:
     int                mResY;
 };
 
+//////////////////////////////////////////////////////////////////////////
+// Auxiliary per-pixel output variables (AOVs). Surface features are
+// recorded at the first non-specular camera hit, and are averaged over
+// samples in the same way as the color. They guide the edge-aware denoiser
+// (see denoiser.hxx) and can be saved for compositing.
+//
+// The per-technique buffers split the final color by the technique that
+// computed it, so they sum up to the rendered image.
+class FeatureBuffers
+{
+public:
+
+    void Setup(const Vec2f& aResolution)
+    {
+        mAlbedo.Setup(aResolution);
+        mNormal.Setup(aResolution);
+        mDepth.Setup(aResolution);
+        mMaterialID.Setup(aResolution);
+        mDirect.Setup(aResolution);
+        mConnection.Setup(aResolution);
+        mMerging.Setup(aResolution);
+    }
+
+    void AddFeatures(
+        const Vec2f& aSample,
+        const Vec3f& aAlbedo,
+        const Vec3f& aNormal,
+        const float  aDepth,
+        const int    aMaterialID)
+    {
+        mAlbedo.AddColor(aSample, aAlbedo);
+        mNormal.AddColor(aSample, aNormal);
+        mDepth.AddColor(aSample, Vec3f(aDepth));
+        // Averaged IDs would be meaningless, the last one is kept
+        mMaterialID.SetColor(aSample, Vec3f(float(aMaterialID + 1)));
+    }
+
+    void Add(const FeatureBuffers& aOther)
+    {
+        mAlbedo.Add(aOther.mAlbedo);
+        mNormal.Add(aOther.mNormal);
+        mDepth.Add(aOther.mDepth);
+        mDirect.Add(aOther.mDirect);
+        mConnection.Add(aOther.mConnection);
+        mMerging.Add(aOther.mMerging);
+
+        // Material ID is taken from the other buffer only where we have none
+        for(int y=0; y<mMaterialID.GetResY(); y++)
+        {
+            for(int x=0; x<mMaterialID.GetResX(); x++)
+            {
+                if(mMaterialID.GetColor(x, y).x == 0)
+                    mMaterialID.GetColor(x, y) = aOther.mMaterialID.GetColor(x, y);
+            }
+        }
+    }
+
+    void Scale(float aScale)
+    {
+        mAlbedo.Scale(aScale);
+        mNormal.Scale(aScale);
+        mDepth.Scale(aScale);
+        mDirect.Scale(aScale);
+        mConnection.Scale(aScale);
+        mMerging.Scale(aScale);
+    }
+
+public:
+
+    Framebuffer mAlbedo;     //!< Material reflectance
+    Framebuffer mNormal;     //!< Normal facing the camera
+    Framebuffer mDepth;      //!< Distance along camera path, same in all channels
+    Framebuffer mMaterialID; //!< Material index + 1 (0 ~ none), same in all channels
+
+    Framebuffer mDirect;     //!< Camera paths hitting or sampling lights (all of path tracing)
+    Framebuffer mConnection; //!< Vertex connection, including light tracing to camera
+    Framebuffer mMerging;    //!< Vertex merging
+};
+
 #endif //__FRAMEBUFFER_HXX__
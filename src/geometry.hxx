@@ -48,8 +48,38 @@ public:
         return Intersect(aRay, oResult);
     }
 
+    // Intersect of all rays of the batch, default tests them one by one
+    virtual void IntersectBatch(RayBatch &aoBatch) const
+    {
+        for(int i=0; i<aoBatch.mCount; i++)
+        {
+            if(Intersect(aoBatch.mRays[i], aoBatch.mResults[i]))
+            {
+                aoBatch.mHit[i]  = 1;
+                aoBatch.mDist[i] = aoBatch.mResults[i].dist;
+            }
+        }
+    }
+
+    // IntersectP of the rays of the batch that did not hit yet
+    virtual void IntersectPBatch(RayBatch &aoBatch) const
+    {
+        for(int i=0; i<aoBatch.mCount; i++)
+        {
+            if(!aoBatch.mHit[i] && IntersectP(aoBatch.mRays[i], aoBatch.mResults[i]))
+                aoBatch.mHit[i] = 1;
+        }
+    }
+
     // Grows given bounding box by this object
     virtual void GrowBBox(Vec3f &aoBBoxMin, Vec3f &aoBBoxMax) = 0;
+
+    // Appends the parts that an acceleration structure should bound
+    // separately, by default the object itself
+    virtual void GetParts(std::vector<AbstractGeometry*> &aoParts)
+    {
+        aoParts.push_back(this);
+    }
 };
 
 class GeometryList : public AbstractGeometry
@@ -90,6 +120,20 @@ public:
         return false;
     }
 
+    // Objects are tested in the same order as by Intersect, and find
+    // the same hits
+    virtual void IntersectBatch(RayBatch &aoBatch) const
+    {
+        for(int i=0; i<(int)mGeometry.size(); i++)
+            mGeometry[i]->IntersectBatch(aoBatch);
+    }
+
+    virtual void IntersectPBatch(RayBatch &aoBatch) const
+    {
+        for(int i=0; i<(int)mGeometry.size(); i++)
+            mGeometry[i]->IntersectPBatch(aoBatch);
+    }
+
     virtual void GrowBBox(
         Vec3f &aoBBoxMin,
         Vec3f &aoBBoxMax)
@@ -98,11 +142,54 @@ public:
             mGeometry[i]->GrowBBox(aoBBoxMin, aoBBoxMax);
     }
 
+    virtual void GetParts(std::vector<AbstractGeometry*> &aoParts)
+    {
+        for(int i=0; i<(int)mGeometry.size(); i++)
+            mGeometry[i]->GetParts(aoParts);
+    }
+
 public:
 
     std::vector<AbstractGeometry*> mGeometry;
 };
 
+// Ray-triangle test shared by Triangle and triangles of meshes
+bool IntersectTriangle(
+    const Vec3f aP[3],
+    const Vec3f &aNormal,
+    const int   aMatID,
+    const Ray   &aRay,
+    Isect       &oResult)
+{
+    const Vec3f ao = aP[0] - aRay.org;
+    const Vec3f bo = aP[1] - aRay.org;
+    const Vec3f co = aP[2] - aRay.org;
+
+    const Vec3f v0 = Cross(co, bo);
+    const Vec3f v1 = Cross(bo, ao);
+    const Vec3f v2 = Cross(ao, co);
+
+    const float v0d = Dot(v0, aRay.dir);
+    const float v1d = Dot(v1, aRay.dir);
+    const float v2d = Dot(v2, aRay.dir);
+
+    if(((v0d < 0.f)  && (v1d < 0.f)  && (v2d < 0.f)) ||
+       ((v0d >= 0.f) && (v1d >= 0.f) && (v2d >= 0.f)))
+    {
+        const float distance = Dot(aNormal, ao) / Dot(aNormal, aRay.dir);
+
+        if((distance > aRay.tmin) & (distance < oResult.dist))
+        {
+            oResult.normal = aNormal;
+            oResult.matID  = aMatID;
+            oResult.dist   = distance;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 class Triangle : public AbstractGeometry
 {
 public:
@@ -126,33 +213,54 @@ public:
         const Ray &aRay,
         Isect     &oResult) const
     {
-        const Vec3f ao = p[0] - aRay.org;
-        const Vec3f bo = p[1] - aRay.org;
-        const Vec3f co = p[2] - aRay.org;
-
-        const Vec3f v0 = Cross(co, bo);
-        const Vec3f v1 = Cross(bo, ao);
-        const Vec3f v2 = Cross(ao, co);
+        return IntersectTriangle(p, mNormal, matID, aRay, oResult);
+    }
 
-        const float v0d = Dot(v0, aRay.dir);
-        const float v1d = Dot(v1, aRay.dir);
-        const float v2d = Dot(v2, aRay.dir);
+    // Same arithmetic as IntersectTriangle, over all lanes of the batch
+    // in a fixed loop, then the (few) hits are written
+    virtual void IntersectBatch(RayBatch &aoBatch) const
+    {
+        float distance[RayBatch::kSize];
+        int   hit[RayBatch::kSize];
 
-        if(((v0d < 0.f)  && (v1d < 0.f)  && (v2d < 0.f)) ||
-           ((v0d >= 0.f) && (v1d >= 0.f) && (v2d >= 0.f)))
+        for(int i=0; i<RayBatch::kSize; i++)
         {
-            const float distance = Dot(mNormal, ao) / Dot(mNormal, aRay.dir);
+            const Vec3f org(aoBatch.mOrgX[i], aoBatch.mOrgY[i], aoBatch.mOrgZ[i]);
+            const Vec3f dir(aoBatch.mDirX[i], aoBatch.mDirY[i], aoBatch.mDirZ[i]);
 
-            if((distance > aRay.tmin) & (distance < oResult.dist))
-            {
-                oResult.normal = mNormal;
-                oResult.matID  = matID;
-                oResult.dist   = distance;
-                return true;
-            }
+            const Vec3f ao = p[0] - org;
+            const Vec3f bo = p[1] - org;
+            const Vec3f co = p[2] - org;
+
+            const float v0d = Dot(Cross(co, bo), dir);
+            const float v1d = Dot(Cross(bo, ao), dir);
+            const float v2d = Dot(Cross(ao, co), dir);
+
+            distance[i] = Dot(mNormal, ao) / Dot(mNormal, dir);
+
+            const int inside = ((v0d < 0.f)  & (v1d < 0.f)  & (v2d < 0.f)) |
+                ((v0d >= 0.f) & (v1d >= 0.f) & (v2d >= 0.f));
+            hit[i] = inside & (distance[i] > aoBatch.mTMin[i]) &
+                (distance[i] < aoBatch.mDist[i]);
         }
 
-        return false;
+        for(int i=0; i<aoBatch.mCount; i++)
+        {
+            if(!hit[i])
+                continue;
+
+            Isect &result = aoBatch.mResults[i];
+            result.normal = mNormal;
+            result.matID  = matID;
+            result.dist   = distance[i];
+            aoBatch.mDist[i] = distance[i];
+            aoBatch.mHit[i]  = 1;
+        }
+    }
+
+    virtual void IntersectPBatch(RayBatch &aoBatch) const
+    {
+        IntersectBatch(aoBatch);
     }
 
     virtual void GrowBBox(
@@ -236,6 +344,24 @@ public:
         return true;
     }
 
+    // Qualified calls of Intersect are not virtual
+    virtual void IntersectBatch(RayBatch &aoBatch) const
+    {
+        for(int i=0; i<aoBatch.mCount; i++)
+        {
+            if(Sphere::Intersect(aoBatch.mRays[i], aoBatch.mResults[i]))
+            {
+                aoBatch.mHit[i]  = 1;
+                aoBatch.mDist[i] = aoBatch.mResults[i].dist;
+            }
+        }
+    }
+
+    virtual void IntersectPBatch(RayBatch &aoBatch) const
+    {
+        IntersectBatch(aoBatch);
+    }
+
     virtual void GrowBBox(
         Vec3f &aoBBoxMin,
         Vec3f &aoBBoxMax)
@@ -0,0 +1,788 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __GUIDING_HXX__
+#define __GUIDING_HXX__
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+#include "utils.hxx"
+#include "lights.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Piecewise constant distribution of directions, stored as a quadtree
+// over the cylindrical mapping of the sphere (cos(theta), phi), which
+// preserves area. Every node keeps the energy of its 4 quadrants, so
+// sampling and pdf evaluation just descend the tree.
+class DirectionalQuadtree
+{
+public:
+
+    DirectionalQuadtree()
+    {
+        mNodes.resize(1);
+    }
+
+    // Adds energy to the leaf containing the direction
+    void Record(const Vec3f &aDirection, const float aValue)
+    {
+        Vec2f p = DirToSquare(aDirection);
+        int node = 0;
+
+        for(;;)
+        {
+            const int quadrant = GetQuadrant(p);
+            mNodes[node].mSum[quadrant] += aValue;
+
+            if(mNodes[node].mChild[quadrant] == 0)
+                break;
+
+            node = mNodes[node].mChild[quadrant];
+        }
+    }
+
+    float GetTotal() const
+    {
+        const Node &root = mNodes[0];
+        return root.mSum[0] + root.mSum[1] + root.mSum[2] + root.mSum[3];
+    }
+
+    // Pdf w.r.t. solid angle. Distribution with no energy is uniform
+    float Pdf(const Vec3f &aDirection) const
+    {
+        Vec2f p   = DirToSquare(aDirection);
+        float pdf = 1.f;
+        int  node = 0;
+
+        for(;;)
+        {
+            const Node &n = mNodes[node];
+            const float total = n.mSum[0] + n.mSum[1] + n.mSum[2] + n.mSum[3];
+            if(total <= 0)
+                break;
+
+            const int quadrant = GetQuadrant(p);
+            pdf *= 4.f * n.mSum[quadrant] / total;
+
+            if(n.mChild[quadrant] == 0 || pdf == 0)
+                break;
+
+            node = n.mChild[quadrant];
+        }
+
+        return pdf / (4.f * PI_F);
+    }
+
+    // Samples direction proportionally to the stored energy. Each level
+    // first picks the left or right half and then the quadrant in it,
+    // rescaling the random numbers, so no extra ones are needed.
+    Vec3f Sample(const Vec2f &aSamples, float &oPdfW) const
+    {
+        Vec2f u      = aSamples;
+        Vec2f origin = Vec2f(0.f);
+        float size   = 1.f;
+        float pdf    = 1.f;
+        int   node   = 0;
+
+        for(;;)
+        {
+            const Node &n = mNodes[node];
+            const float total = n.mSum[0] + n.mSum[1] + n.mSum[2] + n.mSum[3];
+            if(total <= 0)
+                break;
+
+            // Quadrants are numbered x + 2 * y
+            const float leftProb = (n.mSum[0] + n.mSum[2]) / total;
+            int x, y;
+            if(u.x < leftProb)
+            {
+                x   = 0;
+                u.x = u.x / leftProb;
+            }
+            else
+            {
+                x   = 1;
+                u.x = (u.x - leftProb) / (1.f - leftProb);
+            }
+
+            const float columnSum  = n.mSum[x] + n.mSum[x + 2];
+            const float bottomProb = n.mSum[x] / columnSum;
+            if(u.y < bottomProb)
+            {
+                y   = 0;
+                u.y = u.y / bottomProb;
+            }
+            else
+            {
+                y   = 1;
+                u.y = (u.y - bottomProb) / (1.f - bottomProb);
+            }
+
+            const int quadrant = x + 2 * y;
+            pdf    *= 4.f * n.mSum[quadrant] / total;
+            size   *= 0.5f;
+            origin += Vec2f(float(x), float(y)) * size;
+
+            if(n.mChild[quadrant] == 0)
+                break;
+
+            node = n.mChild[quadrant];
+        }
+
+        // Rescaled numbers can reach 1 due to rounding
+        u.x = std::min(u.x, 0.99999994f);
+        u.y = std::min(u.y, 0.99999994f);
+
+        oPdfW = pdf / (4.f * PI_F);
+        return SquareToDir(origin + u * size);
+    }
+
+    // Builds empty tree for the next pass from the energy recorded in aOther.
+    // Quadrants with more than aThreshold of the total energy are subdivided,
+    // the others are collapsed.
+    void Refine(
+        const DirectionalQuadtree &aOther,
+        const float               aThreshold,
+        const int                 aMaxDepth)
+    {
+        mNodes.clear();
+        mNodes.resize(1);
+
+        const float total = aOther.GetTotal();
+        if(total > 0)
+            RefineNode(aOther, 0, 0.f, 0, 1, total * aThreshold, aMaxDepth);
+    }
+
+private:
+
+    struct Node
+    {
+        Node()
+        {
+            for(int i=0; i<4; i++)
+            {
+                mSum[i]   = 0.f;
+                mChild[i] = 0;
+            }
+        }
+
+        float mSum[4];   //!< Energy of quadrants
+        int   mChild[4]; //!< Child node of quadrants, 0 ~ leaf
+    };
+
+    // aOtherNode < 0 means the other tree has leaf there,
+    // and its energy aValue is spread uniformly
+    void RefineNode(
+        const DirectionalQuadtree &aOther,
+        const int                 aOtherNode,
+        const float               aValue,
+        const int                 aNode,
+        const int                 aDepth,
+        const float               aMinValue,
+        const int                 aMaxDepth)
+    {
+        for(int i=0; i<4; i++)
+        {
+            const float value = (aOtherNode >= 0) ?
+                aOther.mNodes[aOtherNode].mSum[i] : aValue * 0.25f;
+
+            if(aDepth >= aMaxDepth || value <= aMinValue)
+                continue;
+
+            const int child = (int)mNodes.size();
+            mNodes.push_back(Node());
+            mNodes[aNode].mChild[i] = child;
+
+            const int otherChild = (aOtherNode >= 0 &&
+                aOther.mNodes[aOtherNode].mChild[i] != 0) ?
+                aOther.mNodes[aOtherNode].mChild[i] : -1;
+
+            RefineNode(aOther, otherChild, value, child, aDepth + 1,
+                aMinValue, aMaxDepth);
+        }
+    }
+
+    // Descends point p into quadrant, rescaling p to it
+    static int GetQuadrant(Vec2f &aoPoint)
+    {
+        int quadrant = 0;
+        if(aoPoint.x >= 0.5f) { quadrant += 1; aoPoint.x -= 0.5f; }
+        if(aoPoint.y >= 0.5f) { quadrant += 2; aoPoint.y -= 0.5f; }
+        aoPoint *= Vec2f(2.f);
+        return quadrant;
+    }
+
+    static Vec2f DirToSquare(const Vec3f &aDirection)
+    {
+        const float cosTheta = std::min(std::max(aDirection.z, -1.f), 1.f);
+        float phi = std::atan2(aDirection.y, aDirection.x);
+        if(phi < 0) phi += 2.f * PI_F;
+
+        return Vec2f(
+            std::min((cosTheta + 1.f) * 0.5f, 0.99999994f),
+            std::min(phi * (0.5f * INV_PI_F), 0.99999994f));
+    }
+
+    static Vec3f SquareToDir(const Vec2f &aPoint)
+    {
+        const float cosTheta = 2.f * aPoint.x - 1.f;
+        const float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+        const float phi      = 2.f * PI_F * aPoint.y;
+
+        return Vec3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+    }
+
+private:
+
+    std::vector<Node> mNodes;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Path guiding by an online learned spatio-directional distribution of
+// incident radiance (SD-tree), as described in
+//
+//   "Practical Path Guiding for Efficient Light-Transport Simulation"
+//   Thomas Mueller, Markus Gross, Jan Novak
+//   Eurographics Symposium on Rendering 2017
+//
+// Space is split by a binary tree over the scene bounding box, each leaf
+// holding directional quadtrees. Camera paths record their radiance
+// estimates into the quadtrees of the current pass, while the ones from
+// the previous pass are used for sampling. Pass lengths double,
+// so the later (better guided) passes get more samples. After the last
+// training pass the distribution is kept fixed.
+//
+// Renderers mix it with BSDF sampling by one-sample MIS, see
+// AbstractRenderer::GuidedSample().
+class PathGuide
+{
+public:
+
+    struct PathVertex
+    {
+        Vec3f mPosition;
+        Vec3f mDirection;
+        Vec3f mThroughput;
+        Vec3f mRadiance;
+        float mPdfW;
+    };
+
+    typedef std::vector<PathVertex> PathVertices;
+
+    PathGuide()
+    {
+        mGuidingProb      = 0.5f;
+        mTrainingPasses   = 5;
+        mSpatialThreshold = 12000.f;
+        mEnergyThreshold  = 0.01f;
+        mMaxDepth         = 20;
+
+        mEnabled    = false;
+        mIteration  = 0;
+        mPass       = 0;
+        mPassEnd    = 1;
+    }
+
+    void Setup(const SceneSphere &aSceneSphere)
+    {
+        mBBoxMin  = aSceneSphere.mSceneCenter - Vec3f(aSceneSphere.mSceneRadius);
+        mBBoxSize = Vec3f(2.f * aSceneSphere.mSceneRadius);
+
+        mNodes.clear();
+        mNodes.push_back(SpatialNode());
+        mLeaves.clear();
+        mLeaves.push_back(Leaf());
+        mPathVertices.clear();
+
+        mEnabled    = true;
+        mIteration  = 0;
+        mPass       = 0;
+        mPassEnd    = 1;
+    }
+
+    // Sampling distribution is available after the first pass
+    bool IsTrained() const { return mEnabled && mPass > 0; }
+
+    bool IsLearning() const { return mEnabled && mPass < mTrainingPasses; }
+
+    float Pdf(const Vec3f &aPosition, const Vec3f &aDirection) const
+    {
+        return mLeaves[FindLeaf(aPosition)].mSampling.Pdf(aDirection);
+    }
+
+    Vec3f Sample(
+        const Vec3f &aPosition,
+        const Vec2f &aSamples,
+        float       &oPdfW) const
+    {
+        return mLeaves[FindLeaf(aPosition)].mSampling.Sample(aSamples, oPdfW);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Recording of a camera path. Vertices are added as the path scatters,
+    // and every contribution the path gathers afterwards is the radiance
+    // incident along the sampled directions of all vertices so far.
+    // The overloads with aoPath record paths traced concurrently,
+    // each into its own vertex list.
+
+    // aThroughput includes the scattering at the vertex, aPdfW is the
+    // pdf of the sampled direction
+    void AddPathVertex(
+        const Vec3f &aPosition,
+        const Vec3f &aDirection,
+        const Vec3f &aThroughput,
+        const float aPdfW)
+    {
+        AddPathVertex(aPosition, aDirection, aThroughput, aPdfW, mPathVertices);
+    }
+
+    void AddPathVertex(
+        const Vec3f  &aPosition,
+        const Vec3f  &aDirection,
+        const Vec3f  &aThroughput,
+        const float  aPdfW,
+        PathVertices &aoPath)
+    {
+        if(!IsLearning())
+            return;
+
+        PathVertex vertex;
+        vertex.mPosition   = aPosition;
+        vertex.mDirection  = aDirection;
+        vertex.mThroughput = aThroughput;
+        vertex.mPdfW       = aPdfW;
+        vertex.mRadiance   = Vec3f(0);
+        aoPath.push_back(vertex);
+    }
+
+    // aContrib is already multiplied by the path throughput
+    void AddPathContrib(const Vec3f &aContrib)
+    {
+        AddPathContrib(aContrib, mPathVertices);
+    }
+
+    void AddPathContrib(
+        const Vec3f  &aContrib,
+        PathVertices &aoPath)
+    {
+        for(size_t i=0; i<aoPath.size(); i++)
+        {
+            PathVertex &vertex = aoPath[i];
+            for(int j=0; j<3; j++)
+            {
+                if(vertex.mThroughput.Get(j) > 0)
+                    vertex.mRadiance.Get(j) += aContrib.Get(j) / vertex.mThroughput.Get(j);
+            }
+        }
+    }
+
+    void EndPath()
+    {
+        EndPath(mPathVertices);
+    }
+
+    void EndPath(PathVertices &aoPath)
+    {
+        for(size_t i=0; i<aoPath.size(); i++)
+        {
+            const PathVertex &vertex = aoPath[i];
+            Leaf &leaf = mLeaves[FindLeaf(vertex.mPosition)];
+
+            // Dividing by pdf gives estimate of the integral over each quadrant
+            leaf.mBuilding.Record(vertex.mDirection,
+                Luminance(vertex.mRadiance) / vertex.mPdfW);
+            leaf.mSampleCount++;
+        }
+
+        aoPath.clear();
+    }
+
+    // Called by renderers after every iteration, ends the pass when due
+    void EndIteration()
+    {
+        if(!IsLearning())
+            return;
+
+        mIteration++;
+        if(mIteration < mPassEnd)
+            return;
+
+        // Leaves with many samples are split, the threshold grows with
+        // the pass length, as in the paper
+        const float passLength = float(1 << mPass);
+        const float threshold  = mSpatialThreshold * std::sqrt(passLength);
+        const size_t nodeCount = mNodes.size();
+        for(size_t i=0; i<nodeCount; i++)
+        {
+            if(mNodes[i].mLeaf >= 0)
+                SplitNode((int)i, threshold);
+        }
+
+        for(size_t i=0; i<mLeaves.size(); i++)
+        {
+            Leaf &leaf = mLeaves[i];
+            leaf.mSampling = leaf.mBuilding;
+            leaf.mBuilding.Refine(leaf.mSampling, mEnergyThreshold, mMaxDepth);
+            leaf.mSampleCount = 0;
+        }
+
+        mPass++;
+        mPassEnd += 1 << mPass;
+    }
+
+public:
+
+    float mGuidingProb;      //!< Probability of sampling the guide instead of BSDF
+    int   mTrainingPasses;   //!< Number of passes (1, 2, 4, ... iterations) to learn
+    float mSpatialThreshold; //!< Samples per leaf to split it, for 1 iteration pass
+    float mEnergyThreshold;  //!< Fraction of energy to subdivide directional node
+    int   mMaxDepth;         //!< Maximal depth of directional quadtrees
+
+private:
+
+    struct SpatialNode
+    {
+        SpatialNode() : mAxis(0), mLeaf(0) { mChild[0] = mChild[1] = 0; }
+
+        int mChild[2]; //!< Children of inner node
+        int mAxis;     //!< Split axis, space is split in half
+        int mLeaf;     //!< Index to mLeaves, < 0 ~ inner node
+    };
+
+    struct Leaf
+    {
+        Leaf() : mSampleCount(0) {}
+
+        DirectionalQuadtree mSampling; //!< Learned in the previous pass
+        DirectionalQuadtree mBuilding; //!< Learned in the current pass
+        int                 mSampleCount;
+    };
+
+    int FindLeaf(const Vec3f &aPosition) const
+    {
+        Vec3f p = (aPosition - mBBoxMin) / mBBoxSize;
+        int node = 0;
+
+        while(mNodes[node].mLeaf < 0)
+        {
+            const SpatialNode &n = mNodes[node];
+            float &coord = p.Get(n.mAxis);
+
+            if(coord < 0.5f)
+            {
+                coord *= 2.f;
+                node = n.mChild[0];
+            }
+            else
+            {
+                coord = (coord - 0.5f) * 2.f;
+                node = n.mChild[1];
+            }
+        }
+
+        return mNodes[node].mLeaf;
+    }
+
+    // Splits leaf node in half while the halves still have enough samples.
+    // Both halves start with the distributions of the parent.
+    void SplitNode(const int aNode, const float aThreshold)
+    {
+        const int leafIdx = mNodes[aNode].mLeaf;
+        if(mLeaves[leafIdx].mSampleCount <= aThreshold)
+            return;
+
+        Leaf leaf = mLeaves[leafIdx];
+        leaf.mSampleCount /= 2;
+        mLeaves.push_back(leaf);
+        mLeaves[leafIdx].mSampleCount = leaf.mSampleCount;
+
+        const int axis = mNodes[aNode].mAxis;
+        const int child0 = (int)mNodes.size();
+
+        SpatialNode child;
+        child.mAxis = (axis + 1) % 3;
+        child.mLeaf = leafIdx;
+        mNodes.push_back(child);
+        child.mLeaf = (int)mLeaves.size() - 1;
+        mNodes.push_back(child);
+
+        mNodes[aNode].mLeaf     = -1;
+        mNodes[aNode].mChild[0] = child0;
+        mNodes[aNode].mChild[1] = child0 + 1;
+
+        SplitNode(child0, aThreshold);
+        SplitNode(child0 + 1, aThreshold);
+    }
+
+private:
+
+    Vec3f mBBoxMin, mBBoxSize;
+
+    std::vector<SpatialNode> mNodes;
+    std::vector<Leaf>        mLeaves;
+    PathVertices             mPathVertices; //!< Vertices of the recorded path
+
+    bool mEnabled;  //!< Set up, guide is not used otherwise
+    int mIteration; //!< Iterations since Setup()
+    int mPass;      //!< Current pass
+    int mPassEnd;   //!< Iteration at which the current pass ends
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Piecewise constant distribution over the unit square, on a regular grid
+// of cells. Learned energy is added to cells, and Build() turns it into
+// sampling density. Part of the density is always uniform, so no sample
+// gets zero pdf.
+class Distribution2D
+{
+public:
+
+    void Setup(const int aResolution)
+    {
+        mRes = aResolution;
+        mSums.assign(mRes * mRes, 0.f);
+        mDensity.assign(mRes * mRes, 1.f);
+        mRowSums.assign(mRes, float(mRes));
+    }
+
+    int GetCell(const Vec2f &aSamples) const
+    {
+        const int x = std::min(int(aSamples.x * mRes), mRes - 1);
+        const int y = std::min(int(aSamples.y * mRes), mRes - 1);
+        return x + y * mRes;
+    }
+
+    void Add(const int aCell, const float aValue)
+    {
+        mSums[aCell] += aValue;
+    }
+
+    // Density is mix of uniform and normalized sums, aUniformProb being
+    // the probability of the uniform part
+    void Build(const float aUniformProb)
+    {
+        float total = 0;
+        for(size_t i=0; i<mSums.size(); i++)
+            total += mSums[i];
+
+        const float scale = (total > 0) ? (1.f - aUniformProb) * mSums.size() / total : 0.f;
+        const float base  = (total > 0) ? aUniformProb : 1.f;
+
+        for(int y=0; y<mRes; y++)
+        {
+            mRowSums[y] = 0;
+            for(int x=0; x<mRes; x++)
+            {
+                const int i = x + y * mRes;
+                mDensity[i] = base + scale * mSums[i];
+                mRowSums[y] += mDensity[i];
+            }
+        }
+    }
+
+    // Pdf w.r.t. the unit square
+    float Pdf(const Vec2f &aSamples) const
+    {
+        return mDensity[GetCell(aSamples)];
+    }
+
+    // Warps uniform samples to the distribution, first picking the row
+    // and then the cell in it
+    Vec2f Sample(
+        const Vec2f &aSamples,
+        float       &oPdf,
+        int         &oCell) const
+    {
+        float total = 0;
+        for(int y=0; y<mRes; y++)
+            total += mRowSums[y];
+
+        float u = aSamples.y * total;
+        int y = 0;
+        while(y < mRes - 1 && u >= mRowSums[y])
+            u -= mRowSums[y++];
+        const float v = std::min(u / mRowSums[y], 0.99999994f);
+
+        u = aSamples.x * mRowSums[y];
+        int x = 0;
+        while(x < mRes - 1 && u >= mDensity[x + y * mRes])
+            u -= mDensity[x++ + y * mRes];
+        oCell = x + y * mRes;
+        const float w = std::min(u / mDensity[oCell], 0.99999994f);
+
+        // Keep the sample inside the cell despite rounding
+        oPdf = mDensity[oCell];
+        const float cellEps = 1e-6f / mRes;
+        return Vec2f(
+            std::min((x + w) / mRes, (x + 1) / float(mRes) - cellEps),
+            std::min((y + v) / mRes, (y + 1) / float(mRes) - cellEps));
+    }
+
+private:
+
+    int                mRes;
+    std::vector<float> mSums;    //!< Learned energy of cells
+    std::vector<float> mDensity; //!< Density of cells, averages to 1
+    std::vector<float> mRowSums; //!< Density summed over rows
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Adaptive emission of light sub-paths, in the spirit of
+//
+//   "Importance Driven Construction of Photon Maps"
+//   Ingmar Peter, Georg Pietrek
+//   Eurographics Workshop on Rendering 1998
+//
+// The random tuples each light uses in Emit() are warped by learned
+// piecewise constant densities, one for direction and one for position
+// tuples. Light sub-paths credit their emission cells with the
+// contribution of their vertices to the camera (merges, connections and
+// light tracing), so emission concentrates where it is seen.
+//
+// The emission pdf is multiplied by the density of the warp, which can be
+// evaluated for any emitted ray by inverting Emit() (see
+// AbstractLight::EmissionSamples()), which MIS needs.
+class EmissionGuide
+{
+public:
+
+    // Cells of one emitted light sub-path, < 0 ~ tuple not warped
+    struct Cells
+    {
+        int mLight;
+        int mDir;
+        int mPos;
+    };
+
+    EmissionGuide()
+    {
+        mResolution  = 16;
+        mUniformProb = 0.3f;
+        mEnabled     = false;
+    }
+
+    void Setup(const int aLightCount)
+    {
+        mDirDistributions.resize(aLightCount);
+        mPosDistributions.resize(aLightCount);
+
+        for(int i=0; i<aLightCount; i++)
+        {
+            mDirDistributions[i].Setup(mResolution);
+            mPosDistributions[i].Setup(mResolution);
+        }
+
+        mEnabled = true;
+    }
+
+    bool IsEnabled() const { return mEnabled; }
+
+    // Warps the random tuples of the light, returns the density
+    // the emission pdf has to be multiplied with
+    float Sample(
+        const int   aLightID,
+        const int   aSampleMask,
+        Vec2f       &aoDirRndTuple,
+        Vec2f       &aoPosRndTuple,
+        Cells       &oCells) const
+    {
+        float density = 1.f;
+        float pdf;
+
+        oCells.mLight = aLightID;
+        oCells.mDir   = -1;
+        oCells.mPos   = -1;
+
+        if(aSampleMask & AbstractLight::kDirSamples)
+        {
+            aoDirRndTuple = mDirDistributions[aLightID].Sample(
+                aoDirRndTuple, pdf, oCells.mDir);
+            density *= pdf;
+        }
+
+        if(aSampleMask & AbstractLight::kPosSamples)
+        {
+            aoPosRndTuple = mPosDistributions[aLightID].Sample(
+                aoPosRndTuple, pdf, oCells.mPos);
+            density *= pdf;
+        }
+
+        return density;
+    }
+
+    // Density of the warp for given random tuples
+    float Pdf(
+        const int   aLightID,
+        const int   aSampleMask,
+        const Vec2f &aDirRndTuple,
+        const Vec2f &aPosRndTuple) const
+    {
+        float density = 1.f;
+
+        if(aSampleMask & AbstractLight::kDirSamples)
+            density *= mDirDistributions[aLightID].Pdf(aDirRndTuple);
+
+        if(aSampleMask & AbstractLight::kPosSamples)
+            density *= mPosDistributions[aLightID].Pdf(aPosRndTuple);
+
+        return density;
+    }
+
+    // Contribution already includes division by the warped emission pdf,
+    // so the sums estimate the (unwarped) integral over each cell
+    void AddContrib(const Cells &aCells, const float aValue)
+    {
+        if(aCells.mDir >= 0)
+            mDirDistributions[aCells.mLight].Add(aCells.mDir, aValue);
+
+        if(aCells.mPos >= 0)
+            mPosDistributions[aCells.mLight].Add(aCells.mPos, aValue);
+    }
+
+    // Rebuilds densities from everything learned so far
+    void Update()
+    {
+        for(size_t i=0; i<mDirDistributions.size(); i++)
+        {
+            mDirDistributions[i].Build(mUniformProb);
+            mPosDistributions[i].Build(mUniformProb);
+        }
+    }
+
+public:
+
+    int   mResolution;  //!< Cells per dimension of each tuple
+    float mUniformProb; //!< Fraction of uniform density in each warp
+
+private:
+
+    bool mEnabled;
+    std::vector<Distribution2D> mDirDistributions; //!< Per light
+    std::vector<Distribution2D> mPosDistributions; //!< Per light
+};
+
+#endif //__GUIDING_HXX__
@@ -32,8 +32,16 @@
 class HashGrid
 {
 public:
+
+    // Range queries test candidates in batches of this size, see TestBatch()
+    enum { kBatchSize = 8 };
+
+    // Dense grid may use this many cells per cell of the hash table
+    enum { kDenseCellFactor = 16 };
+
     void Reserve(int aNumCells)
     {
+        mNumCells = aNumCells;
         mCellEnds.resize(aNumCells);
     }
 
@@ -60,6 +68,25 @@ public:
             }
         }
 
+        // When the bounding box at this radius needs few enough cells, every
+        // cell gets its own entry in a dense array and is never hashed
+        mDenseRes = Vec3i(0);
+        if(!aParticles.empty())
+        {
+            const Vec3f extent   = (mBBoxMax - mBBoxMin) * mInvCellSize;
+            const float maxCells = float(mNumCells) * kDenseCellFactor;
+
+            if(extent.x < maxCells && extent.y < maxCells && extent.z < maxCells)
+            {
+                const Vec3i res(int(extent.x) + 1, int(extent.y) + 1, int(extent.z) + 1);
+
+                if(double(res.x) * res.y * res.z <= double(maxCells))
+                    mDenseRes = res;
+            }
+        }
+
+        mCellEnds.resize(IsDense() ? mDenseRes.x * mDenseRes.y * mDenseRes.z : mNumCells);
+
         mIndices.resize(aParticles.size());
         memset(&mCellEnds[0], 0, mCellEnds.size() * sizeof(int));
 
@@ -90,6 +117,20 @@ public:
         // now mCellEnds[x] points to the index right after the last
         // element of cell x
 
+        // Positions in cell order, so that candidates are tested without
+        // touching the particles themselves
+        mPosX.resize(aParticles.size());
+        mPosY.resize(aParticles.size());
+        mPosZ.resize(aParticles.size());
+
+        for(size_t i=0; i<aParticles.size(); i++)
+        {
+            const Vec3f &pos = aParticles[mIndices[i]].GetPosition();
+            mPosX[i] = pos.x;
+            mPosY[i] = pos.y;
+            mPosZ[i] = pos.z;
+        }
+
         //// DEBUG
         //for(size_t i=0; i<aParticles.size(); i++)
         //{
@@ -110,6 +151,16 @@ public:
     void Process(
         const std::vector<tParticle> &aParticles,
         tQuery& aQuery)
+    {
+        Process(aParticles, aQuery, mRadiusSqr);
+    }
+
+    // Query with a smaller radius than the grid was built with
+    template<typename tParticle, typename tQuery>
+    void Process(
+        const std::vector<tParticle> &aParticles,
+        tQuery& aQuery,
+        const float aRadiusSqr)
     {
         const Vec3f queryPos = aQuery.GetPosition();
 
@@ -137,7 +188,32 @@ public:
         const int  pyo = py + (fractCoord.y < 0.5f ? -1 : +1);
         const int  pzo = pz + (fractCoord.z < 0.5f ? -1 : +1);
 
-        int found = 0;
+        // Dense grid addresses the neighbours by strides and skips
+        // those outside the grid, the order is the same as below
+        if(IsDense())
+        {
+            const int  base = GetCellIndex(Vec3i(px, py, pz));
+            const int  offX = pxo - px;
+            const int  offY = (pyo - py) * mDenseRes.x;
+            const int  offZ = (pzo - pz) * mDenseRes.x * mDenseRes.y;
+
+            const bool inX  = pxo >= 0 && pxo < mDenseRes.x;
+            const bool inY  = pyo >= 0 && pyo < mDenseRes.y;
+            const bool inZ  = pzo >= 0 && pzo < mDenseRes.z;
+
+            for(int j=0; j<8; j++)
+            {
+                if(((j & 4) && !inX) || ((j & 2) && !inY) || ((j & 1) && !inZ))
+                    continue;
+
+                const int cellIndex = base +
+                    ((j & 4) ? offX : 0) + ((j & 2) ? offY : 0) + ((j & 1) ? offZ : 0);
+
+                ProcessCell(aParticles, aQuery, aRadiusSqr, GetCellRange(cellIndex));
+            }
+
+            return;
+        }
 
         for(int j=0; j<8; j++)
         {
@@ -154,22 +230,99 @@ public:
             case 7: activeRange = GetCellRange(GetCellIndex(Vec3i(pxo, pyo, pzo))); break;
             }
 
-            for(; activeRange.x < activeRange.y; activeRange.x++)
-            {
-                const int particleIndex   = mIndices[activeRange.x];
-                const tParticle &particle = aParticles[particleIndex];
+            ProcessCell(aParticles, aQuery, aRadiusSqr, activeRange);
+        }
+    }
 
-                const float distSqr =
-                    (aQuery.GetPosition() - particle.GetPosition()).LenSqr();
+    //! Whether the last Build() chose the dense grid
+    bool IsDense() const { return mDenseRes.x > 0; }
 
-                if(distSqr <= mRadiusSqr)
-                    aQuery.Process(particle);
-            }
+    // Morton code of the cell containing aPoint, 10 bits per axis (cells past
+    // 1023 share the last code). Queries in this order visit nearby cells
+    // one after another.
+    uint GetMortonKey(const Vec3f &aPoint) const
+    {
+        const Vec3f cellPt = mInvCellSize * (aPoint - mBBoxMin);
+
+        uint key = 0;
+        for(int i=0; i<3; i++)
+        {
+            const float coord = std::min(std::max(cellPt.Get(i), 0.f), 1023.f);
+            key |= SpreadBits(uint(coord)) << i;
         }
+
+        return key;
     }
 
 private:
 
+    // Calls the query for particles of one cell within the radius.
+    // Full batches are tested at once, the rest one by one.
+    template<typename tParticle, typename tQuery>
+    void ProcessCell(
+        const std::vector<tParticle> &aParticles,
+        tQuery& aQuery,
+        const float aRadiusSqr,
+        Vec2i aRange)
+    {
+        const Vec3f &queryPos = aQuery.GetPosition();
+
+        for(; aRange.x + kBatchSize <= aRange.y; aRange.x += kBatchSize)
+        {
+            int accepted[kBatchSize];
+            const int acceptedCount = TestBatch(queryPos, aRadiusSqr,
+                aRange.x, accepted);
+
+            for(int k=0; k<acceptedCount; k++)
+                aQuery.Process(aParticles[mIndices[accepted[k]]]);
+        }
+
+        for(; aRange.x < aRange.y; aRange.x++)
+        {
+            const float dx = queryPos.x - mPosX[aRange.x];
+            const float dy = queryPos.y - mPosY[aRange.x];
+            const float dz = queryPos.z - mPosZ[aRange.x];
+
+            if(dx * dx + dy * dy + dz * dz <= aRadiusSqr)
+                aQuery.Process(aParticles[mIndices[aRange.x]]);
+        }
+    }
+
+    // Tests kBatchSize candidates from slot aFirst on against the query
+    // sphere. The fixed size loops over position arrays are vectorized by
+    // the compiler (SSE or AVX, as the target allows). Slots of
+    // accepted candidates are compacted into oAccepted, in order, and their
+    // count is returned.
+    int TestBatch(
+        const Vec3f &aQueryPos,
+        const float aRadiusSqr,
+        const int   aFirst,
+        int         *oAccepted) const
+    {
+        const float *posX = &mPosX[aFirst];
+        const float *posY = &mPosY[aFirst];
+        const float *posZ = &mPosZ[aFirst];
+
+        int inside[kBatchSize];
+        for(int i=0; i<kBatchSize; i++)
+        {
+            const float dx = aQueryPos.x - posX[i];
+            const float dy = aQueryPos.y - posY[i];
+            const float dz = aQueryPos.z - posZ[i];
+
+            inside[i] = (dx * dx + dy * dy + dz * dz <= aRadiusSqr);
+        }
+
+        int count = 0;
+        for(int i=0; i<kBatchSize; i++)
+        {
+            oAccepted[count] = aFirst + i;
+            count += inside[i];
+        }
+
+        return count;
+    }
+
     Vec2i GetCellRange(int aCellIndex) const
     {
         if(aCellIndex == 0) return Vec2i(0, mCellEnds[0]);
@@ -178,6 +331,9 @@ private:
 
     int GetCellIndex(const Vec3i &aCoord) const
     {
+        if(IsDense())
+            return aCoord.x + mDenseRes.x * (aCoord.y + mDenseRes.y * aCoord.z);
+
         uint x = uint(aCoord.x);
         uint y = uint(aCoord.y);
         uint z = uint(aCoord.z);
@@ -207,6 +363,14 @@ private:
     std::vector<int> mIndices;
     std::vector<int> mCellEnds;
 
+    // Particle positions in the order of mIndices, for batched queries
+    std::vector<float> mPosX;
+    std::vector<float> mPosY;
+    std::vector<float> mPosZ;
+
+    int   mNumCells; //!< Size of the hash table, also bounds the dense grid
+    Vec3i mDenseRes; //!< Cells of the dense grid per axis, 0 ~ hashed
+
     float mRadius;
     float mRadiusSqr;
     float mCellSize;
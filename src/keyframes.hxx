@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __KEYFRAMES_HXX__
+#define __KEYFRAMES_HXX__
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "math.hxx"
+
+// Keyframed animation of the mesh and the camera, over time 0 to 1 of
+// the frame sequence. Between keys, the pose is linearly interpolated,
+// before the first and after the last it holds.
+//
+// The file has a key per line, '#' starts a comment, angles in degrees:
+//   mesh   <time> <move x y z> <angle> <scale> <twist>
+//   camera <time> <position x y z> <target x y z>
+// The mesh turns by angle about the vertical axis through the middle of
+// its bounding box as loaded, and by twist more at its top than at its
+// bottom. It scales about the middle of its bottom, then moves.
+
+// Pose of the mesh relative to the mesh as loaded
+struct MeshKey
+{
+    float mTime;
+    Vec3f mMove;
+    float mAngle;  //!< In radians
+    float mScale;
+    float mTwist;  //!< In radians, added at the top
+};
+
+struct CameraKey
+{
+    float mTime;
+    Vec3f mPosition;
+    Vec3f mTarget;
+};
+
+class Keyframes
+{
+public:
+
+    // Without a file, the mesh twists up to half a turn
+    Keyframes()
+    {
+        MeshKey key;
+        key.mTime  = 0.f;
+        key.mMove  = Vec3f(0);
+        key.mAngle = 0.f;
+        key.mScale = 1.f;
+        key.mTwist = 0.f;
+        mMeshKeys.push_back(key);
+
+        key.mTime  = 1.f;
+        key.mTwist = PI_F;
+        mMeshKeys.push_back(key);
+    }
+
+    // Replaces the keys by those of aFilename. Keys of each kind must
+    // come in order of time. Returns false on error.
+    bool Load(const char *aFilename)
+    {
+        FILE *file = fopen(aFilename, "r");
+        if(!file)
+        {
+            printf("Cannot open keyframes %s\n", aFilename);
+            return false;
+        }
+
+        mMeshKeys.clear();
+        mCameraKeys.clear();
+
+        bool valid   = true;
+        int  lineIdx = 0;
+        char line[4096];
+
+        while(valid && fgets(line, sizeof(line), file))
+        {
+            lineIdx++;
+
+            char *comment = strchr(line, '#');
+            if(comment)
+                *comment = 0;
+
+            char kind[16];
+            if(sscanf(line, "%15s", kind) != 1)
+                continue;
+
+            if(strcmp(kind, "mesh") == 0)
+            {
+                MeshKey key;
+                valid = sscanf(line, "%*s %f %f %f %f %f %f %f", &key.mTime,
+                    &key.mMove.x, &key.mMove.y, &key.mMove.z,
+                    &key.mAngle, &key.mScale, &key.mTwist) == 7 &&
+                    (mMeshKeys.empty() || mMeshKeys.back().mTime < key.mTime);
+                key.mAngle *= PI_F / 180.f;
+                key.mTwist *= PI_F / 180.f;
+                mMeshKeys.push_back(key);
+            }
+            else if(strcmp(kind, "camera") == 0)
+            {
+                CameraKey key;
+                valid = sscanf(line, "%*s %f %f %f %f %f %f %f", &key.mTime,
+                    &key.mPosition.x, &key.mPosition.y, &key.mPosition.z,
+                    &key.mTarget.x, &key.mTarget.y, &key.mTarget.z) == 7 &&
+                    (mCameraKeys.empty() || mCameraKeys.back().mTime < key.mTime) &&
+                    (key.mTarget - key.mPosition).LenSqr() > 0.f;
+                mCameraKeys.push_back(key);
+            }
+            else
+                valid = false;
+        }
+
+        fclose(file);
+
+        if(!valid)
+            printf("Keyframes %s, line %d is not a valid key\n", aFilename, lineIdx);
+
+        return valid;
+    }
+
+    bool HasMesh()   const { return !mMeshKeys.empty(); }
+    bool HasCamera() const { return !mCameraKeys.empty(); }
+
+    // Needs HasMesh()
+    MeshKey GetMesh(const float aTime) const
+    {
+        int   keyIdx;
+        float t;
+        FindKeys(mMeshKeys, aTime, keyIdx, t);
+
+        const MeshKey &a = mMeshKeys[keyIdx];
+        const MeshKey &b = mMeshKeys[std::min(keyIdx + 1, int(mMeshKeys.size()) - 1)];
+
+        MeshKey res;
+        res.mTime  = aTime;
+        res.mMove  = a.mMove  + (b.mMove  - a.mMove)  * t;
+        res.mAngle = a.mAngle + (b.mAngle - a.mAngle) * t;
+        res.mScale = a.mScale + (b.mScale - a.mScale) * t;
+        res.mTwist = a.mTwist + (b.mTwist - a.mTwist) * t;
+        return res;
+    }
+
+    // Needs HasCamera()
+    CameraKey GetCamera(const float aTime) const
+    {
+        int   keyIdx;
+        float t;
+        FindKeys(mCameraKeys, aTime, keyIdx, t);
+
+        const CameraKey &a = mCameraKeys[keyIdx];
+        const CameraKey &b = mCameraKeys[std::min(keyIdx + 1, int(mCameraKeys.size()) - 1)];
+
+        CameraKey res;
+        res.mTime     = aTime;
+        res.mPosition = a.mPosition + (b.mPosition - a.mPosition) * t;
+        res.mTarget   = a.mTarget   + (b.mTarget   - a.mTarget)   * t;
+        return res;
+    }
+
+private:
+
+    // Last key at or before aTime (the first if none), and the fraction
+    // of the way to the next one
+    template<typename tKey>
+    static void FindKeys(
+        const std::vector<tKey> &aKeys,
+        const float             aTime,
+        int                     &oKeyIdx,
+        float                   &oT)
+    {
+        oKeyIdx = 0;
+        while(oKeyIdx + 1 < int(aKeys.size()) && aKeys[oKeyIdx + 1].mTime <= aTime)
+            oKeyIdx++;
+
+        oT = 0.f;
+        if(oKeyIdx + 1 < int(aKeys.size()) && aTime > aKeys[oKeyIdx].mTime)
+            oT = (aTime - aKeys[oKeyIdx].mTime) /
+                (aKeys[oKeyIdx + 1].mTime - aKeys[oKeyIdx].mTime);
+    }
+
+private:
+
+    std::vector<MeshKey>   mMeshKeys;
+    std::vector<CameraKey> mCameraKeys;
+};
+
+#endif //__KEYFRAMES_HXX__
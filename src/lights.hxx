@@ -98,6 +98,29 @@ public:
         float             *oDirectPdfA = NULL,
         float             *oEmissionPdfW = NULL) const = 0;
 
+    // Random tuples that Emit() actually uses
+    enum EmissionTuple
+    {
+        kDirSamples = 1,
+        kPosSamples = 2
+    };
+
+    virtual int EmissionSampleMask() const = 0;
+
+    /* \brief Inverse of Emit, used for adaptive emission.
+     *
+     * Given position and direction of a particle leaving the light
+     * (for infinite lights any point along the ray), returns
+     * random tuples for which Emit generates this particle.
+     * Tuples not in EmissionSampleMask() are left unchanged.
+     */
+    virtual void EmissionSamples(
+        const SceneSphere &aSceneSphere,
+        const Vec3f       &aPosition,
+        const Vec3f       &aDirection,
+        Vec2f             &oDirRndTuple,
+        Vec2f             &oPosRndTuple) const = 0;
+
     // Whether the light has a finite extent (area, point) or not (directional, env. map)
     virtual bool IsFinite() const = 0;
 
@@ -215,6 +238,31 @@ public:
 
         return mIntensity;
     }
+
+    virtual int EmissionSampleMask() const { return kDirSamples | kPosSamples; }
+
+    virtual void EmissionSamples(
+        const SceneSphere &/*aSceneSphere*/,
+        const Vec3f       &aPosition,
+        const Vec3f       &aDirection,
+        Vec2f             &oDirRndTuple,
+        Vec2f             &oPosRndTuple) const
+    {
+        oDirRndTuple = CosHemisphereToSamples(mFrame.ToLocal(aDirection));
+
+        // Barycentric coordinates w.r.t. e1 and e2
+        const Vec3f d      = aPosition - p0;
+        const float d11    = Dot(e1, e1);
+        const float d12    = Dot(e1, e2);
+        const float d22    = Dot(e2, e2);
+        const float invDet = 1.f / (d11 * d22 - d12 * d12);
+        const Vec2f uv(
+            (d22 * Dot(d, e1) - d12 * Dot(d, e2)) * invDet,
+            (d11 * Dot(d, e2) - d12 * Dot(d, e1)) * invDet);
+
+        oPosRndTuple = UniformTriangleToSamples(uv);
+    }
+
     // Whether the light has a finite extent (area, point) or not (directional, env. map)
     virtual bool IsFinite() const { return true; }
 
@@ -300,6 +348,21 @@ public:
         return Vec3f(0);
     }
 
+    virtual int EmissionSampleMask() const { return kPosSamples; }
+
+    virtual void EmissionSamples(
+        const SceneSphere &aSceneSphere,
+        const Vec3f       &aPosition,
+        const Vec3f       &/*aDirection*/,
+        Vec2f             &/*oDirRndTuple*/,
+        Vec2f             &oPosRndTuple) const
+    {
+        const Vec3f offset = aPosition - aSceneSphere.mSceneCenter;
+        oPosRndTuple = ConcentricDiscToSamples(Vec2f(
+            Dot(offset, mFrame.Binormal()), Dot(offset, mFrame.Tangent())) /
+            Vec2f(aSceneSphere.mSceneRadius));
+    }
+
     // Whether the light has a finite extent (area, point) or not (directional, env. map)
     virtual bool IsFinite() const { return false; }
     
@@ -381,6 +444,18 @@ public:
         return Vec3f(0);
     }
     
+    virtual int EmissionSampleMask() const { return kDirSamples; }
+
+    virtual void EmissionSamples(
+        const SceneSphere &/*aSceneSphere*/,
+        const Vec3f       &/*aPosition*/,
+        const Vec3f       &aDirection,
+        Vec2f             &oDirRndTuple,
+        Vec2f             &/*oPosRndTuple*/) const
+    {
+        oDirRndTuple = UniformSphereToSamples(aDirection);
+    }
+
     // Whether the light has a finite extent (area, point) or not (directional, env. map)
     virtual bool IsFinite() const { return true; }
     
@@ -498,6 +573,26 @@ public:
         return radiance;
     }
 
+    virtual int EmissionSampleMask() const { return kDirSamples | kPosSamples; }
+
+    virtual void EmissionSamples(
+        const SceneSphere &aSceneSphere,
+        const Vec3f       &aPosition,
+        const Vec3f       &aDirection,
+        Vec2f             &oDirRndTuple,
+        Vec2f             &oPosRndTuple) const
+    {
+        oDirRndTuple = UniformSphereToSamples(aDirection);
+
+        // Same disc frame as in Emit()
+        Frame frame;
+        frame.SetFromZ(aDirection);
+        const Vec3f offset = aPosition - aSceneSphere.mSceneCenter;
+        oPosRndTuple = ConcentricDiscToSamples(Vec2f(
+            Dot(offset, frame.Binormal()), Dot(offset, frame.Tangent())) /
+            Vec2f(aSceneSphere.mSceneRadius));
+    }
+
     // Whether the light has a finite extent (area, point) or not (directional, env. map)
     virtual bool IsFinite() const { return false; }
     
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __MAPPEDFILE_HXX__
+#define __MAPPEDFILE_HXX__
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+#if defined(_WIN32)
+// Without these, windows.h defines min and max macros, which break every
+// std::min and std::max after it
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Whole file mapped read-only into memory. Pages are read when first
+// touched, and being clean, the system can drop them again under memory
+// pressure.
+
+class MappedFile
+{
+public:
+
+    MappedFile() :
+        mData(NULL),
+        mSize(0)
+    {
+#if defined(_WIN32)
+        mFile    = INVALID_HANDLE_VALUE;
+        mMapping = NULL;
+#endif
+    }
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    // With aRandomAccess, the system does not read ahead of touched pages.
+    // Returns false when the file cannot be mapped (or is empty).
+    bool Open(const char *aFilename, bool aRandomAccess)
+    {
+        Close();
+
+#if defined(_WIN32)
+        mFile = CreateFileA(aFilename, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, aRandomAccess ? FILE_FLAG_RANDOM_ACCESS : 0, NULL);
+
+        LARGE_INTEGER size;
+        if(mFile != INVALID_HANDLE_VALUE && GetFileSizeEx(mFile, &size) &&
+           size.QuadPart > 0)
+        {
+            mSize    = size_t(size.QuadPart);
+            mMapping = CreateFileMappingA(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+        if(mMapping != NULL)
+            mData = (const char*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        const int file = open(aFilename, O_RDONLY);
+        struct stat info;
+
+        if(file >= 0 && fstat(file, &info) == 0 && info.st_size > 0)
+        {
+            void *data = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_SHARED, file, 0);
+
+            if(data != MAP_FAILED)
+            {
+                mData = (const char*)data;
+                mSize = size_t(info.st_size);
+
+                if(aRandomAccess)
+                    madvise(data, mSize, MADV_RANDOM);
+            }
+        }
+
+        if(file >= 0)
+            close(file); // the mapping keeps the file open
+#endif
+
+        if(!mData)
+        {
+            Close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Close()
+    {
+#if defined(_WIN32)
+        if(mData)
+            UnmapViewOfFile(mData);
+        if(mMapping != NULL)
+            CloseHandle(mMapping);
+        if(mFile != INVALID_HANDLE_VALUE)
+            CloseHandle(mFile);
+        mMapping = NULL;
+        mFile    = INVALID_HANDLE_VALUE;
+#else
+        if(mData)
+            munmap((void*)mData, mSize);
+#endif
+        mData = NULL;
+        mSize = 0;
+    }
+
+    const char* GetData() const { return mData; }
+    size_t      GetSize() const { return mSize; }
+
+    // Number of aPageBytes sized pages among the first aLength bytes whose
+    // first byte is in memory now, -1 when the system cannot tell
+    int GetResidentPageCount(
+        const size_t aPageBytes,
+        const size_t aLength = size_t(-1)) const
+    {
+#if defined(_WIN32)
+        return -1;
+#else
+        const size_t systemPage = size_t(sysconf(_SC_PAGESIZE));
+        std::vector<unsigned char> resident((mSize + systemPage - 1) / systemPage);
+
+        if(!mData || mincore((void*)mData, mSize, (unsigned char*)&resident[0]) != 0)
+            return -1;
+
+        int count = 0;
+        for(size_t offset=0; offset<std::min(mSize, aLength); offset+=aPageBytes)
+            count += resident[offset / systemPage] & 1;
+
+        return count;
+#endif
+    }
+
+private:
+
+    const char *mData;
+    size_t     mSize;
+#if defined(_WIN32)
+    HANDLE     mFile;
+    HANDLE     mMapping;
+#endif
+};
+
+//////////////////////////////////////////////////////////////////////////
+// FNV-1a hash, names files cached between runs by what they depend on.
+// Start from kHashSeed, continue with the key of the previous bytes.
+
+static const unsigned long long kHashSeed = 14695981039346656037ULL;
+
+inline unsigned long long HashBytes(
+    unsigned long long aKey,
+    const void         *aData,
+    const size_t       aSize)
+{
+    const unsigned char *bytes = (const unsigned char*)aData;
+
+    for(size_t i=0; i<aSize; i++)
+        aKey = (aKey ^ bytes[i]) * 1099511628211ULL;
+
+    return aKey;
+}
+
+#endif //__MAPPEDFILE_HXX__
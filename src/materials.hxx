@@ -33,9 +33,29 @@
 #include "scene.hxx"
 #include "utils.hxx"
 
+// Probabilities of picking BSDF components when sampling
+struct ComponentProbabilities
+{
+    float diffProb;
+    float phongProb;
+    float reflProb;
+    float refrProb;
+};
+
 class Material
 {
 public:
+
+    // Combinations of components that BSDF has fast paths for
+    enum Type
+    {
+        kGeneric = 0,  //!< Anything else, handled component by component
+        kPureDiffuse,  //!< Diffuse only
+        kPureMirror,   //!< Mirror only, without Fresnel
+        kGlass,        //!< Mirror and refraction mixed by Fresnel
+        kDiffuseGlossy //!< Diffuse and Phong
+    };
+
     Material()
     {
         Reset();
@@ -48,6 +68,102 @@ public:
         mPhongExponent      = 1.f;
         mMirrorReflectance  = Vec3f(0);
         mIOR = -1.f;
+        mType = kGeneric;
+        mDiffuseTexture = -1;
+        mPhongTexture   = -1;
+        mTextureOrigin  = Vec3f(0);
+        mTextureU       = Vec3f(0);
+        mTextureV       = Vec3f(0);
+    }
+
+    bool IsTextured() const
+    {
+        return mDiffuseTexture >= 0 || mPhongTexture >= 0;
+    }
+
+    // Texture coordinates of a point, by planar projection
+    Vec2f GetTextureUV(const Vec3f &aPosition) const
+    {
+        const Vec3f p = aPosition - mTextureOrigin;
+        return Vec2f(Dot(p, mTextureU), Dot(p, mTextureV));
+    }
+
+    // Sets mType from the components present, has to be called
+    // whenever they change (Scene does it after loading)
+    void Classify()
+    {
+        const bool diffuse = mDiffuseReflectance.Max() > 0;
+        const bool phong   = mPhongReflectance.Max()   > 0;
+        const bool mirror  = mMirrorReflectance.Max()  > 0;
+        const bool glass   = mIOR > 0;
+
+        if(diffuse && !phong && !mirror && !glass)
+            mType = kPureDiffuse;
+        else if(!diffuse && !phong && mirror && !glass)
+            mType = kPureMirror;
+        else if(!diffuse && !phong && glass)
+            mType = kGlass;
+        else if(diffuse && phong && !mirror && !glass)
+            mType = kDiffuseGlossy;
+        else
+            mType = kGeneric;
+    }
+
+    // Total reflectance of all components, clamped to 1.
+    // Used as a denoising feature, not for light transport.
+    Vec3f GetAlbedo() const
+    {
+        Vec3f albedo = mDiffuseReflectance + mPhongReflectance + mMirrorReflectance;
+
+        if(mIOR > 0)
+            albedo = Vec3f(1);
+
+        for(int i=0; i<3; i++)
+            albedo.Get(i) = std::min(1.f, albedo.Get(i));
+
+        return albedo;
+    }
+
+    // Component probabilities, proportional to component albedos, and the
+    // Russian roulette continuation probability. aReflectCoeff is the Fresnel
+    // reflection coefficient of glass, 1 for other materials.
+    void GetSamplingProbabilities(
+        const float            aReflectCoeff,
+        ComponentProbabilities &oProbabilities,
+        float                  &oContinuationProb) const
+    {
+        const float albedoDiffuse = Luminance(mDiffuseReflectance);
+        const float albedoPhong   = Luminance(mPhongReflectance);
+        const float albedoReflect = aReflectCoeff         * Luminance(mMirrorReflectance);
+        const float albedoRefract = (1.f - aReflectCoeff) * (mIOR > 0.f ? 1.f : 0.f);
+
+        const float totalAlbedo = albedoDiffuse + albedoPhong + albedoReflect + albedoRefract;
+
+        if(totalAlbedo < 1e-9f)
+        {
+            oProbabilities.diffProb  = 0.f;
+            oProbabilities.phongProb = 0.f;
+            oProbabilities.reflProb  = 0.f;
+            oProbabilities.refrProb  = 0.f;
+            oContinuationProb = 0.f;
+        }
+        else
+        {
+            oProbabilities.diffProb  = albedoDiffuse / totalAlbedo;
+            oProbabilities.phongProb = albedoPhong   / totalAlbedo;
+            oProbabilities.reflProb  = albedoReflect / totalAlbedo;
+            oProbabilities.refrProb  = albedoRefract / totalAlbedo;
+            // The continuation probability is max component from reflectance.
+            // That way the weight of sample will never rise.
+            // Luminance is another very valid option.
+            oContinuationProb =
+                (mDiffuseReflectance +
+                mPhongReflectance +
+                aReflectCoeff * mMirrorReflectance).Max() +
+                (1.f - aReflectCoeff);
+
+            oContinuationProb = std::min(1.f, std::max(0.f, oContinuationProb));
+        }
     }
 
     // diffuse is simply added to the others
@@ -63,6 +179,32 @@ public:
 
     // When mIOR >= 0, we also transmit (just clear glass)
     float mIOR;
+
+    // Which BSDF fast path to use, see Classify()
+    Type  mType;
+
+    // Textures (of Scene::mTextureCache) multiplying the diffuse and
+    // Phong reflectance, < 0 ~ none
+    int   mDiffuseTexture;
+    int   mPhongTexture;
+
+    // Planar projection of textures, uv = ((p - origin).U, (p - origin).V),
+    // the length of U and V is uv units per world unit
+    Vec3f mTextureOrigin;
+    Vec3f mTextureU;
+    Vec3f mTextureV;
+};
+
+// Sampling data of a material that does not depend on the hit,
+// precomputed by Scene::CompileMaterials()
+struct MaterialSampling
+{
+    ComponentProbabilities mProbabilities;
+    float          mContinuationProb;
+    bool           mIsDelta;      //!< Purely specular
+    bool           mUsesFresnel;  //!< Glass, the above depend on the incident direction
+    bool           mIsTextured;   //!< The above depend on the hit point
+    Material::Type mType;         //!< BSDF fast path, generic for black materials
 };
 
 #endif //__MATERIALS_HXX__
@@ -160,6 +160,17 @@ Vec3f Normalize(const Vec3f& a)
     return a / len;
 }
 
+// Inserts two zero bits above each of the low 10 bits, shifted copies
+// of three such values interleave into a 30 bit Morton code
+uint SpreadBits(uint aValue)
+{
+    aValue = (aValue | (aValue << 16)) & 0x030000FF;
+    aValue = (aValue | (aValue <<  8)) & 0x0300F00F;
+    aValue = (aValue | (aValue <<  4)) & 0x030C30C3;
+    aValue = (aValue | (aValue <<  2)) & 0x09249249;
+    return aValue;
+}
+
 class Mat4f
 {
 public:
@@ -0,0 +1,1051 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __MESH_HXX__
+#define __MESH_HXX__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <omp.h>
+#include "math.hxx"
+#include "fastmath.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "mappedfile.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Out-of-core triangle meshes
+//
+// Triangles are written once to a paging file, sorted along a Morton curve
+// of their centroids and cut into blocks of one memory page, so that each
+// block holds spatially close triangles. The file is mapped read-only and
+// only the pages of blocks that rays reach become resident. They are clean
+// file pages, so under memory pressure the system drops them and reads
+// them again later, instead of running out of memory. Only block bounds
+// are kept in memory.
+
+// Per-vertex transform for PagedMesh::TransformVertices, rotates about a
+// vertical axis through mPivot by mAngle, plus mTwist growing linearly
+// with height from mPivot up to mHeight above it, scales about mPivot
+// by mScale, and moves by mMove
+struct MeshTransform
+{
+    Vec3f operator()(const Vec3f &aPoint) const
+    {
+        const float angle = mAngle + mTwist * (aPoint.z - mPivot.z) / mHeight;
+        float sinA, cosA;
+        FastSinCos(angle, sinA, cosA);
+        const float dx    = aPoint.x - mPivot.x;
+        const float dy    = aPoint.y - mPivot.y;
+        const float dz    = aPoint.z - mPivot.z;
+
+        const float c     = mScale * cosA;
+        const float s     = mScale * sinA;
+
+        return Vec3f(mPivot.x + mMove.x + c * dx - s * dy,
+            mPivot.y + mMove.y + s * dx + c * dy,
+            aPoint.z + mMove.z + (mScale - 1.f) * dz);
+    }
+
+    Vec3f mPivot;  //!< Middle of the bottom of the mesh
+    Vec3f mMove;
+    float mAngle;  //!< In radians
+    float mTwist;  //!< In radians, added at mHeight above mPivot
+    float mScale;
+    float mHeight;
+};
+
+// Triangle as stored in the paging file
+struct MeshTriangle
+{
+    Vec3f p[3];
+    Vec3f mNormal;
+    int   matID;
+};
+
+// Triangles of one page of the paging file
+class MeshBlock : public AbstractGeometry
+{
+public:
+
+    MeshBlock() :
+        mTriangles(NULL),
+        mCount(0),
+        mBBoxMin( 1e36f),
+        mBBoxMax(-1e36f)
+    {}
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        bool anyIntersection = false;
+
+        for(int i=0; i<mCount; i++)
+        {
+            const MeshTriangle &tri = mTriangles[i];
+
+            if(IntersectTriangle(tri.p, tri.mNormal, tri.matID, aRay, oResult))
+                anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        for(int i=0; i<mCount; i++)
+        {
+            const MeshTriangle &tri = mTriangles[i];
+
+            if(IntersectTriangle(tri.p, tri.mNormal, tri.matID, aRay, oResult))
+                return true;
+        }
+
+        return false;
+    }
+
+    // Uses the stored bounds, does not touch the page
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        for(int j=0; j<3; j++)
+        {
+            aoBBoxMin.Get(j) = std::min(aoBBoxMin.Get(j), mBBoxMin.Get(j));
+            aoBBoxMax.Get(j) = std::max(aoBBoxMax.Get(j), mBBoxMax.Get(j));
+        }
+    }
+
+public:
+
+    const MeshTriangle *mTriangles; //!< In the mapped paging file
+    int                mCount;
+    Vec3f              mBBoxMin, mBBoxMax;
+};
+
+class PagedMesh : public AbstractGeometry
+{
+public:
+
+    enum { kPageBytes      = 4096 };
+    enum { kBlockTriangles = kPageBytes / sizeof(MeshTriangle) };
+
+    // Loading sorts this many triangles in memory at once (about 15 MB),
+    // and merges the sorted runs reading this many triangles of each ahead
+    enum { kSortChunkTriangles = 1 << 18 };
+    enum { kMergeBufferRecords = 64 };
+
+    PagedMesh() :
+        mTriangleCount(0),
+        mBBoxMin( 1e36f),
+        mBBoxMax(-1e36f),
+        mRestBBoxMin( 1e36f),
+        mRestBBoxMax(-1e36f),
+        mCached(false),
+        mFromCache(false)
+    {}
+
+    // Cached paging files stay for later runs
+    virtual ~PagedMesh()
+    {
+        mMapping.Close();
+        mFrameMapping.Close();
+
+        if(mPagingFile.length() > 0)
+        {
+            if(!mCached)
+                remove(mPagingFile.c_str());
+            remove(mFramePagingFile.c_str());
+        }
+    }
+
+    // Loads a Wavefront .obj file (vertex positions and faces, polygons
+    // are split into fans) into a paging file, <aObjFile>.pages deleted
+    // with the mesh. The mesh is scaled to fit the box keeping its
+    // proportions, centered in x and y and standing on the bottom of the
+    // box. Returns false on error.
+    //
+    // With aCacheDir, the paging file is kept there, named by a hash of
+    // the .obj contents and the placement, and later runs map it instead
+    // of loading the .obj again.
+    bool Load(
+        const char        *aObjFile,
+        const std::string &aCacheDir,
+        const Vec3f       &aBoxMin,
+        const Vec3f       &aBoxMax,
+        const int         aMatID)
+    {
+        unsigned long long key = 0;
+        std::string pagingFile = std::string(aObjFile) + ".pages";
+
+        if(!aCacheDir.empty())
+        {
+            if(!GetCacheKey(aObjFile, aBoxMin, aBoxMax, aMatID, key))
+                return false;
+
+            char name[32];
+            sprintf(name, "mesh_%016llx.pages", key);
+
+            pagingFile = aCacheDir;
+            if(pagingFile[pagingFile.length()-1] != '/' &&
+               pagingFile[pagingFile.length()-1] != '\\')
+                pagingFile += '/';
+            pagingFile += name;
+
+            mFromCache = MapPagingFile(pagingFile, key);
+            mCached    = mFromCache;
+        }
+
+        // Each run transforms the mesh in its own file
+        char suffix[32];
+        sprintf(suffix, ".%x", (unsigned)(omp_get_wtime() * 1e6));
+        mFramePagingFile = pagingFile + suffix + ".frame";
+
+        if(mFromCache)
+        {
+            mPagingFile = pagingFile;
+            return true;
+        }
+
+        // Cache files are written under a temporary name first, so that
+        // concurrent runs never see a partial file
+        const std::string writtenFile = aCacheDir.empty() ?
+            pagingFile : pagingFile + suffix + ".tmp";
+
+        if(!WriteMesh(aObjFile, writtenFile, key, aBoxMin, aBoxMax, aMatID))
+        {
+            remove(writtenFile.c_str());
+            return false;
+        }
+
+        mPagingFile = writtenFile;
+
+        if(!aCacheDir.empty())
+        {
+            // Another run may have saved the same file meanwhile
+            mCached = rename(writtenFile.c_str(), pagingFile.c_str()) == 0;
+            if(!mCached)
+            {
+                remove(pagingFile.c_str());
+                mCached = rename(writtenFile.c_str(), pagingFile.c_str()) == 0;
+            }
+
+            if(mCached)
+                mPagingFile = pagingFile;
+            else
+                printf("Cannot write mesh cache %s\n", pagingFile.c_str());
+        }
+
+        if(!MapPagingFile(mPagingFile, key))
+        {
+            printf("Cannot map mesh paging file %s\n", mPagingFile.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const Vec3f invDir = Vec3f(1.f) / aRay.dir;
+        bool anyIntersection = false;
+
+        for(size_t i=0; i<mBlocks.size(); i++)
+        {
+            if(!HitsBox(mBlocks[i], aRay, invDir, oResult.dist))
+                continue;
+
+            if(mBlocks[i].Intersect(aRay, oResult))
+                anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const Vec3f invDir = Vec3f(1.f) / aRay.dir;
+
+        for(size_t i=0; i<mBlocks.size(); i++)
+        {
+            if(HitsBox(mBlocks[i], aRay, invDir, oResult.dist) &&
+               mBlocks[i].IntersectP(aRay, oResult))
+                return true;
+        }
+
+        return false;
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        for(int j=0; j<3; j++)
+        {
+            aoBBoxMin.Get(j) = std::min(aoBBoxMin.Get(j), mBBoxMin.Get(j));
+            aoBBoxMax.Get(j) = std::max(aoBBoxMax.Get(j), mBBoxMax.Get(j));
+        }
+    }
+
+    // Blocks are bounded separately
+    virtual void GetParts(std::vector<AbstractGeometry*> &aoParts)
+    {
+        for(size_t i=0; i<mBlocks.size(); i++)
+            aoParts.push_back(&mBlocks[i]);
+    }
+
+    // Moves vertices of the loaded (rest) mesh by aTransform, a functor
+    // from rest positions to new ones. The moved triangles are written to
+    // their own paging file, page by page as in Load, so the mesh still
+    // does not have to fit in memory. Blocks keep their triangles, only
+    // their bounds change. Returns false on error.
+    template<typename tTransform>
+    bool TransformVertices(const tTransform &aTransform)
+    {
+        const std::string &frameFile = mFramePagingFile;
+
+        // The file is rewritten, it must not stay mapped meanwhile
+        mFrameMapping.Close();
+
+        FILE *file = fopen(frameFile.c_str(), "wb");
+        if(!file)
+        {
+            printf("Cannot create mesh paging file %s\n", frameFile.c_str());
+            return false;
+        }
+
+        std::vector<char> page(kPageBytes);
+        MeshTriangle *triangles = (MeshTriangle*)&page[0];
+        bool ok = true;
+
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+
+        for(size_t i=0; ok && i<mBlocks.size(); i++)
+        {
+            MeshBlock &block = mBlocks[i];
+            const MeshTriangle *rest =
+                (const MeshTriangle*)(mMapping.GetData() + i * kPageBytes);
+
+            memset(&page[0], 0, kPageBytes);
+            block.mBBoxMin = Vec3f( 1e36f);
+            block.mBBoxMax = Vec3f(-1e36f);
+
+            for(int k=0; k<block.mCount; k++)
+            {
+                MeshTriangle &tri = triangles[k];
+                tri.matID = rest[k].matID;
+
+                for(int v=0; v<3; v++)
+                {
+                    tri.p[v] = aTransform(rest[k].p[v]);
+
+                    for(int j=0; j<3; j++)
+                    {
+                        block.mBBoxMin.Get(j) = std::min(block.mBBoxMin.Get(j), tri.p[v].Get(j));
+                        block.mBBoxMax.Get(j) = std::max(block.mBBoxMax.Get(j), tri.p[v].Get(j));
+                    }
+                }
+
+                // Triangles that collapsed keep a zero normal, never hit
+                tri.mNormal = Cross(tri.p[1] - tri.p[0], tri.p[2] - tri.p[0]);
+                if(Dot(tri.mNormal, tri.mNormal) > 0.f)
+                    tri.mNormal = Normalize(tri.mNormal);
+            }
+
+            ok = fwrite(&page[0], kPageBytes, 1, file) == 1;
+            block.GrowBBox(mBBoxMin, mBBoxMax);
+        }
+
+        ok = (fclose(file) == 0) && ok;
+
+        if(!ok || !mFrameMapping.Open(frameFile.c_str(), true))
+        {
+            printf("Cannot write mesh paging file %s\n", frameFile.c_str());
+            return false;
+        }
+
+        for(size_t i=0; i<mBlocks.size(); i++)
+        {
+            mBlocks[i].mTriangles =
+                (const MeshTriangle*)(mFrameMapping.GetData() + i * kPageBytes);
+        }
+
+        return true;
+    }
+
+    // Bounds of the mesh at rest, as loaded
+    void GetRestBBox(Vec3f &oBBoxMin, Vec3f &oBBoxMax) const
+    {
+        oBBoxMin = mRestBBoxMin;
+        oBBoxMax = mRestBBoxMax;
+    }
+
+    int  GetTriangleCount() const { return mTriangleCount; }
+    int  GetBlockCount()    const { return (int)mBlocks.size(); }
+    bool IsFromCache()      const { return mFromCache; }
+
+    // Blocks whose page is in memory now, -1 when the system cannot tell
+    int GetResidentBlockCount() const
+    {
+        const MappedFile &mapping = mFrameMapping.GetData() ? mFrameMapping : mMapping;
+        return mapping.GetResidentPageCount(kPageBytes, mBlocks.size() * kPageBytes);
+    }
+
+private:
+
+    enum { kPagingVersion = 1 };
+
+    // Bounds of a block, stored after the pages
+    struct BlockBounds
+    {
+        Vec3f mBBoxMin, mBBoxMax;
+        int   mCount;
+    };
+
+    // Paging file ends with the bounds of all its blocks and this, so
+    // that a cached file is mapped without touching its pages
+    struct PagingFooter
+    {
+        char               mMagic[8];
+        unsigned long long mKey;
+        int                mBlockCount;
+        int                mVersion;
+    };
+
+    // FNV-1a hash of the .obj contents and everything else the paging
+    // file depends on
+    static bool GetCacheKey(
+        const char         *aObjFile,
+        const Vec3f        &aBoxMin,
+        const Vec3f        &aBoxMax,
+        const int          aMatID,
+        unsigned long long &oKey)
+    {
+        FILE *file = fopen(aObjFile, "rb");
+        if(!file)
+        {
+            printf("Cannot open mesh %s\n", aObjFile);
+            return false;
+        }
+
+        const int params[] = {kPagingVersion, kPageBytes,
+            (int)sizeof(MeshTriangle), aMatID};
+
+        oKey = HashBytes(kHashSeed, params, sizeof(params));
+        oKey = HashBytes(oKey, &aBoxMin, sizeof(Vec3f));
+        oKey = HashBytes(oKey, &aBoxMax, sizeof(Vec3f));
+
+        std::vector<char> buffer(1 << 16);
+        size_t count;
+        while((count = fread(&buffer[0], 1, buffer.size(), file)) > 0)
+            oKey = HashBytes(oKey, &buffer[0], count);
+
+        const bool ok = ferror(file) == 0;
+        fclose(file);
+
+        if(!ok)
+            printf("Cannot read mesh %s\n", aObjFile);
+
+        return ok;
+    }
+
+    // Writes the paging file of the .obj. Neither the .obj nor its
+    // triangles have to fit in memory. The .obj is read twice: first its
+    // vertices go to a temporary file, which is then mapped while the
+    // faces are read, sorted in chunks and written as runs to another
+    // temporary file. The runs are merged into pages.
+    static bool WriteMesh(
+        const char               *aObjFile,
+        const std::string        &aPagingFile,
+        const unsigned long long aKey,
+        const Vec3f              &aBoxMin,
+        const Vec3f              &aBoxMax,
+        const int                aMatID)
+    {
+        const std::string vertexFile = aPagingFile + ".vertices";
+        const std::string runFile    = aPagingFile + ".runs";
+
+        Vec3f objMin( 1e36f);
+        Vec3f objMax(-1e36f);
+
+        if(!WriteVertexFile(aObjFile, vertexFile.c_str(), objMin, objMax))
+        {
+            remove(vertexFile.c_str());
+            return false;
+        }
+
+        // No vertices leave nothing to map, any face is then invalid
+        MappedFile vertices;
+        const bool hasVertices = objMin.x <= objMax.x;
+        bool       ok = true;
+
+        if(hasVertices && !vertices.Open(vertexFile.c_str(), true))
+        {
+            printf("Cannot map mesh vertex file %s\n", vertexFile.c_str());
+            ok = false;
+        }
+
+        std::vector<int> runSizes;
+        int faceCount = 0;
+
+        ok = ok && WriteSortedRuns(aObjFile, runFile.c_str(),
+            (const Vec3f*)vertices.GetData(), int(vertices.GetSize() / sizeof(Vec3f)),
+            Placement(objMin, objMax, aBoxMin, aBoxMax), aMatID, runSizes, faceCount);
+
+        vertices.Close();
+        remove(vertexFile.c_str());
+
+        if(ok && faceCount == 0)
+        {
+            printf("Mesh %s has no faces\n", aObjFile);
+            ok = false;
+        }
+
+        ok = ok && WritePagingFile(aPagingFile.c_str(), aKey, runFile.c_str(), runSizes);
+        remove(runFile.c_str());
+
+        return ok;
+    }
+
+    // Scales and moves .obj vertices to fit a box, keeping proportions,
+    // centered in x and y and standing on the bottom of the box
+    struct Placement
+    {
+        Placement(
+            const Vec3f &aObjMin,
+            const Vec3f &aObjMax,
+            const Vec3f &aBoxMin,
+            const Vec3f &aBoxMax)
+        {
+            mScale = 1e36f;
+            for(int j=0; j<3; j++)
+            {
+                if(aObjMax.Get(j) > aObjMin.Get(j))
+                    mScale = std::min(mScale,
+                        (aBoxMax.Get(j) - aBoxMin.Get(j)) / (aObjMax.Get(j) - aObjMin.Get(j)));
+            }
+
+            mObjBase = Vec3f((aObjMin.x + aObjMax.x) * 0.5f,
+                (aObjMin.y + aObjMax.y) * 0.5f, aObjMin.z);
+            mBoxBase = Vec3f((aBoxMin.x + aBoxMax.x) * 0.5f,
+                (aBoxMin.y + aBoxMax.y) * 0.5f, aBoxMin.z);
+
+            mMin = (*this)(aObjMin);
+            mMax = (*this)(aObjMax);
+        }
+
+        Vec3f operator()(const Vec3f &aPoint) const
+        {
+            return mBoxBase + (aPoint - mObjBase) * mScale;
+        }
+
+        Vec3f mObjBase, mBoxBase;
+        float mScale;
+        Vec3f mMin, mMax; //!< Bounds of the placed vertices
+    };
+
+    // Triangle with its Morton code, as sorted in the runs
+    struct SortRecord
+    {
+        // Face index orders triangles with equal codes
+        unsigned long long GetSortKey() const
+        {
+            return ((unsigned long long)mCode << 32) | uint(mFaceIndex);
+        }
+
+        bool operator<(const SortRecord &aOther) const
+        {
+            return GetSortKey() < aOther.GetSortKey();
+        }
+
+        uint         mCode;
+        int          mFaceIndex;
+        MeshTriangle mTriangle;
+    };
+
+    // Reads one sorted run of the run file through a small buffer
+    struct RunReader
+    {
+        RunReader() : mOffset(0), mLeft(0), mPos(0), mEnd(0) {}
+
+        // Next record of the run, false at its end or on read error
+        bool Next(FILE *aFile, SortRecord &oRecord)
+        {
+            if(mPos == mEnd)
+            {
+                const int count = std::min(mLeft, int(kMergeBufferRecords));
+                mBuffer.resize(kMergeBufferRecords);
+
+                if(count == 0 || !Seek(aFile, mOffset) ||
+                   fread(&mBuffer[0], sizeof(SortRecord), count, aFile) != size_t(count))
+                    return false;
+
+                mOffset += count * (long long)sizeof(SortRecord);
+                mLeft   -= count;
+                mPos     = 0;
+                mEnd     = count;
+            }
+
+            oRecord = mBuffer[mPos++];
+            return true;
+        }
+
+        long long mOffset; //!< Of the first record not read yet
+        int       mLeft;   //!< Records not read yet
+        int       mPos, mEnd;
+        std::vector<SortRecord> mBuffer;
+    };
+
+    static bool Seek(FILE *aFile, long long aOffset)
+    {
+#if defined(_MSC_VER)
+        return _fseeki64(aFile, aOffset, SEEK_SET) == 0;
+#else
+        return fseeko(aFile, off_t(aOffset), SEEK_SET) == 0;
+#endif
+    }
+
+    // First pass over the .obj, writes vertex positions to aVertexFile
+    // and grows their bounds
+    static bool WriteVertexFile(
+        const char *aObjFile,
+        const char *aVertexFile,
+        Vec3f      &aoObjMin,
+        Vec3f      &aoObjMax)
+    {
+        FILE *obj = fopen(aObjFile, "r");
+        if(!obj)
+        {
+            printf("Cannot open mesh %s\n", aObjFile);
+            return false;
+        }
+
+        FILE *file = fopen(aVertexFile, "wb");
+        if(!file)
+        {
+            printf("Cannot create mesh vertex file %s\n", aVertexFile);
+            fclose(obj);
+            return false;
+        }
+
+        bool valid   = true;
+        bool written = true;
+        char line[4096];
+
+        while(valid && written && fgets(line, sizeof(line), obj))
+        {
+            if(line[0] != 'v' || line[1] != ' ')
+                continue;
+
+            Vec3f v;
+            valid   = sscanf(line + 2, "%f %f %f", &v.x, &v.y, &v.z) == 3;
+            written = fwrite(&v, sizeof(v), 1, file) == 1;
+
+            for(int j=0; j<3; j++)
+            {
+                aoObjMin.Get(j) = std::min(aoObjMin.Get(j), v.Get(j));
+                aoObjMax.Get(j) = std::max(aoObjMax.Get(j), v.Get(j));
+            }
+        }
+
+        fclose(obj);
+        written = (fclose(file) == 0) && written;
+
+        if(!valid)
+            printf("Mesh %s is not a valid .obj file\n", aObjFile);
+        else if(!written)
+            printf("Cannot write mesh vertex file %s\n", aVertexFile);
+
+        return valid && written;
+    }
+
+    // Second pass over the .obj, splits faces into triangles and writes
+    // them to aRunFile in runs of up to kSortChunkTriangles, each sorted by
+    // Morton code of the triangle centroids. Degenerate triangles have no
+    // normal and are never hit, they are left out.
+    static bool WriteSortedRuns(
+        const char       *aObjFile,
+        const char       *aRunFile,
+        const Vec3f      *aVertices,
+        const int        aVertexCount,
+        const Placement  &aPlacement,
+        const int        aMatID,
+        std::vector<int> &oRunSizes,
+        int              &oFaceCount)
+    {
+        FILE *obj = fopen(aObjFile, "r");
+        if(!obj)
+        {
+            printf("Cannot open mesh %s\n", aObjFile);
+            return false;
+        }
+
+        FILE *file = fopen(aRunFile, "wb");
+        if(!file)
+        {
+            printf("Cannot create mesh sort file %s\n", aRunFile);
+            fclose(obj);
+            return false;
+        }
+
+        const Vec3f toGrid = Vec3f(1023.f) /
+            (aPlacement.mMax - aPlacement.mMin + Vec3f(1e-20f));
+
+        std::vector<SortRecord> chunk;
+        chunk.reserve(kSortChunkTriangles);
+
+        int  vertexCount = 0;
+        bool valid   = true;
+        bool written = true;
+        char line[4096];
+
+        while(valid && written && fgets(line, sizeof(line), obj))
+        {
+            // Never past the vertices of the first pass, should the file
+            // have grown meanwhile
+            if(line[0] == 'v' && line[1] == ' ')
+                vertexCount = std::min(vertexCount + 1, aVertexCount);
+
+            if(line[0] != 'f' || line[1] != ' ')
+                continue;
+
+            // Indices are 1-based, or negative counting from the last
+            // vertex. Texture and normal indices after '/' are skipped.
+            int  corners[3];
+            int  count = 0;
+            char *token = strtok(line + 2, " \t\r\n");
+
+            for(; valid && written && token; token = strtok(NULL, " \t\r\n"), count++)
+            {
+                int idx = atoi(token);
+                idx = (idx < 0) ? vertexCount + idx : idx - 1;
+                valid = idx >= 0 && idx < vertexCount;
+
+                if(!valid)
+                    break;
+
+                if(count < 2)
+                {
+                    corners[count] = idx;
+                    continue;
+                }
+
+                corners[2] = idx;
+
+                SortRecord   record;
+                MeshTriangle &tri = record.mTriangle;
+
+                record.mFaceIndex = oFaceCount++;
+                for(int k=0; k<3; k++)
+                    tri.p[k] = aPlacement(aVertices[corners[k]]);
+                tri.mNormal = Cross(tri.p[1] - tri.p[0], tri.p[2] - tri.p[0]);
+                tri.matID   = aMatID;
+
+                corners[1] = corners[2];
+
+                if(Dot(tri.mNormal, tri.mNormal) == 0.f)
+                    continue;
+
+                tri.mNormal = Normalize(tri.mNormal);
+
+                const Vec3f centroid = (tri.p[0] + tri.p[1] + tri.p[2]) * (1.f / 3.f);
+                const Vec3f gridPt   = (centroid - aPlacement.mMin) * toGrid;
+
+                record.mCode = 0;
+                for(int j=0; j<3; j++)
+                    record.mCode |= SpreadBits(uint(gridPt.Get(j))) << j;
+
+                chunk.push_back(record);
+                if((int)chunk.size() == kSortChunkTriangles)
+                    written = WriteRun(file, chunk, oRunSizes);
+            }
+        }
+
+        if(valid && written && !chunk.empty())
+            written = WriteRun(file, chunk, oRunSizes);
+
+        fclose(obj);
+        written = (fclose(file) == 0) && written;
+
+        if(!valid)
+            printf("Mesh %s is not a valid .obj file\n", aObjFile);
+        else if(!written)
+            printf("Cannot write mesh sort file %s\n", aRunFile);
+
+        return valid && written;
+    }
+
+    // Sorts the chunk and appends it to aFile as one run
+    static bool WriteRun(
+        FILE                    *aFile,
+        std::vector<SortRecord> &aoChunk,
+        std::vector<int>        &aoRunSizes)
+    {
+        std::sort(aoChunk.begin(), aoChunk.end());
+
+        const bool ok = fwrite(&aoChunk[0], sizeof(SortRecord),
+            aoChunk.size(), aFile) == aoChunk.size();
+
+        aoRunSizes.push_back((int)aoChunk.size());
+        aoChunk.clear();
+        return ok;
+    }
+
+    // Merges the sorted runs into the paging file, one block of spatially
+    // close triangles per page, followed by the block bounds and footer.
+    // Only a buffer per run and the page being filled are in memory.
+    static bool WritePagingFile(
+        const char               *aPagingFile,
+        const unsigned long long aKey,
+        const char               *aRunFile,
+        const std::vector<int>   &aRunSizes)
+    {
+        FILE *runs = fopen(aRunFile, "rb");
+        FILE *file = runs ? fopen(aPagingFile, "wb") : NULL;
+        if(!file)
+        {
+            printf("Cannot create mesh paging file %s\n", aPagingFile);
+            if(runs)
+                fclose(runs);
+            return false;
+        }
+
+        typedef std::pair<unsigned long long, int> QueueEntry;
+        std::priority_queue<QueueEntry, std::vector<QueueEntry>,
+            std::greater<QueueEntry> > queue;
+
+        // Next record of each run, queued by its sort key
+        std::vector<RunReader>  readers(aRunSizes.size());
+        std::vector<SortRecord> heads(aRunSizes.size());
+        long long offset = 0;
+        int       total  = 0;
+
+        for(size_t r=0; r<aRunSizes.size(); r++)
+        {
+            readers[r].mOffset = offset;
+            readers[r].mLeft   = aRunSizes[r];
+            offset += aRunSizes[r] * (long long)sizeof(SortRecord);
+            total  += aRunSizes[r];
+
+            if(readers[r].Next(runs, heads[r]))
+                queue.push(QueueEntry(heads[r].GetSortKey(), int(r)));
+        }
+
+        std::vector<char>        page(kPageBytes);
+        std::vector<BlockBounds> blocks;
+        MeshTriangle *triangles = (MeshTriangle*)&page[0];
+        BlockBounds  block;
+        int          merged = 0;
+        bool         ok = true;
+
+        block.mCount = 0;
+        while(ok && !queue.empty())
+        {
+            const int r = queue.top().second;
+            queue.pop();
+
+            const MeshTriangle &tri = heads[r].mTriangle;
+
+            if(block.mCount == 0)
+            {
+                memset(&page[0], 0, kPageBytes);
+                block.mBBoxMin = Vec3f( 1e36f);
+                block.mBBoxMax = Vec3f(-1e36f);
+            }
+
+            triangles[block.mCount++] = tri;
+            for(int k=0; k<3; k++)
+            {
+                for(int j=0; j<3; j++)
+                {
+                    block.mBBoxMin.Get(j) = std::min(block.mBBoxMin.Get(j), tri.p[k].Get(j));
+                    block.mBBoxMax.Get(j) = std::max(block.mBBoxMax.Get(j), tri.p[k].Get(j));
+                }
+            }
+
+            if(block.mCount == kBlockTriangles)
+                ok = WriteBlock(file, page, block, blocks);
+
+            merged++;
+            if(readers[r].Next(runs, heads[r]))
+                queue.push(QueueEntry(heads[r].GetSortKey(), r));
+        }
+
+        // Partially filled last block
+        if(ok && block.mCount > 0)
+            ok = WriteBlock(file, page, block, blocks);
+
+        PagingFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        memcpy(footer.mMagic, "SVCMMSH", 8);
+        footer.mKey        = aKey;
+        footer.mBlockCount = (int)blocks.size();
+        footer.mVersion    = kPagingVersion;
+
+        if(ok && !blocks.empty())
+            ok = fwrite(&blocks[0], sizeof(BlockBounds), blocks.size(), file) == blocks.size();
+        ok = ok && fwrite(&footer, sizeof(footer), 1, file) == 1;
+
+        fclose(runs);
+        ok = (fclose(file) == 0) && ok && merged == total;
+
+        if(!ok)
+            printf("Cannot write mesh paging file %s\n", aPagingFile);
+
+        return ok;
+    }
+
+    // Writes the filled page of aoBlock and starts a new block
+    static bool WriteBlock(
+        FILE                     *aFile,
+        const std::vector<char>  &aPage,
+        BlockBounds              &aoBlock,
+        std::vector<BlockBounds> &aoBlocks)
+    {
+        const bool ok = fwrite(&aPage[0], kPageBytes, 1, aFile) == 1;
+
+        aoBlocks.push_back(aoBlock);
+        aoBlock.mCount = 0;
+        return ok;
+    }
+
+    // Maps the paging file and sets up the blocks from the bounds stored
+    // after the pages. Returns false when the file is missing or does not
+    // match aKey.
+    bool MapPagingFile(
+        const std::string        &aPagingFile,
+        const unsigned long long aKey)
+    {
+        // Blocks are visited in no particular order, read ahead would
+        // bring in pages nobody asked for
+        if(!mMapping.Open(aPagingFile.c_str(), true))
+            return false;
+
+        const size_t size = mMapping.GetSize();
+        PagingFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        if(size >= sizeof(footer))
+            memcpy(&footer, mMapping.GetData() + size - sizeof(footer), sizeof(footer));
+
+        const size_t blockCount = size_t(std::max(footer.mBlockCount, 0));
+        bool ok = memcmp(footer.mMagic, "SVCMMSH", 8) == 0 &&
+            footer.mKey == aKey && footer.mVersion == kPagingVersion &&
+            size == blockCount * (kPageBytes + sizeof(BlockBounds)) + sizeof(footer);
+
+        mBlocks.clear();
+        mBlocks.resize(ok ? blockCount : 0);
+        mTriangleCount = 0;
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+
+        for(size_t i=0; ok && i<blockCount; i++)
+        {
+            BlockBounds bounds;
+            memcpy(&bounds, mMapping.GetData() + blockCount * kPageBytes +
+                i * sizeof(BlockBounds), sizeof(BlockBounds));
+
+            // Damaged files must not make intersection leave the page
+            ok = bounds.mCount > 0 && bounds.mCount <= kBlockTriangles;
+
+            MeshBlock &block = mBlocks[i];
+            block.mTriangles =
+                (const MeshTriangle*)(mMapping.GetData() + i * kPageBytes);
+            block.mCount   = bounds.mCount;
+            block.mBBoxMin = bounds.mBBoxMin;
+            block.mBBoxMax = bounds.mBBoxMax;
+
+            mTriangleCount += block.mCount;
+            block.GrowBBox(mBBoxMin, mBBoxMax);
+        }
+
+        if(!ok)
+        {
+            mMapping.Close();
+            mBlocks.clear();
+            mTriangleCount = 0;
+            return false;
+        }
+
+        mRestBBoxMin = mBBoxMin;
+        mRestBBoxMax = mBBoxMax;
+        return true;
+    }
+
+    // Slab test of the block bounds against the ray segment
+    static bool HitsBox(
+        const MeshBlock &aBlock,
+        const Ray       &aRay,
+        const Vec3f     &aInvDir,
+        const float     aMaxDist)
+    {
+        float tNear = aRay.tmin;
+        float tFar  = aMaxDist;
+
+        for(int j=0; j<3; j++)
+        {
+            float t0 = (aBlock.mBBoxMin.Get(j) - aRay.org.Get(j)) * aInvDir.Get(j);
+            float t1 = (aBlock.mBBoxMax.Get(j) - aRay.org.Get(j)) * aInvDir.Get(j);
+
+            if(t0 > t1) std::swap(t0, t1);
+
+            // Slightly conservative, so that rounding does not lose hits
+            // at the block bounds
+            tNear = std::max(tNear, t0);
+            tFar  = std::min(tFar,  t1 * 1.0000004f);
+        }
+
+        return tNear <= tFar;
+    }
+
+private:
+
+    std::vector<MeshBlock> mBlocks;
+    std::string mPagingFile;
+    std::string mFramePagingFile; //!< Of this run, also when mCached
+    MappedFile  mMapping;      //!< Of mPagingFile, the rest pose
+    MappedFile  mFrameMapping; //!< Of transformed triangles, once there are any
+    int         mTriangleCount;
+    Vec3f       mBBoxMin, mBBoxMax;
+    Vec3f       mRestBBoxMin, mRestBBoxMax;
+    bool        mCached;    //!< Paging file is in the cache, kept after the run
+    bool        mFromCache; //!< Paging file was there before the run
+};
+
+#endif //__MESH_HXX__
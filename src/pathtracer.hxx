@@ -48,17 +48,23 @@ public:
         const int   lightCount    = mScene.GetLightCount();
         const float lightPickProb = 1.f / lightCount;
 
-        const int resX = int(mScene.mCamera.mResolution.x);
-        const int resY = int(mScene.mCamera.mResolution.y);
+        // Only pixels within the crop window are traced,
+        // in preview iterations one path per block of pixels
+        const int pixelCount = mScene.mCamera.CropBlockCount(mBlockSize);
+        CameraRayBatch cameraRays;
 
-        for(int pixID = 0; pixID < resX * resY; pixID++)
+        for(int pixID = 0; pixID < pixelCount; pixID++)
         {
-            const int x = pixID % resX;
-            const int y = pixID / resX;
+            // Camera rays are generated a batch at a time
+            const int batchIdx = pixID % CameraRayBatch::kSize;
+            if(batchIdx == 0)
+                GenerateCameraBatch(pixID, pixelCount, 1, false, mRng, cameraRays);
 
-            const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
+            const Vec2i &blockMin  = cameraRays.mBlockMin[batchIdx];
+            const Vec2i &blockSize = cameraRays.mBlockSize[batchIdx];
+            const Vec2f sample     = cameraRays.GetSample(batchIdx);
 
-            Ray   ray = mScene.mCamera.GenerateRay(sample);
+            Ray   ray = cameraRays.GetRay(batchIdx);
             Isect isect;
             isect.dist = 1e36f;
 
@@ -67,6 +73,8 @@ public:
             uint  pathLength   = 1;
             bool  lastSpecular = true;
             float lastPdfW     = 1;
+            float pathDistance = 0;    // Length of the path, for features
+            bool  needFeatures = true; // Features not recorded yet
 
             for(;; ++pathLength)
             {
@@ -93,6 +101,7 @@ public:
                     }
 
                     color += pathWeight * misWeight * contrib;
+                    mGuide.AddPathContrib(pathWeight * misWeight * contrib);
                     break;
                 }
 
@@ -103,6 +112,14 @@ public:
                 if(!bsdf.IsValid())
                     break;
 
+                // Features (AOVs), from first non-specular surface or light
+                pathDistance += isect.dist;
+                if(needFeatures && (!bsdf.IsDelta() || isect.lightID >= 0))
+                {
+                    AddFeatures(sample, ray, isect, pathDistance);
+                    needFeatures = false;
+                }
+
                 // directly hit some light, lights do not reflect
                 if(isect.lightID >= 0)
                 {
@@ -125,6 +142,7 @@ public:
                     }
 
                     color += pathWeight * misWeight * contrib;
+                    mGuide.AddPathContrib(pathWeight * misWeight * contrib);
                     break;
                 }
 
@@ -156,6 +174,7 @@ public:
                             float weight = 1.f;
                             if(!light->IsDelta())
                             {
+                                bsdfPdfW = GuidedPdf(bsdf, hitPoint, directionToLight, bsdfPdfW);
                                 const float contProb = bsdf.ContinuationProb();
                                 bsdfPdfW *= contProb;
                                 weight = Mis2(directPdfW * lightPickProb, bsdfPdfW);
@@ -167,6 +186,7 @@ public:
                             if(!mScene.Occluded(hitPoint, directionToLight, distance))
                             {
                                 color += pathWeight * contrib;
+                                mGuide.AddPathContrib(pathWeight * contrib);
                             }
                         }
                     }
@@ -178,7 +198,7 @@ public:
                     float pdf, cosThetaOut;
                     uint  sampledEvent;
 
-                    Vec3f factor = bsdf.Sample(mScene, rndTriplet, ray.dir,
+                    Vec3f factor = GuidedSample(bsdf, hitPoint, rndTriplet, ray.dir,
                         pdf, cosThetaOut, &sampledEvent);
 
                     if(factor.IsZero())
@@ -189,6 +209,7 @@ public:
 
                     lastSpecular = (sampledEvent & BSDF<true>::kSpecular) != 0;
                     lastPdfW     = pdf * contProb;
+                    const float dirPdfW = pdf;
 
                     if(contProb < 1.f)
                     {
@@ -200,6 +221,11 @@ public:
                     }
 
                     pathWeight *= factor * (cosThetaOut / pdf);
+
+                    // Guide learns incident radiance at vertices it can guide
+                    if(!bsdf.IsDelta() && !bsdf.HasSpecular())
+                        mGuide.AddPathVertex(hitPoint, ray.dir, pathWeight, dirPdfW);
+
                     // We offset ray origin instead of setting tmin due to numeric
                     // issues in ray-sphere intersection. The isect.dist has to be
                     // extended by this EPS_RAY after hitpoint is determined
@@ -208,13 +234,17 @@ public:
                     isect.dist = 1e36f;
                 }
             }
-            mFramebuffer.AddColor(sample, color);
+            mGuide.EndPath();
+            AddSampleColor(blockMin, blockSize, sample, color);
+            // Path tracing uses only camera paths hitting or sampling lights
+            AddTechniqueColors(sample, color, Vec3f(0), Vec3f(0));
         }
 
         mIterations++;
+        mGuide.EndIteration();
     }
 
-private:
+protected:
 
     // Mis power (1 for balance heuristic)
     float Mis(float aPdf) const
@@ -230,7 +260,7 @@ private:
         return Mis(aSamplePdf) / (Mis(aSamplePdf) + Mis(aOtherPdf));
     }
 
-private:
+protected:
 
     Rng mRng;
 };
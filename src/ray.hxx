@@ -64,4 +64,53 @@ struct Isect
     Vec3f normal;  //!< Normal at the intersection
 };
 
+// Rays tested together by AbstractGeometry::IntersectBatch. Origins,
+// directions and current distances are also kept in structure of arrays
+// layout, so that tests can run over all rays in fixed loops. Lanes past
+// mCount never hit (negative distance).
+struct RayBatch
+{
+    enum { kSize = 64 };
+
+    void Setup(
+        const Ray *aRays,
+        Isect     *aoResults,
+        int       *aoHit,
+        const int aCount)
+    {
+        mRays    = aRays;
+        mResults = aoResults;
+        mHit     = aoHit;
+        mCount   = aCount;
+
+        for(int i=0; i<kSize; i++)
+        {
+            const int   idx   = (i < aCount) ? i : 0;
+            const Ray   &ray  = aRays[idx];
+            mOrgX[i] = ray.org.x;
+            mOrgY[i] = ray.org.y;
+            mOrgZ[i] = ray.org.z;
+            mDirX[i] = ray.dir.x;
+            mDirY[i] = ray.dir.y;
+            mDirZ[i] = ray.dir.z;
+            mTMin[i] = ray.tmin;
+            mDist[i] = (i < aCount) ? aoResults[i].dist : -1.f;
+        }
+    }
+
+    const Ray *mRays;
+    Isect     *mResults;
+    int       *mHit;       //!< Set for rays that hit, kept for the others
+    int       mCount;
+
+    float     mOrgX[kSize];
+    float     mOrgY[kSize];
+    float     mOrgZ[kSize];
+    float     mDirX[kSize];
+    float     mDirY[kSize];
+    float     mDirZ[kSize];
+    float     mTMin[kSize];
+    float     mDist[kSize]; //!< Same as mResults[i].dist
+};
+
 #endif //__RAY_HXX__
@@ -29,6 +29,9 @@
 #include <cmath>
 #include "scene.hxx"
 #include "framebuffer.hxx"
+#include "bsdf.hxx"
+#include "guiding.hxx"
+#include "rng.hxx"
 
 class AbstractRenderer
 {
@@ -39,13 +42,32 @@ public:
         mMinPathLength = 0;
         mMaxPathLength = 2;
         mIterations = 0;
+        mPreviewIterations = 0;
+        mBlockSize = 1;
+        mGatherFeatures = false;
         mFramebuffer.Setup(aScene.mCamera.mResolution);
+        mPreviewFramebuffer.Setup(aScene.mCamera.mResolution);
     }
 
     virtual ~AbstractRenderer(){}
 
     virtual void RunIteration(int aIteration) = 0;
 
+    // Runs a coarse iteration that traces one camera path per
+    // aBlockSize x aBlockSize pixel block. The result goes to a separate
+    // preview framebuffer and never contributes to the final image.
+    void RunPreviewIteration(int aIteration, int aBlockSize)
+    {
+        const int iterations = mIterations;
+
+        mBlockSize = aBlockSize;
+        RunIteration(aIteration);
+        mBlockSize = 1;
+
+        mIterations = iterations;
+        mPreviewIterations++;
+    }
+
     void GetFramebuffer(Framebuffer& oFramebuffer)
     {
         oFramebuffer = mFramebuffer;
@@ -54,9 +76,235 @@ public:
             oFramebuffer.Scale(1.f / mIterations);
     }
 
+    void GetPreviewFramebuffer(Framebuffer& oFramebuffer)
+    {
+        oFramebuffer = mPreviewFramebuffer;
+
+        if(mPreviewIterations > 0)
+            oFramebuffer.Scale(1.f / mPreviewIterations);
+    }
+
+    // Starts recording features (AOVs), used also for denoising
+    void EnableFeatures()
+    {
+        mGatherFeatures = true;
+        mFeatures.Setup(mScene.mCamera.mResolution);
+    }
+
+    // Starts learning path guiding distribution, camera paths
+    // are guided once the first training pass is over
+    void EnableGuiding()
+    {
+        mGuide.Setup(mScene.mSceneSphere);
+    }
+
+    // Starts learning emission of light sub-paths, only
+    // used by renderers that trace them
+    virtual void EnableAdaptiveEmission() {}
+
+    // Traces aCount camera paths per pixel against one pass of light
+    // sub-paths, only used by renderers that trace them
+    virtual void SetCameraPathsPerPixel(const int /*aCount*/) {}
+
+    // Switches vertex merging to per-pixel radius, only
+    // used by renderers that merge
+    virtual void EnableAdaptiveRadius() {}
+
+    // Defers merges of camera vertices and runs them sorted by grid
+    // cell, only used by renderers that merge
+    virtual void EnableDeferredMerging() {}
+
+    void GetFeatures(FeatureBuffers& oFeatures)
+    {
+        oFeatures = mFeatures;
+
+        if(mIterations > 0)
+            oFeatures.Scale(1.f / mIterations);
+    }
+
     //! Whether this renderer was used at all
     bool WasUsed() const { return mIterations > 0; }
 
+    //! Whether this renderer ran any preview iteration
+    bool WasPreviewed() const { return mPreviewIterations > 0; }
+
+protected:
+
+    // Jitters camera samples aFirstSample on, up to CameraRayBatch::kSize of
+    // them within aSampleCount, and generates their rays. Each pixel (or
+    // preview block) takes aSamplesPerPixel consecutive samples. Samples are
+    // at block centers when aCentered.
+    void GenerateCameraBatch(
+        const int      aFirstSample,
+        const int      aSampleCount,
+        const int      aSamplesPerPixel,
+        const bool     aCentered,
+        Rng            &aRng,
+        CameraRayBatch &oBatch) const
+    {
+        const Camera &camera = mScene.mCamera;
+        oBatch.mCount = std::min(int(CameraRayBatch::kSize), aSampleCount - aFirstSample);
+
+        for(int i=0; i<CameraRayBatch::kSize; i++)
+        {
+            // Padding repeats the last sample, its ray is never traced
+            const int sampleIdx = aFirstSample + std::min(i, oBatch.mCount - 1);
+
+            if(i < oBatch.mCount)
+                camera.CropIndexToBlock(sampleIdx / aSamplesPerPixel, mBlockSize,
+                    oBatch.mBlockMin[i], oBatch.mBlockSize[i]);
+            else
+            {
+                oBatch.mBlockMin[i]  = oBatch.mBlockMin[i - 1];
+                oBatch.mBlockSize[i] = oBatch.mBlockSize[i - 1];
+            }
+
+            const Vec2f jitter = (aCentered || i >= oBatch.mCount) ?
+                Vec2f(0.5f) : aRng.GetVec2f();
+            oBatch.mRasterX[i] = float(oBatch.mBlockMin[i].x) +
+                float(oBatch.mBlockSize[i].x) * jitter.x;
+            oBatch.mRasterY[i] = float(oBatch.mBlockMin[i].y) +
+                float(oBatch.mBlockSize[i].y) * jitter.y;
+        }
+
+        camera.GenerateRays(oBatch);
+    }
+
+    // Accumulates color of a camera sample. In preview iterations the
+    // sample stands for its whole pixel block, which it fills.
+    void AddSampleColor(
+        const Vec2i &aBlockMin,
+        const Vec2i &aBlockSize,
+        const Vec2f &aSample,
+        const Vec3f &aColor)
+    {
+        if(mBlockSize > 1)
+            mPreviewFramebuffer.AddColorBlock(aBlockMin, aBlockSize, aColor);
+        else
+            mFramebuffer.AddColor(aSample, aColor);
+    }
+
+    // Records features of a camera hit, if enabled. Renderers call
+    // it for the first non-specular hit (or light), so that features of
+    // mirrors and glass show the reflected edges. aDepth is the distance
+    // along the camera path. Preview iterations are not recorded.
+    void AddFeatures(
+        const Vec2f &aSample,
+        const Ray   &aRay,
+        const Isect &aIsect,
+        const float aDepth)
+    {
+        if(!mGatherFeatures || mBlockSize > 1)
+            return;
+
+        const Vec3f normal = Dot(aIsect.normal, aRay.dir) > 0 ?
+            -aIsect.normal : aIsect.normal;
+
+        const Vec3f albedo =
+            mScene.GetMaterialSampling(aIsect.matID).mIsTextured ?
+            mScene.GetTexturedMaterial(aIsect.matID,
+                aRay.org + aRay.dir * aIsect.dist).GetAlbedo() :
+            mScene.GetMaterial(aIsect.matID).GetAlbedo();
+
+        mFeatures.AddFeatures(aSample, albedo, normal, aDepth, aIsect.matID);
+    }
+
+    // Records color of a camera sample split by technique, if enabled
+    void AddTechniqueColors(
+        const Vec2f &aSample,
+        const Vec3f &aDirect,
+        const Vec3f &aConnection,
+        const Vec3f &aMerging)
+    {
+        if(!mGatherFeatures || mBlockSize > 1)
+            return;
+
+        mFeatures.mDirect.AddColor(aSample, aDirect);
+        mFeatures.mConnection.AddColor(aSample, aConnection);
+        mFeatures.mMerging.AddColor(aSample, aMerging);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Path guiding of camera sub-paths. The guide is mixed with BSDF sampling
+    // by one-sample MIS, so every pdf of a camera sub-path sampling a
+    // direction has to be the mixture pdf, as returned by GuidedPdf().
+    // Only BSDFs without specular components are guided.
+
+    template<bool FixIsLight>
+    float GuideProb(const BSDF<FixIsLight> &aBsdf) const
+    {
+        if(!mGuide.IsTrained() || aBsdf.IsDelta() || aBsdf.HasSpecular())
+            return 0.f;
+
+        return mGuide.mGuidingProb;
+    }
+
+    // Mixes BSDF pdf of aDirection from aPosition with the guide pdf
+    template<bool FixIsLight>
+    float GuidedPdf(
+        const BSDF<FixIsLight> &aBsdf,
+        const Vec3f            &aPosition,
+        const Vec3f            &aDirection,
+        const float            aBsdfPdfW) const
+    {
+        const float guideProb = GuideProb(aBsdf);
+        if(guideProb == 0)
+            return aBsdfPdfW;
+
+        return guideProb * mGuide.Pdf(aPosition, aDirection) +
+            (1.f - guideProb) * aBsdfPdfW;
+    }
+
+    // Same as BSDF::Sample(), but samples the guide with probability
+    // GuideProb(), picked by the z component of the random triplet.
+    // Returns the mixture pdf.
+    template<bool FixIsLight>
+    Vec3f GuidedSample(
+        const BSDF<FixIsLight> &aBsdf,
+        const Vec3f            &aPosition,
+        const Vec3f            &aRndTriplet,
+        Vec3f                  &oWorldDirGen,
+        float                  &oPdfW,
+        float                  &oCosThetaGen,
+        uint                   *oSampledEvent = NULL) const
+    {
+        const float guideProb = GuideProb(aBsdf);
+        if(guideProb == 0)
+            return aBsdf.Sample(mScene, aRndTriplet, oWorldDirGen, oPdfW,
+                oCosThetaGen, oSampledEvent);
+
+        Vec3f bsdfFactor;
+        float bsdfPdfW, guidePdfW;
+
+        if(aRndTriplet.z < guideProb)
+        {
+            oWorldDirGen = mGuide.Sample(aPosition, aRndTriplet.GetXY(), guidePdfW);
+            bsdfFactor   = aBsdf.Evaluate(mScene, oWorldDirGen, oCosThetaGen, &bsdfPdfW);
+
+            if(bsdfFactor.IsZero() || oCosThetaGen < EPS_COSINE)
+                return Vec3f(0);
+
+            if(oSampledEvent)
+                *oSampledEvent = BSDF<FixIsLight>::kNonSpecular;
+        }
+        else
+        {
+            Vec3f rndTriplet = aRndTriplet;
+            rndTriplet.z = (aRndTriplet.z - guideProb) / (1.f - guideProb);
+
+            bsdfFactor = aBsdf.Sample(mScene, rndTriplet, oWorldDirGen, bsdfPdfW,
+                oCosThetaGen, oSampledEvent);
+
+            if(bsdfFactor.IsZero())
+                return Vec3f(0);
+
+            guidePdfW = mGuide.Pdf(aPosition, oWorldDirGen);
+        }
+
+        oPdfW = guideProb * guidePdfW + (1.f - guideProb) * bsdfPdfW;
+        return bsdfFactor;
+    }
+
 public:
 
     uint         mMaxPathLength;
@@ -65,7 +313,13 @@ public:
 protected:
 
     int          mIterations;
+    int          mPreviewIterations;
+    int          mBlockSize;  //!< Pixel block size of current iteration, 1 unless previewing
+    bool         mGatherFeatures;
     Framebuffer  mFramebuffer;
+    Framebuffer  mPreviewFramebuffer;
+    FeatureBuffers mFeatures;
+    PathGuide    mGuide;
     const Scene& mScene;
 };
 
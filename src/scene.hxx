@@ -33,12 +33,18 @@
 #include "camera.hxx"
 #include "materials.hxx"
 #include "lights.hxx"
+#include "texture.hxx"
+#include "mesh.hxx"
+#include "bvh.hxx"
+#include "keyframes.hxx"
 
 class Scene
 {
 public:
     Scene() :
         mGeometry(NULL),
+        mMesh(NULL),
+        mBVH(NULL),
         mBackground(NULL)
     {}
 
@@ -69,17 +75,82 @@ public:
         return hit;
     }
 
+    // Intersect of aCount rays, aoHit[i] tells whether ray i hit
+    void IntersectBatch(
+        const Ray *aRays,
+        Isect     *aoResults,
+        int       *aoHit,
+        const int aCount) const
+    {
+        RayBatch batch;
+
+        for(int i=0; i<aCount; i++)
+            aoHit[i] = 0;
+
+        for(int i=0; i<aCount; i+=RayBatch::kSize)
+        {
+            batch.Setup(aRays + i, aoResults + i, aoHit + i,
+                std::min(int(RayBatch::kSize), aCount - i));
+            mGeometry->IntersectBatch(batch);
+        }
+
+        for(int i=0; i<aCount; i++)
+        {
+            if(!aoHit[i])
+                continue;
+
+            aoResults[i].lightID = -1;
+            std::map<int, int>::const_iterator it =
+                mMaterial2Light.find(aoResults[i].matID);
+
+            if(it != mMaterial2Light.end())
+                aoResults[i].lightID = it->second;
+        }
+    }
+
+    // Occluded of aCount rays made by OcclusionRay, aoOccluded[i] tells
+    // whether ray i is
+    void OccludedBatch(
+        const Ray *aRays,
+        Isect     *aoResults,
+        int       *aoOccluded,
+        const int aCount) const
+    {
+        RayBatch batch;
+
+        for(int i=0; i<aCount; i++)
+            aoOccluded[i] = 0;
+
+        for(int i=0; i<aCount; i+=RayBatch::kSize)
+        {
+            batch.Setup(aRays + i, aoResults + i, aoOccluded + i,
+                std::min(int(RayBatch::kSize), aCount - i));
+            mGeometry->IntersectPBatch(batch);
+        }
+    }
+
+    // Ray and its maximum distance as tested by Occluded
+    static void OcclusionRay(
+        const Vec3f &aPoint,
+        const Vec3f &aDir,
+        float       aTMax,
+        Ray         &oRay,
+        Isect       &oIsect)
+    {
+        oRay.org    = aPoint + aDir * EPS_RAY;
+        oRay.dir    = aDir;
+        oRay.tmin   = 0;
+        oIsect.dist = aTMax - 2*EPS_RAY;
+    }
+
     bool Occluded(
         const Vec3f &aPoint,
         const Vec3f &aDir,
         float aTMax) const
     {
-        Ray ray;
-        ray.org  = aPoint + aDir * EPS_RAY;
-        ray.dir  = aDir;
-        ray.tmin = 0;
+        Ray   ray;
         Isect isect;
-        isect.dist = aTMax - 2*EPS_RAY;
+        OcclusionRay(aPoint, aDir, aTMax, ray, isect);
 
         return mGeometry->IntersectP(ray, isect);
     }
@@ -94,6 +165,76 @@ public:
         return (int)mMaterials.size();
     }
 
+    // Copy of material with reflectances at aPosition. The filter size is
+    // the footprint of a pixel at the distance of aPosition from the camera,
+    // a function of the point only, so all techniques see the same texture
+    Material GetTexturedMaterial(
+        const int   aMaterialIdx,
+        const Vec3f &aPosition) const
+    {
+        Material mat = mMaterials[aMaterialIdx];
+
+        const Vec2f uv = mat.GetTextureUV(aPosition);
+        const float pixelWidth =
+            (aPosition - mCamera.mPosition).Length() / mCamera.mImagePlaneDist;
+
+        if(mat.mDiffuseTexture >= 0)
+            mat.mDiffuseReflectance = mat.mDiffuseReflectance * mTextureCache.Lookup(
+                mat.mDiffuseTexture, uv, pixelWidth * mat.mTextureU.Length());
+
+        if(mat.mPhongTexture >= 0)
+            mat.mPhongReflectance = mat.mPhongReflectance * mTextureCache.Lookup(
+                mat.mPhongTexture, uv, pixelWidth * mat.mTextureU.Length());
+
+        return mat;
+    }
+
+    // Maps texture once over the box floor, multiplying both
+    // its diffuse and glossy reflectance
+    void SetFloorTexture(const int aTexture)
+    {
+        Material &mat = mMaterials[mFloorMaterialID];
+
+        mat.mDiffuseTexture = aTexture;
+        mat.mPhongTexture   = aTexture;
+        mat.mTextureOrigin  = mFloorMin;
+        mat.mTextureU = Vec3f(1.f / (mFloorMax.x - mFloorMin.x), 0, 0);
+        mat.mTextureV = Vec3f(0, 1.f / (mFloorMax.y - mFloorMin.y), 0);
+
+        CompileMaterials();
+    }
+
+    const MaterialSampling& GetMaterialSampling(const int aMaterialIdx) const
+    {
+        return mMaterialSampling[aMaterialIdx];
+    }
+
+    // Classifies materials and precomputes their sampling data,
+    // has to be called whenever materials change
+    void CompileMaterials()
+    {
+        mMaterialSampling.resize(mMaterials.size());
+
+        for(size_t i=0; i<mMaterials.size(); i++)
+        {
+            Material         &mat      = mMaterials[i];
+            MaterialSampling &sampling = mMaterialSampling[i];
+
+            mat.Classify();
+
+            // Fresnel coefficient is 1 for all but glass
+            mat.GetSamplingProbabilities(1.f, sampling.mProbabilities,
+                sampling.mContinuationProb);
+
+            sampling.mIsDelta = (sampling.mProbabilities.diffProb == 0) &&
+                (sampling.mProbabilities.phongProb == 0);
+            sampling.mUsesFresnel = mat.mIOR >= 0;
+            sampling.mIsTextured  = mat.IsTextured();
+            sampling.mType = (sampling.mContinuationProb > 0) ?
+                mat.mType : Material::kGeneric;
+        }
+    }
+
 
     const AbstractLight* GetLightPtr(int aLightIdx) const
     {
@@ -111,6 +252,9 @@ public:
         return mBackground;
     }
 
+    // Smaller geometry is not put in a hierarchy, see BuildAccelerator
+    enum { kMinAcceleratorParts = 64 };
+
     //////////////////////////////////////////////////////////////////////////
     // Loads a Cornell Box scene
     enum BoxMask
@@ -204,6 +348,13 @@ public:
         mat.mDiffuseReflectance = Vec3f(0.156863f, 0.172549f, 0.803922f);
         mMaterials.push_back(mat);
 
+        // 9) diffuse white floor, own material so it can be textured
+        mat.Reset();
+        mat.mDiffuseReflectance = Vec3f(0.803922f, 0.803922f, 0.803922f);
+        mMaterials.push_back(mat);
+
+        CompileMaterials();
+
         delete mGeometry;
 
         //////////////////////////////////////////////////////////////////////////
@@ -222,6 +373,10 @@ public:
         GeometryList *geometryList = new GeometryList;
         mGeometry = geometryList;
 
+        mFloorMaterialID = ((aBoxMask & kGlossyFloor) != 0) ? 2 : 9;
+        mFloorMin        = cb[4];
+        mFloorMax        = cb[1];
+
         if((aBoxMask & kGlossyFloor) != 0)
         {
             // Floor
@@ -234,8 +389,8 @@ public:
         else
         {
             // Floor
-            geometryList->mGeometry.push_back(new Triangle(cb[0], cb[4], cb[5], 5));
-            geometryList->mGeometry.push_back(new Triangle(cb[5], cb[1], cb[0], 5));
+            geometryList->mGeometry.push_back(new Triangle(cb[0], cb[4], cb[5], 9));
+            geometryList->mGeometry.push_back(new Triangle(cb[5], cb[1], cb[0], 9));
             // Back wall
             geometryList->mGeometry.push_back(new Triangle(cb[0], cb[1], cb[2], 5));
             geometryList->mGeometry.push_back(new Triangle(cb[2], cb[3], cb[0], 5));
@@ -384,6 +539,98 @@ public:
         }
     }
 
+    // Adds a mesh from a Wavefront .obj file, standing on the back half of
+    // the floor. Its triangles are paged from file <aObjFile>.pages, or
+    // from a file kept in aCacheDir, see PagedMesh. Has to be called after
+    // LoadCornellBox and before BuildAccelerator and BuildSceneSphere.
+    // Returns false on error.
+    bool LoadMesh(
+        const char        *aObjFile,
+        const std::string &aCacheDir = "")
+    {
+        const Vec3f floorSize = mFloorMax - mFloorMin;
+        const Vec3f boxMin = mFloorMin + floorSize * Vec3f(0.25f, 0.5f, 0.f);
+        const Vec3f boxMax = boxMin + floorSize * Vec3f(0.5f, 0.4f, 0.f) +
+            Vec3f(0.f, 0.f, 0.5f * floorSize.x);
+
+        PagedMesh *mesh = new PagedMesh;
+
+        // 5) diffuse white
+        if(!mesh->Load(aObjFile, aCacheDir, boxMin, boxMax, 5))
+        {
+            delete mesh;
+            return false;
+        }
+
+        // LoadCornellBox always creates a list
+        static_cast<GeometryList*>(mGeometry)->mGeometry.push_back(mesh);
+        mMesh = mesh;
+        return true;
+    }
+
+    // Puts a bounding volume hierarchy over the geometry, unless there are
+    // so few parts that testing them all is faster (as in the plain boxes).
+    // With aCacheDir, built hierarchies are kept there for later runs.
+    void BuildAccelerator(const std::string &aCacheDir = "")
+    {
+        std::vector<AbstractGeometry*> parts;
+        mGeometry->GetParts(parts);
+
+        if((int)parts.size() > kMinAcceleratorParts)
+        {
+            mBVH = new WideBVH(mGeometry, aCacheDir);
+            mGeometry = mBVH;
+        }
+    }
+
+    // Poses the mesh and the camera at aTime (0 to 1) of mKeyframes.
+    // The BVH is refit, or built again when refitting made it too slow
+    // (oRebuilt). Returns false on error.
+    bool Animate(
+        const float aTime,
+        bool        &oRebuilt)
+    {
+        oRebuilt = false;
+
+        // Setup resets the crop window
+        if(mKeyframes.HasCamera())
+        {
+            const CameraKey key     = mKeyframes.GetCamera(aTime);
+            const Vec2i     cropMin = mCamera.mCropMin;
+            const Vec2i     cropMax = mCamera.mCropMax;
+
+            mCamera.Setup(key.mPosition, key.mTarget - key.mPosition,
+                Vec3f(0.f, 0.f, 1.f), mCamera.mResolution, mCamera.mHorizontalFOV);
+            mCamera.SetCropWindow(cropMin, cropMax);
+        }
+
+        if(!mMesh || !mKeyframes.HasMesh())
+            return true;
+
+        Vec3f restMin, restMax;
+        mMesh->GetRestBBox(restMin, restMax);
+
+        const MeshKey key = mKeyframes.GetMesh(aTime);
+        MeshTransform transform;
+        transform.mPivot  = Vec3f((restMin.x + restMax.x) * 0.5f,
+            (restMin.y + restMax.y) * 0.5f, restMin.z);
+        transform.mMove   = key.mMove;
+        transform.mAngle  = key.mAngle;
+        transform.mTwist  = key.mTwist;
+        transform.mScale  = key.mScale;
+        transform.mHeight = std::max(restMax.z - restMin.z, 1e-20f);
+
+        if(!mMesh->TransformVertices(transform))
+            return false;
+
+        // Rebuilds when the surface area cost grew by a third
+        if(mBVH)
+            oRebuilt = mBVH->Update(1.33f);
+
+        BuildSceneSphere();
+        return true;
+    }
+
     void BuildSceneSphere()
     {
         Vec3f bboxMin( 1e36f);
@@ -474,8 +721,15 @@ public:
 public:
 
     AbstractGeometry      *mGeometry;
+    PagedMesh             *mMesh;     //!< Loaded mesh (owned by mGeometry) or NULL
+    WideBVH               *mBVH;      //!< Same as mGeometry when it is a hierarchy, or NULL
     Camera                mCamera;
+    Keyframes             mKeyframes; //!< Animation of mMesh and mCamera
     std::vector<Material> mMaterials;
+    std::vector<MaterialSampling> mMaterialSampling; //!< Of mMaterials
+    TextureCache          mTextureCache;
+    int                   mFloorMaterialID;    //!< For SetFloorTexture()
+    Vec3f                 mFloorMin, mFloorMax; //!< Corners of the floor
     std::vector<AbstractLight*>   mLights;
     std::map<int, int>    mMaterial2Light;
     SceneSphere           mSceneSphere;
@@ -36,6 +36,7 @@
 #include "pathtracer.hxx"
 #include "bsdf.hxx"
 #include "vertexcm.hxx"
+#include "denoiser.hxx"
 #include "html_writer.hxx"
 #include "config.hxx"
 
@@ -44,6 +45,104 @@
 #include <set>
 #include <sstream>
 
+//////////////////////////////////////////////////////////////////////////
+// Saves framebuffer as bmp or hdr, based on the file extension
+
+void SaveImage(
+    Framebuffer       &aFramebuffer,
+    const std::string &aFilename)
+{
+    std::string extension = aFilename.substr(aFilename.length() - 3, 3);
+
+    if(extension == "bmp")
+        aFramebuffer.SaveBMP(aFilename.c_str(), 2.2f /*gamma*/);
+    else if(extension == "hdr")
+        aFramebuffer.SaveHDR(aFilename.c_str());
+    else
+        printf("Used unknown extension %s\n", extension.c_str());
+}
+
+// Inserts suffix before the file extension, e.g., "a.bmp" -> "a_suffix.bmp"
+std::string SuffixedFilename(
+    const std::string &aFilename,
+    const std::string &aSuffix)
+{
+    const size_t dot = aFilename.rfind('.');
+
+    if(dot == std::string::npos)
+        return aFilename + aSuffix;
+
+    return aFilename.substr(0, dot) + aSuffix + aFilename.substr(dot);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Saves all feature and per-technique buffers as <name>_<aov>.pfm
+
+void SaveAovs(
+    FeatureBuffers    &aFeatures,
+    const std::string &aFilename)
+{
+    const size_t dot = aFilename.rfind('.');
+    const std::string base = aFilename.substr(0, dot);
+
+    aFeatures.mAlbedo.SavePFM((base + "_albedo.pfm").c_str());
+    aFeatures.mNormal.SavePFM((base + "_normal.pfm").c_str());
+    aFeatures.mDepth.SavePFM((base + "_depth.pfm").c_str());
+    aFeatures.mMaterialID.SavePFM((base + "_matid.pfm").c_str());
+    aFeatures.mDirect.SavePFM((base + "_direct.pfm").c_str());
+    aFeatures.mConnection.SavePFM((base + "_vc.pfm").c_str());
+    aFeatures.mMerging.SavePFM((base + "_vm.pfm").c_str());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Renders quick preview iterations and saves the preview image.
+// Block size is halved every round, down to 2x2 pixel blocks. The preview
+// is kept in separate framebuffers, so the final image stays unbiased.
+
+void RenderPreview(
+    const Config           &aConfig,
+    AbstractRenderer *const *aRenderers)
+{
+    int previewIter = 0;
+
+    for(int blockSize = aConfig.mPreviewBlockSize; blockSize > 1; blockSize /= 2)
+    {
+#pragma omp parallel for
+        for(int iter = previewIter; iter < previewIter + aConfig.mNumThreads; iter++)
+        {
+            int threadId = omp_get_thread_num();
+            aRenderers[threadId]->RunPreviewIteration(iter, blockSize);
+        }
+
+        previewIter += aConfig.mNumThreads;
+    }
+
+    Framebuffer preview, tmp;
+    int usedRenderers = 0;
+
+    for(int i=0; i<aConfig.mNumThreads; i++)
+    {
+        if(!aRenderers[i]->WasPreviewed())
+            continue;
+
+        if(usedRenderers == 0)
+        {
+            aRenderers[i]->GetPreviewFramebuffer(preview);
+        }
+        else
+        {
+            aRenderers[i]->GetPreviewFramebuffer(tmp);
+            preview.Add(tmp);
+        }
+
+        usedRenderers++;
+    }
+
+    preview.Scale(1.f / usedRenderers);
+
+    SaveImage(preview, SuffixedFilename(aConfig.mOutputName, "_preview"));
+}
+
 //////////////////////////////////////////////////////////////////////////
 // The main rendering function, renders what is in aConfig
 
@@ -65,11 +164,32 @@ float render(
 
         renderers[i]->mMaxPathLength = aConfig.mMaxPathLength;
         renderers[i]->mMinPathLength = aConfig.mMinPathLength;
+
+        if(aConfig.mFeatures)
+            renderers[i]->EnableFeatures();
+
+        if(aConfig.mGuide)
+            renderers[i]->EnableGuiding();
+
+        if(aConfig.mAdaptEmission)
+            renderers[i]->EnableAdaptiveEmission();
+
+        if(aConfig.mAdaptRadius)
+            renderers[i]->EnableAdaptiveRadius();
+
+        if(aConfig.mSortMerges)
+            renderers[i]->EnableDeferredMerging();
+
+        renderers[i]->SetCameraPathsPerPixel(aConfig.mCameraPaths);
     }
 
     clock_t startT = clock();
     int iter = 0;
 
+    // Coarse preview for fast first feedback, counts towards the time limit
+    if(aConfig.mPreviewBlockSize > 1)
+        RenderPreview(aConfig, renderers);
+
     // Rendering loop, when we have any time limit, use time-based loop,
     // otherwise go with required iterations
     if(aConfig.mMaxTime > 0)
@@ -115,12 +235,22 @@ float render(
         if(usedRenderers == 0)
         {
             renderers[i]->GetFramebuffer(*aConfig.mFramebuffer);
+
+            if(aConfig.mFeatures)
+                renderers[i]->GetFeatures(*aConfig.mFeatures);
         }
         else
         {
             Framebuffer tmp;
             renderers[i]->GetFramebuffer(tmp);
             aConfig.mFramebuffer->Add(tmp);
+
+            if(aConfig.mFeatures)
+            {
+                FeatureBuffers tmpFeatures;
+                renderers[i]->GetFeatures(tmpFeatures);
+                aConfig.mFeatures->Add(tmpFeatures);
+            }
         }
 
         usedRenderers++;
@@ -129,6 +259,9 @@ float render(
     // Scale framebuffer by the number of used renderers
     aConfig.mFramebuffer->Scale(1.f / usedRenderers);
 
+    if(aConfig.mFeatures)
+        aConfig.mFeatures->Scale(1.f / usedRenderers);
+
     // Clean up renderers
     for(int i=0; i<aConfig.mNumThreads; i++)
         delete renderers[i];
@@ -147,10 +280,18 @@ void FullReport(const Config &aConfig)
     Config config = aConfig;
 
     config.mFullReport = false;
+    config.mPreviewBlockSize = 0;
+    config.mGuide = false;
+    config.mAdaptEmission = false;
+    config.mAdaptRadius = false;
+    config.mCameraPaths = 1;
+    config.mWavefront = false;
+    config.mSortMerges = false;
 
     // Setup framebuffer and threads
     Framebuffer fbuffer;
     config.mFramebuffer = &fbuffer;
+    config.mFeatures    = NULL;
 
     // Setup html writer
     HtmlWriter html_writer("index.html");
@@ -200,7 +341,9 @@ void FullReport(const Config &aConfig)
     {
         Scene  scene;
         scene.LoadCornellBox(config.mResolution, g_SceneConfigs[sceneID]);
+        scene.BuildAccelerator(config.mAccelCacheDir);
         scene.BuildSceneSphere();
+        scene.mCamera.SetCropWindow(config.mCropMin, config.mCropMax);
         config.mScene = &scene;
 
         html_writer.AddScene(scene.mSceneName);
@@ -215,7 +358,7 @@ void FullReport(const Config &aConfig)
             printf("done in %.2f s\n", time);
 
             std::string filename = DefaultFilename(g_SceneConfigs[sceneID],
-                *config.mScene, config.mAlgorithm);
+                *config.mScene, Config::GetAcronym(config.mAlgorithm));
 
             fbuffer.SaveBMP(filename.c_str(), 2.2f);
 
@@ -250,6 +393,187 @@ void FullReport(const Config &aConfig)
     printf("Whole run took %.2f s\n", float(endTime - startTime) / CLOCKS_PER_SEC);
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Picks the algorithm for -a auto, and sets it to aoConfig. Each candidate
+// renders two independent halves of a short pilot. Per pixel, the squared
+// difference of the halves estimates the variance of their average, which
+// falls with render time. The difference of the average from the mean of
+// all candidates, less its expected noise, estimates the bias of
+// candidates missing some light transport (e.g. caustics of point lights
+// in path tracing), which does not fall. Both are relative to the squared
+// mean luminance. The winner has the lowest predicted error after the
+// remaining time, or the time of the iterations of path tracing, and then
+// gets as many iterations as fit in it. Returns the time spent in pilots.
+
+float SelectAlgorithm(Config &aoConfig)
+{
+    // Path tracing goes first, its time is the unit of iterations
+    const Config::Algorithm candidates[] = {
+        Config::kPathTracing,
+        Config::kBidirectionalPathTracing,
+        Config::kBidirectionalPhotonMapping,
+        Config::kVertexConnectionMerging };
+    const int candidateCount = SizeOfArray(candidates);
+
+    Config pilot = aoConfig;
+    pilot.mPreviewBlockSize = 0;
+    pilot.mFeatures         = NULL;
+
+    // With time limit pilots take a tenth of it, otherwise each half
+    // renders one iteration
+    if(aoConfig.mMaxTime > 0)
+        pilot.mMaxTime = 0.1f * aoConfig.mMaxTime / (2 * candidateCount);
+    else
+        pilot.mIterations = 1;
+
+    // Pilots render the middle of the crop window, half its width and height,
+    // at about a quarter of the cost with the same path density per pixel.
+    // The scene is ours to change (made by ParseCommandline).
+    Camera &camera = const_cast<Scene*>(aoConfig.mScene)->mCamera;
+    const Vec2i cropMin  = camera.mCropMin;
+    const Vec2i cropMax  = camera.mCropMax;
+    const Vec2i cropSize = cropMax - cropMin;
+    camera.SetCropWindow(cropMin + Vec2i(cropSize.x / 4, cropSize.y / 4),
+        cropMax - Vec2i(cropSize.x / 4, cropSize.y / 4));
+
+    const Vec2i pilotMin  = camera.mCropMin;
+    const Vec2i pilotMax  = camera.mCropMax;
+    const float areaRatio = float(cropSize.x * cropSize.y) /
+        float((pilotMax.x - pilotMin.x) * (pilotMax.y - pilotMin.y));
+
+    std::vector<Framebuffer> halves(2 * candidateCount);
+    std::vector<float>       times(candidateCount, 0.f);
+    float pilotTime = 0;
+
+    for(int i=0; i<candidateCount; i++)
+    {
+        pilot.mAlgorithm = candidates[i];
+
+        // Halves use seeds of neither each other nor the final render
+        for(int h=0; h<2; h++)
+        {
+            pilot.mFramebuffer = &halves[2*i + h];
+            pilot.mBaseSeed    = aoConfig.mBaseSeed + (h + 1) * aoConfig.mNumThreads;
+            times[i] += render(pilot);
+        }
+
+        pilotTime += times[i];
+    }
+
+    camera.SetCropWindow(cropMin, cropMax);
+
+    // Pixel statistics, the small constant keeps black pixels from dominating
+    std::vector<double> variance(candidateCount, 0.0), bias(candidateCount, 0.0);
+    std::vector<float>  mean(candidateCount), meanVariance(candidateCount);
+    const float n = float(candidateCount);
+
+    for(int y=pilotMin.y; y<pilotMax.y; y++)
+    {
+        for(int x=pilotMin.x; x<pilotMax.x; x++)
+        {
+            float reference = 0, referenceVariance = 0;
+
+            for(int i=0; i<candidateCount; i++)
+            {
+                const float a = Luminance(halves[2*i    ].GetColor(x, y));
+                const float b = Luminance(halves[2*i + 1].GetColor(x, y));
+
+                mean[i]            = 0.5f * (a + b);
+                meanVariance[i]    = 0.25f * Sqr(a - b);
+                reference         += mean[i] / n;
+                referenceVariance += meanVariance[i] / Sqr(n);
+            }
+
+            const float norm = 1.f / (Sqr(reference) + 1e-2f);
+
+            // The reference includes the candidate, hence the covariance term
+            for(int i=0; i<candidateCount; i++)
+            {
+                variance[i] += meanVariance[i] * norm;
+                bias[i]     += (Sqr(mean[i] - reference) -
+                    meanVariance[i] * (1.f - 2.f / n) - referenceVariance) * norm;
+            }
+        }
+    }
+
+    // Variance of the whole image after time T is variance * time * areaRatio / T.
+    // Candidates are compared at the same T. With iterations, T is the time of
+    // as many iterations of path tracing (the cheapest), and the winner then
+    // runs as many of its own as fit in T.
+    const int   pixelCount = (pilotMax.x - pilotMin.x) * (pilotMax.y - pilotMin.y);
+    const float finalTime  = (aoConfig.mMaxTime > 0) ?
+        std::max(aoConfig.mMaxTime - pilotTime, 1e-3f) :
+        0.5f * times[0] * areaRatio * aoConfig.mIterations;
+    float bestError = 1e36f;
+    int   bestIdx   = 0;
+
+    for(int i=0; i<candidateCount; i++)
+    {
+        const float relVariance = float(variance[i] / pixelCount);
+        const float relBias2    = std::max(float(bias[i] / pixelCount), 0.f);
+        const float fullTime    = times[i] * areaRatio;
+        const float error       = relVariance * fullTime / finalTime + relBias2;
+
+        printf("Pilot:   %-3s in %.2f s, rel. variance %.3g, bias^2 %.3g, "
+            "predicted error %.3g\n", Config::GetAcronym(candidates[i]),
+            times[i], relVariance, relBias2, error);
+
+        if(error < bestError)
+        {
+            bestError = error;
+            bestIdx   = i;
+        }
+    }
+
+    aoConfig.mAlgorithm = candidates[bestIdx];
+
+    if(aoConfig.mMaxTime <= 0 && bestIdx > 0)
+    {
+        const int   ptIterations  = aoConfig.mIterations;
+        const float iterationTime = 0.5f * times[bestIdx] * areaRatio;
+        aoConfig.mIterations = std::max(int(finalTime / iterationTime + 0.5f), 1);
+        printf("Pilot:   %d iteration(s) of %s take as long as %d of pt\n",
+            aoConfig.mIterations, Config::GetAcronym(candidates[bestIdx]),
+            ptIterations);
+    }
+
+    return pilotTime;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Renders aConfig.mFrames frames of the animation of Scene::Animate,
+// saving them as <output_name>_<frame>
+
+void RenderSequence(
+    const Config &aConfig,
+    Scene        &aoScene)
+{
+    for(int frame=0; frame<aConfig.mFrames; frame++)
+    {
+        const float time = (aConfig.mFrames > 1) ?
+            float(frame) / float(aConfig.mFrames - 1) : 0.f;
+
+        printf("Frame %d: ", frame);
+        fflush(stdout);
+
+        bool rebuilt;
+        if(!aoScene.Animate(time, rebuilt))
+            return;
+
+        if(aoScene.mBVH && aoScene.mKeyframes.HasMesh())
+            printf("BVH %s in %.3f s, ", rebuilt ? "rebuilt" : "refit",
+                aoScene.mBVH->GetBuildTime());
+        fflush(stdout);
+
+        const float renderTime = render(aConfig);
+        printf("rendered in %.2f s\n", renderTime);
+
+        char suffix[16];
+        sprintf(suffix, "_%04d", frame);
+        SaveImage(*aConfig.mFramebuffer, SuffixedFilename(aConfig.mOutputName, suffix));
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Main
 
@@ -280,28 +604,77 @@ int main(int argc, const char *argv[])
     Framebuffer fbuffer;
     config.mFramebuffer = &fbuffer;
 
+    // Features are only needed for denoising and AOV output
+    FeatureBuffers features;
+    config.mFeatures = (config.mDenoise || config.mSaveAovs) ? &features : NULL;
+
     // Prints what we are doing
     printf("Scene:   %s\n", config.mScene->mSceneName.c_str());
+    if(config.mScene->mMesh)
+        printf("Mesh:    %d triangles in %d pages%s\n",
+            config.mScene->mMesh->GetTriangleCount(),
+            config.mScene->mMesh->GetBlockCount(),
+            config.mScene->mMesh->IsFromCache() ? " loaded from cache" : "");
+    if(config.mScene->mBVH)
+        printf("BVH:     %d nodes (%.1f KB) %s in %.3f s\n",
+            config.mScene->mBVH->GetNodeCount(),
+            config.mScene->mBVH->GetNodeBytes() / 1024.f,
+            config.mScene->mBVH->IsFromCache() ? "loaded from cache" : "built",
+            config.mScene->mBVH->GetBuildTime());
     if(config.mMaxTime > 0)
         printf("Target:  %g seconds render time\n", config.mMaxTime);
     else
         printf("Target:  %d iteration(s)\n", config.mIterations);
 
+    // Picks the algorithm, the pilots count towards the time limit
+    // (of a single image, animation frames keep theirs)
+    if(config.mAutoAlgorithm)
+    {
+        const float pilotTime = SelectAlgorithm(config);
+
+        if(config.mMaxTime > 0 && config.mFrames == 0)
+            config.mMaxTime = std::max(config.mMaxTime - pilotTime, 1e-3f);
+    }
+
+    // Animation, the scene is ours to change (made by ParseCommandline)
+    if(config.mFrames > 0)
+    {
+        printf("Running: %s, %d frames\n", config.GetName(config.mAlgorithm),
+            config.mFrames);
+        RenderSequence(config, *const_cast<Scene*>(config.mScene));
+        delete config.mScene;
+        return 0;
+    }
+
     // Renders the image
     printf("Running: %s... ", config.GetName(config.mAlgorithm));
     fflush(stdout);
     float time = render(config);
     printf("done in %.2f s\n", time);
 
-    // Saves the image
-    std::string extension = config.mOutputName.substr(config.mOutputName.length() - 3, 3);
+    if(config.mScene->mMesh && config.mScene->mMesh->GetResidentBlockCount() >= 0)
+        printf("Mesh:    %d pages resident\n",
+            config.mScene->mMesh->GetResidentBlockCount());
 
-    if(extension == "bmp")
-        fbuffer.SaveBMP(config.mOutputName.c_str(), 2.2f /*gamma*/);
-    else if(extension == "hdr")
-        fbuffer.SaveHDR(config.mOutputName.c_str());
-    else
-        printf("Used unknown extension %s\n", extension.c_str());
+    // Saves AOVs before denoising, they refer to the unfiltered image
+    if(config.mSaveAovs)
+        SaveAovs(features, config.mOutputName);
+
+    // Denoises the image, keeping the unfiltered one as well
+    if(config.mDenoise)
+    {
+        SaveImage(fbuffer, SuffixedFilename(config.mOutputName, "_noisy"));
+
+        printf("Denoising... ");
+        fflush(stdout);
+        clock_t startT = clock();
+        Denoiser denoiser;
+        denoiser.Denoise(fbuffer, features);
+        printf("done in %.2f s\n", float(clock() - startT) / CLOCKS_PER_SEC);
+    }
+
+    // Saves the image
+    SaveImage(fbuffer, config.mOutputName);
 
     // Scene cleanup
     delete config.mScene;
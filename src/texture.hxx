@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __TEXTURE_HXX__
+#define __TEXTURE_HXX__
+
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Textures are RGB .pfm files, read tile by tile when first needed, so
+// that they never have to fit in memory. Tiles of all mip-map levels share
+// one cache with a fixed budget. When it is full, a clock (second chance)
+// picks the tile to evict: one not used since the clock hand last passed
+// it, which approximates least recently used. Levels above 0 are not in
+// the file; their tiles are box-filtered from the level below (through
+// the cache) when first needed.
+//
+// Each thread also keeps a small direct-mapped table of tiles it used.
+// Hits there take no lock; they only check that the slot was not reloaded
+// meanwhile (slot generation), in the spirit of a sequence lock.
+
+// Texel rows of a .pfm file, read on demand
+class PfmFile
+{
+public:
+
+    PfmFile() : mFile(NULL), mResX(0), mResY(0), mDataOffset(0) {}
+
+    ~PfmFile()
+    {
+        if(mFile)
+            fclose(mFile);
+    }
+
+    bool Open(const char *aFilename)
+    {
+        mFile = fopen(aFilename, "rb");
+        if(!mFile)
+        {
+            printf("Cannot open texture %s\n", aFilename);
+            return false;
+        }
+
+        char  magic[3] = {0};
+        float scale;
+        if(fscanf(mFile, "%2s %d %d %f", magic, &mResX, &mResY, &scale) != 4 ||
+           strcmp(magic, "PF") != 0 || mResX <= 0 || mResY <= 0)
+        {
+            printf("Texture %s is not an RGB .pfm file\n", aFilename);
+            return false;
+        }
+
+        // Single whitespace separates header from data. We do not
+        // swap bytes, so only little endian (negative scale) is read.
+        fgetc(mFile);
+        mDataOffset = ftell(mFile);
+
+        if(scale >= 0)
+        {
+            printf("Texture %s is big endian, not supported\n", aFilename);
+            return false;
+        }
+
+        return true;
+    }
+
+    int GetResX() const { return mResX; }
+    int GetResY() const { return mResY; }
+
+    // Reads aCount texels of row aY (counted from the bottom, as stored)
+    // starting at aX
+    void ReadTexels(int aX, int aY, int aCount, Vec3f *oTexels) const
+    {
+        const long long offset = mDataOffset +
+            ((long long)aY * mResX + aX) * (long long)sizeof(Vec3f);
+
+        bool ok;
+#pragma omp critical(texture_file)
+        {
+            ok = Seek(offset) &&
+                fread(oTexels, sizeof(Vec3f), aCount, mFile) == size_t(aCount);
+        }
+
+        if(!ok)
+            std::fill(oTexels, oTexels + aCount, Vec3f(0));
+    }
+
+private:
+
+    bool Seek(long long aOffset) const
+    {
+#if defined(_MSC_VER)
+        return _fseeki64(mFile, aOffset, SEEK_SET) == 0;
+#else
+        return fseeko(mFile, off_t(aOffset), SEEK_SET) == 0;
+#endif
+    }
+
+    FILE      *mFile;
+    int       mResX, mResY;
+    long long mDataOffset;
+};
+
+class TextureCache
+{
+public:
+
+    enum { kTileSize     = 32 };  //!< Texels along tile side
+    enum { kTileTexels   = kTileSize * kTileSize };
+    enum { kThreadTiles  = 64 };  //!< Entries of per-thread table, power of 2
+    enum { kMaxThreads   = 256 }; //!< Threads with own table, others always lock
+
+    TextureCache()
+    {
+        mClockHand  = 0;
+        mSlotCount  = 0;
+        mTileLoads  = 0;
+        SetBudget(256 << 20);
+    }
+
+    ~TextureCache()
+    {
+        for(size_t i=0; i<mTextures.size(); i++)
+            delete mTextures[i].mFile;
+        for(size_t i=0; i<mSlots.size(); i++)
+            delete [] mSlots[i].mTexels;
+    }
+
+    // Memory for tiles, in bytes. Has to be set before rendering.
+    void SetBudget(size_t aBytes)
+    {
+        for(size_t i=0; i<mSlots.size(); i++)
+            delete [] mSlots[i].mTexels;
+
+        const size_t tileBytes = kTileTexels * sizeof(Vec3f);
+        mSlots.assign(std::max<size_t>(aBytes / tileBytes, 16), Slot());
+        mSlotCount = 0;
+        mClockHand = 0;
+        mSlotOfTile.clear();
+        mThreadCaches.assign(kMaxThreads, ThreadCache());
+    }
+
+    // Returns texture index, or -1 when the file cannot be read
+    int AddTexture(const char *aFilename)
+    {
+        Texture texture;
+        texture.mFile = new PfmFile;
+
+        if(!texture.mFile->Open(aFilename))
+        {
+            delete texture.mFile;
+            return -1;
+        }
+
+        int resX = texture.mFile->GetResX();
+        int resY = texture.mFile->GetResY();
+        for(;;)
+        {
+            texture.mLevelRes.push_back(Vec2i(resX, resY));
+            if(resX == 1 && resY == 1)
+                break;
+            resX = std::max(resX / 2, 1);
+            resY = std::max(resY / 2, 1);
+        }
+
+        mTextures.push_back(texture);
+        return int(mTextures.size()) - 1;
+    }
+
+    int GetTextureCount() const { return int(mTextures.size()); }
+
+    // Tiles read or filtered so far, for statistics
+    int GetTileLoads() const { return mTileLoads; }
+
+    // Bilinearly filtered texel at aUV, repeating outside [0,1]^2, with
+    // v going up. aFootprint is the size of the looked up area in uv units
+    // and picks the mip-map level.
+    Vec3f Lookup(
+        const int   aTexture,
+        const Vec2f &aUV,
+        const float aFootprint) const
+    {
+        const Texture &texture = mTextures[aTexture];
+        const int maxLevel = int(texture.mLevelRes.size()) - 1;
+
+        const float texels = aFootprint * float(texture.mLevelRes[0].x);
+        const int   level  = (texels > 1.f) ?
+            std::min(int(std::log(texels) * 1.442695f), maxLevel) : 0;
+        const Vec2i res = texture.mLevelRes[level];
+
+        const float x  = (aUV.x - std::floor(aUV.x)) * res.x - 0.5f;
+        const float y  = (aUV.y - std::floor(aUV.y)) * res.y - 0.5f;
+        const float fx = std::floor(x);
+        const float fy = std::floor(y);
+        const float tx = x - fx;
+        const float ty = y - fy;
+
+        const int x0 = Wrap(int(fx), res.x), x1 = Wrap(int(fx) + 1, res.x);
+        const int y0 = Wrap(int(fy), res.y), y1 = Wrap(int(fy) + 1, res.y);
+
+        return
+            (GetTexel(aTexture, level, x0, y0) * (1.f - tx) +
+             GetTexel(aTexture, level, x1, y0) * tx) * (1.f - ty) +
+            (GetTexel(aTexture, level, x0, y1) * (1.f - tx) +
+             GetTexel(aTexture, level, x1, y1) * tx) * ty;
+    }
+
+private:
+
+    struct Texture
+    {
+        PfmFile            *mFile;
+        std::vector<Vec2i> mLevelRes; //!< Resolution of mip-map levels
+    };
+
+    typedef unsigned long long TileKey;
+
+    struct Slot
+    {
+        Slot() : mKey(0), mGeneration(0), mReferenced(0), mTexels(NULL) {}
+
+        TileKey      mKey;
+        volatile int mGeneration; //!< Odd while being (re)loaded
+        int          mReferenced; //!< Used since the clock hand passed, set without lock
+        Vec3f        *mTexels;
+    };
+
+    struct ThreadTile
+    {
+        ThreadTile() : mKey(~TileKey(0)), mSlot(0), mGeneration(0) {}
+
+        TileKey mKey;
+        int     mSlot;
+        int     mGeneration; //!< Of the slot when the tile was found there
+    };
+
+    struct ThreadCache
+    {
+        ThreadTile mTiles[kThreadTiles];
+    };
+
+    static int Wrap(int aCoord, int aRes)
+    {
+        aCoord %= aRes;
+        return aCoord < 0 ? aCoord + aRes : aCoord;
+    }
+
+    static TileKey GetTileKey(int aTexture, int aLevel, int aTileX, int aTileY)
+    {
+        return (TileKey(aTexture) << 48) | (TileKey(aLevel) << 40) |
+            (TileKey(aTileY) << 20) | TileKey(aTileX);
+    }
+
+    Vec3f GetTexel(
+        const int aTexture,
+        const int aLevel,
+        const int aX,
+        const int aY) const
+    {
+        const TileKey key = GetTileKey(aTexture, aLevel, aX / kTileSize, aY / kTileSize);
+        const int texelIdx = (aX % kTileSize) + (aY % kTileSize) * kTileSize;
+
+        // Lock-free hit in the table of this thread
+        const int thread = omp_get_thread_num();
+        ThreadTile *threadTile = NULL;
+
+        if(thread < kMaxThreads)
+        {
+            threadTile = &mThreadCaches[thread].mTiles[
+                (key ^ (key >> 17) ^ (key >> 40)) & (kThreadTiles - 1)];
+
+            if(threadTile->mKey == key)
+            {
+                Slot &slot = mSlots[threadTile->mSlot];
+                const int generation = slot.mGeneration;
+
+                if(generation == threadTile->mGeneration)
+                {
+#pragma omp flush
+                    const Vec3f texel = slot.mTexels[texelIdx];
+#pragma omp flush
+                    if(slot.mGeneration == generation)
+                    {
+                        slot.mReferenced = 1;
+                        return texel;
+                    }
+                }
+            }
+        }
+
+        Vec3f texel;
+        if(FindTexel(key, texelIdx, threadTile, texel))
+            return texel;
+
+        // Tile is loaded without lock, concurrent loads of the same tile
+        // are rare and only waste time
+        std::vector<Vec3f> tile(kTileTexels);
+        LoadTile(aTexture, aLevel, aX / kTileSize, aY / kTileSize, &tile[0]);
+
+        bool found = false;
+#pragma omp critical(texture_cache)
+        {
+            std::map<TileKey, int>::const_iterator it = mSlotOfTile.find(key);
+            if(it == mSlotOfTile.end())
+                it = StoreTile(key, &tile[0]);
+            else
+                found = true;
+
+            const Slot &slot = mSlots[it->second];
+            texel = slot.mTexels[texelIdx];
+            if(threadTile)
+            {
+                threadTile->mKey        = key;
+                threadTile->mSlot       = it->second;
+                threadTile->mGeneration = slot.mGeneration;
+            }
+        }
+
+        return found ? texel : tile[texelIdx];
+    }
+
+    // Looks up tile in the shared cache, fills the thread table on hit
+    bool FindTexel(
+        const TileKey aKey,
+        const int     aTexelIdx,
+        ThreadTile    *aoThreadTile,
+        Vec3f         &oTexel) const
+    {
+        bool found = false;
+#pragma omp critical(texture_cache)
+        {
+            std::map<TileKey, int>::const_iterator it = mSlotOfTile.find(aKey);
+            if(it != mSlotOfTile.end())
+            {
+                Slot &slot = mSlots[it->second];
+                slot.mReferenced = 1;
+                oTexel = slot.mTexels[aTexelIdx];
+                found  = true;
+
+                if(aoThreadTile)
+                {
+                    aoThreadTile->mKey        = aKey;
+                    aoThreadTile->mSlot       = it->second;
+                    aoThreadTile->mGeneration = slot.mGeneration;
+                }
+            }
+        }
+
+        return found;
+    }
+
+    // Puts tile to a free slot, or evicts one by the clock (second chance)
+    // approximation of LRU: the hand clears reference flags of used slots
+    // until it finds one not used since its last pass, in amortized O(1).
+    // Called in the critical section.
+    std::map<TileKey, int>::const_iterator StoreTile(
+        const TileKey aKey,
+        const Vec3f   *aTexels) const
+    {
+        int slotIdx;
+        if(mSlotCount < int(mSlots.size()))
+        {
+            slotIdx = mSlotCount++;
+            mSlots[slotIdx].mTexels = new Vec3f[kTileTexels];
+        }
+        else
+        {
+            while(mSlots[mClockHand].mReferenced)
+            {
+                mSlots[mClockHand].mReferenced = 0;
+                mClockHand = (mClockHand + 1) % mSlotCount;
+            }
+
+            slotIdx    = mClockHand;
+            mClockHand = (mClockHand + 1) % mSlotCount;
+            mSlotOfTile.erase(mSlots[slotIdx].mKey);
+        }
+
+        Slot &slot = mSlots[slotIdx];
+        slot.mGeneration++;
+#pragma omp flush
+        memcpy(slot.mTexels, aTexels, kTileTexels * sizeof(Vec3f));
+        slot.mKey        = aKey;
+        slot.mReferenced = 1;
+#pragma omp flush
+        slot.mGeneration++;
+
+        mTileLoads++;
+        return mSlotOfTile.insert(std::make_pair(aKey, slotIdx)).first;
+    }
+
+    // Reads tile of level 0 from file, or filters it from the level below
+    void LoadTile(
+        const int aTexture,
+        const int aLevel,
+        const int aTileX,
+        const int aTileY,
+        Vec3f     *oTexels) const
+    {
+        const Texture &texture = mTextures[aTexture];
+        const Vec2i   res      = texture.mLevelRes[aLevel];
+
+        const int x0 = aTileX * kTileSize;
+        const int y0 = aTileY * kTileSize;
+        const int countX = std::min(int(kTileSize), res.x - x0);
+        const int countY = std::min(int(kTileSize), res.y - y0);
+
+        std::fill(oTexels, oTexels + kTileTexels, Vec3f(0));
+
+        if(aLevel == 0)
+        {
+            for(int y=0; y<countY; y++)
+                texture.mFile->ReadTexels(x0, y0 + y, countX, oTexels + y * kTileSize);
+            return;
+        }
+
+        // Box filter, odd last texel of the level below is dropped
+        const Vec2i resBelow = texture.mLevelRes[aLevel - 1];
+        for(int y=0; y<countY; y++)
+        {
+            for(int x=0; x<countX; x++)
+            {
+                const int bx0 = 2 * (x0 + x), bx1 = std::min(bx0 + 1, resBelow.x - 1);
+                const int by0 = 2 * (y0 + y), by1 = std::min(by0 + 1, resBelow.y - 1);
+
+                oTexels[x + y * kTileSize] = 0.25f * (
+                    GetTexel(aTexture, aLevel - 1, bx0, by0) +
+                    GetTexel(aTexture, aLevel - 1, bx1, by0) +
+                    GetTexel(aTexture, aLevel - 1, bx0, by1) +
+                    GetTexel(aTexture, aLevel - 1, bx1, by1));
+            }
+        }
+    }
+
+private:
+
+    std::vector<Texture> mTextures;
+
+    // Cache state changes during rendering, which sees scene as const
+    mutable std::vector<Slot>        mSlots;      //!< Fixed count, from budget
+    mutable int                      mSlotCount;  //!< Slots used so far
+    mutable std::map<TileKey, int>   mSlotOfTile;
+    mutable std::vector<ThreadCache> mThreadCaches;
+    mutable int                      mClockHand;  //!< Next eviction candidate
+    mutable int                      mTileLoads;
+};
+
+#endif //__TEXTURE_HXX__
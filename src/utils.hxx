@@ -28,6 +28,7 @@
 #include <vector>
 #include <cmath>
 #include "math.hxx"
+#include "fastmath.hxx"
 
 #define EPS_COSINE 1e-6f
 #define EPS_RAY    1e-3f
@@ -166,6 +167,45 @@ float ConcentricDiscPdfA()
     return INV_PI_F;
 }
 
+// Inverse of SampleConcentricDisc, returns the samples mapped to the point
+Vec2f ConcentricDiscToSamples(
+    const Vec2f &aPoint)
+{
+    const float r = std::sqrt(aPoint.x * aPoint.x + aPoint.y * aPoint.y);
+    float phi = std::atan2(aPoint.y, aPoint.x);
+
+    if(phi < -PI_F/4.f)
+        phi += 2.f * PI_F;
+
+    const float t = phi / (PI_F/4.f);
+    float a, b;
+
+    if(t < 1.f)         /* region 1 */
+    {
+        a = r;
+        b = a * t;
+    }
+    else if(t < 3.f)    /* region 2 */
+    {
+        b = r;
+        a = b * (2.f - t);
+    }
+    else if(t < 5.f)    /* region 3 */
+    {
+        a = -r;
+        b = a * (t - 4.f);
+    }
+    else                /* region 4 */
+    {
+        b = -r;
+        a = b * (6.f - t);
+    }
+
+    return Vec2f(
+        std::min(std::max((a + 1.f) * 0.5f, 0.f), 0.99999994f),
+        std::min(std::max((b + 1.f) * 0.5f, 0.f), 0.99999994f));
+}
+
 
 //////////////////////////////////////////////////////////////////////////
 /// Sample direction in the upper hemisphere with cosine-proportional pdf
@@ -190,6 +230,18 @@ Vec3f SampleCosHemisphereW(
     return ret;
 }
 
+// Inverse of SampleCosHemisphereW, for direction in the upper hemisphere
+Vec2f CosHemisphereToSamples(
+    const Vec3f &aLocalDir)
+{
+    float phi = std::atan2(aLocalDir.y, aLocalDir.x);
+    if(phi < 0) phi += 2.f * PI_F;
+
+    return Vec2f(
+        std::min(phi * (0.5f * INV_PI_F), 0.99999994f),
+        std::min(Sqr(std::max(aLocalDir.z, 0.f)), 0.99999994f));
+}
+
 float CosHemispherePdfW(
     const Vec3f  &aNormal,
     const Vec3f  &aDirection)
@@ -206,6 +258,16 @@ Vec2f SampleUniformTriangle(const Vec2f &aSamples)
     return Vec2f(1.f - term, aSamples.y * term);
 }
 
+// Inverse of SampleUniformTriangle
+Vec2f UniformTriangleToSamples(const Vec2f &aBarycentric)
+{
+    const float term = 1.f - aBarycentric.x;
+
+    return Vec2f(
+        std::min(std::max(Sqr(term), 0.f), 0.99999994f),
+        term > 0 ? std::min(std::max(aBarycentric.y / term, 0.f), 0.99999994f) : 0.f);
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Sphere sampling
 
@@ -230,6 +292,18 @@ Vec3f SampleUniformSphereW(
     return ret;
 }
 
+// Inverse of SampleUniformSphereW
+Vec2f UniformSphereToSamples(
+    const Vec3f &aDirection)
+{
+    float phi = std::atan2(aDirection.y, aDirection.x);
+    if(phi < 0) phi += 2.f * PI_F;
+
+    return Vec2f(
+        std::min(phi * (0.5f * INV_PI_F), 0.99999994f),
+        std::min(std::max((1.f - aDirection.z) * 0.5f, 0.f), 0.99999994f));
+}
+
 float UniformSpherePdfW()
 {
     //return (1.f / (4.f * PI_F));
@@ -258,4 +332,195 @@ float PdfAtoW(
     return aPdfA * Sqr(aDist) / std::abs(aCosThere);
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Batch samplers
+//
+// Versions of the samplers above over aCount samples, in structure of
+// arrays layout. They use the approximations of fastmath.hxx, so their
+// loops are vectorized. Against the same mappings in double, points and
+// directions are within 1e-6 and pdfs within 2e-6 (relative for the power
+// cosine), except where float cancels as in the scalar versions: power
+// cosine directions close to the lobe axis (2e-5) and Fresnel near the
+// critical angle (3e-6). tests/fastmath_test.cxx checks these bounds.
+// Pdf outputs may be NULL.
+
+void SampleCosHemisphereW(
+    const float *aSamplesX,
+    const float *aSamplesY,
+    const int   aCount,
+    float       *oDirX,
+    float       *oDirY,
+    float       *oDirZ,
+    float       *oPdfW)
+{
+    for(int i=0; i<aCount; i++)
+    {
+        float sinPhi, cosPhi;
+        FastSinCos(2.f * PI_F * aSamplesX[i], sinPhi, cosPhi);
+        const float term2 = std::sqrt(1.f - aSamplesY[i]);
+
+        oDirX[i] = cosPhi * term2;
+        oDirY[i] = sinPhi * term2;
+        oDirZ[i] = std::sqrt(aSamplesY[i]);
+    }
+
+    if(oPdfW)
+    {
+        for(int i=0; i<aCount; i++)
+            oPdfW[i] = oDirZ[i] * INV_PI_F;
+    }
+}
+
+void SamplePowerCosHemisphereW(
+    const float *aSamplesX,
+    const float *aSamplesY,
+    const float aPower,
+    const int   aCount,
+    float       *oDirX,
+    float       *oDirY,
+    float       *oDirZ,
+    float       *oPdfW)
+{
+    // cos = y^(1 / (n + 1)) and pdf ~ cos^n share the logarithm of y
+    const float invPowerPlusOne = 1.f / (aPower + 1.f);
+
+    for(int i=0; i<aCount; i++)
+    {
+        float sinPhi, cosPhi;
+        FastSinCos(2.f * PI_F * aSamplesX[i], sinPhi, cosPhi);
+        const float logY  = FastLog2(aSamplesY[i]);
+        const float term2 = SelectFloat(aSamplesY[i] > 0.f,
+            FastExp2(logY * invPowerPlusOne), 0.f);
+        const float term3 = std::sqrt(std::max(0.f, 1.f - term2 * term2));
+
+        oDirX[i] = cosPhi * term3;
+        oDirY[i] = sinPhi * term3;
+        oDirZ[i] = term2;
+    }
+
+    if(oPdfW)
+    {
+        for(int i=0; i<aCount; i++)
+        {
+            const float cosPowN = SelectFloat(aSamplesY[i] > 0.f,
+                FastExp2(FastLog2(aSamplesY[i]) * aPower * invPowerPlusOne), 0.f);
+            oPdfW[i] = (aPower + 1.f) * cosPowN * (0.5f * INV_PI_F);
+        }
+    }
+}
+
+// Branch free form of the concentric mapping, each lane selects its region
+void SampleConcentricDisc(
+    const float *aSamplesX,
+    const float *aSamplesY,
+    const int   aCount,
+    float       *oPointX,
+    float       *oPointY)
+{
+    for(int i=0; i<aCount; i++)
+    {
+        const float a = 2.f * aSamplesX[i] - 1.f;
+        const float b = 2.f * aSamplesY[i] - 1.f;
+
+        // Regions 1 and 3 have |a| > |b|, regions 3 and 4 negative radius
+        const bool  upper = a > -b;
+        const bool  useA  = (upper & (a > b)) | (!upper & (a < b));
+        const float num   = SelectFloat(useA, b, a);
+        const float den   = SelectFloat(useA, a, b);
+        const float ratio = SelectFloat(den != 0.f, num / SelectFloat(den != 0.f, den, 1.f), 0.f);
+
+        const float offset = float(int(!upper) * 4 + int(!useA) * 2);
+        const float phi    = (PI_F/4.f) * (offset + SelectFloat(useA, ratio, -ratio));
+        const float r      = SelectFloat(upper, den, -den);
+
+        float sinPhi, cosPhi;
+        FastSinCos(phi, sinPhi, cosPhi);
+        oPointX[i] = r * cosPhi;
+        oPointY[i] = r * sinPhi;
+    }
+}
+
+void SampleUniformSphereW(
+    const float *aSamplesX,
+    const float *aSamplesY,
+    const int   aCount,
+    float       *oDirX,
+    float       *oDirY,
+    float       *oDirZ,
+    float       *oPdfSA)
+{
+    for(int i=0; i<aCount; i++)
+    {
+        float sinPhi, cosPhi;
+        FastSinCos(2.f * PI_F * aSamplesX[i], sinPhi, cosPhi);
+        const float term2 = 2.f * std::sqrt(aSamplesY[i] - aSamplesY[i] * aSamplesY[i]);
+
+        oDirX[i] = cosPhi * term2;
+        oDirY[i] = sinPhi * term2;
+        oDirZ[i] = 1.f - 2.f * aSamplesY[i];
+    }
+
+    if(oPdfSA)
+    {
+        for(int i=0; i<aCount; i++)
+            oPdfSA[i] = INV_PI_F * 0.25f;
+    }
+}
+
+void FresnelDielectric(
+    const float *aCosInc,
+    const float mIOR,
+    const int   aCount,
+    float       *oFresnel)
+{
+    if(mIOR < 0)
+    {
+        for(int i=0; i<aCount; i++)
+            oFresnel[i] = 1.f;
+        return;
+    }
+
+    for(int i=0; i<aCount; i++)
+    {
+        const bool  inside = aCosInc[i] < 0.f;
+        const float cosInc = std::abs(aCosInc[i]);
+        const float etaIncOverEtaTrans = SelectFloat(inside, mIOR, 1.f / mIOR);
+
+        const float sinTrans2 = Sqr(etaIncOverEtaTrans) * (1.f - Sqr(cosInc));
+        const float cosTrans  = std::sqrt(std::max(0.f, 1.f - sinTrans2));
+
+        const float term1 = etaIncOverEtaTrans * cosTrans;
+        const float rParallel =
+            (cosInc - term1) / (cosInc + term1);
+
+        const float term2 = etaIncOverEtaTrans * cosInc;
+        const float rPerpendicular =
+            (term2 - cosTrans) / (term2 + cosTrans);
+
+        oFresnel[i] = 0.5f * (Sqr(rParallel) + Sqr(rPerpendicular));
+    }
+}
+
+void PdfWtoA(
+    const float *aPdfW,
+    const float *aDist,
+    const float *aCosThere,
+    const int   aCount,
+    float       *oPdfA)
+{
+    for(int i=0; i<aCount; i++)
+        oPdfA[i] = aPdfW[i] * std::abs(aCosThere[i]) / Sqr(aDist[i]);
+}
+
+void PdfAtoW(
+    const float *aPdfA,
+    const float *aDist,
+    const float *aCosThere,
+    const int   aCount,
+    float       *oPdfW)
+{
+    for(int i=0; i<aCount; i++)
+        oPdfW[i] = aPdfA[i] * Sqr(aDist[i]) / std::abs(aCosThere[i]);
+}
+
 #endif //__UTILS_HXX__
@@ -28,6 +28,7 @@
 #include <vector>
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include "renderer.hxx"
 #include "bsdf.hxx"
 #include "rng.hxx"
@@ -58,8 +59,81 @@
 // where ## is the equation number. 
 //
 
+// Algorithms implemented by VertexCM. Each is a separate instantiation, so
+// the branches and MIS bookkeeping of the others do not reach its loops.
+enum VertexCMAlgorithm
+{
+    // light vertices contribute to camera,
+    // No MIS weights (dVCM, dVM, dVC all ignored)
+    kLightTrace = 0,
+
+    // Camera and light vertices merged on first non-specular surface from camera.
+    // Cannot handle mixed specular + non-specular materials, see PpmSupportsScene().
+    // No MIS weights (dVCM, dVM, dVC all ignored)
+    kPpm,
+
+    // Camera and light vertices merged on along full path.
+    // dVCM and dVM used for MIS
+    kBpm,
+
+    // Standard bidirectional path tracing
+    // dVCM and dVC used for MIS
+    kBpt,
+
+    // Vertex connection and mering
+    // dVCM, dVM, and dVC used for MIS
+    kVcm
+};
+
+// Our PPM cannot handle materials mixing specular and non-specular
+// BSDFs. Returns false (with a warning) for such scenes, BPM is used instead.
+inline bool PpmSupportsScene(const Scene &aScene)
+{
+    for(int i = 0; i < aScene.GetMaterialCount(); ++i)
+    {
+        const Material &mat = aScene.GetMaterial(i);
+
+        const bool hasNonSpecular =
+            (mat.mDiffuseReflectance.Max() > 0) ||
+            (mat.mPhongReflectance.Max() > 0);
+
+        const bool hasSpecular =
+            (mat.mMirrorReflectance.Max() > 0) ||
+            (mat.mIOR > 0);
+
+        if(hasNonSpecular && hasSpecular)
+        {
+            printf(
+                "*WARNING* Our PPM implementation cannot handle materials mixing\n"
+                "Specular and NonSpecular BSDFs. The extension would be\n"
+                "fairly straightforward. In SampleScattering for camera sub-paths\n"
+                "limit the considered events to Specular only.\n"
+                "Merging will use non-specular components, scattering will be specular.\n"
+                "If there is no specular component, the ray will terminate.\n\n");
+
+            printf("We are now switching from *PPM* to *BPM*, which can handle the scene\n\n");
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<VertexCMAlgorithm tAlgorithm>
 class VertexCM : public AbstractRenderer
 {
+    // The algorithm is fixed at compile time, branches on these fold away
+
+    // Vertex merging (of some form) is used
+    static const bool kUseVM = (tAlgorithm == kPpm) || (tAlgorithm == kBpm) || (tAlgorithm == kVcm);
+    // Vertex connection (BPT) is used
+    static const bool kUseVC = (tAlgorithm == kBpt) || (tAlgorithm == kVcm);
+    // Do only light tracing
+    static const bool kLightTraceOnly = (tAlgorithm == kLightTrace);
+    // Do PPM, same terminates camera after first merge
+    static const bool kIsPpm = (tAlgorithm == kPpm);
+
     // The sole point of this structure is to make carrying around the ray baggage easier.
     struct SubPathState
     {
@@ -73,8 +147,34 @@ class VertexCM : public AbstractRenderer
         float dVCM; // MIS quantity used for vertex connection and merging
         float dVC;  // MIS quantity used for vertex connection
         float dVM;  // MIS quantity used for vertex merging
+        float dVCEta; // Factor of mMisVmWeightFactor in dVC, see LightDVC()
+    };
+
+    // Merging statistics of a pixel, in the spirit of stochastic
+    // progressive photon mapping
+    struct PixelStats
+    {
+        float mRadius; // Merging radius of the pixel
+        float mCount;  // Accumulated (reduced) count of found light vertices
+    };
+
+    // Camera vertex waiting for deferred merging, see ProcessMergeQueries()
+    struct MergeQuery
+    {
+        Vec3f        mHitPoint;
+        BSDF<false>  mBsdf;
+        SubPathState mState;
+        Vec2f        mScreenSample;
+        Vec2i        mBlockMin;     // Pixel block of the camera sample
+        Vec2i        mBlockSize;
+        float        mRadius;       // Merging radius, when per pixel
+        int          mPixelIdx;     // < 0 ~ radius not per pixel
+        bool         mUpdatesPixel; // First merge of the path, updates pixel radius
     };
 
+    // Deferred merges are run once this many are queued
+    static const int kMergeBatchSize = 1 << 14;
+
     // Path vertex, used for merging and connection
     template<bool tFromLight>
     struct PathVertex
@@ -89,6 +189,7 @@ class VertexCM : public AbstractRenderer
         float dVCM; // MIS quantity used for vertex connection and merging
         float dVC;  // MIS quantity used for vertex connection
         float dVM;  // MIS quantity used for vertex merging
+        float dVCEta; // Factor of mMisVmWeightFactor in dVC, see LightDVC()
 
         // Used by HashGrid
         const Vec3f& GetPosition() const
@@ -111,7 +212,7 @@ class VertexCM : public AbstractRenderer
     public:
 
         RangeQuery(
-            const VertexCM     &aVertexCM,
+            VertexCM           &aVertexCM,
             const Vec3f        &aCameraPosition,
             const CameraBSDF   &aCameraBsdf,
             const SubPathState &aCameraState
@@ -120,13 +221,16 @@ class VertexCM : public AbstractRenderer
             mCameraPosition(aCameraPosition),
             mCameraBsdf(aCameraBsdf),
             mCameraState(aCameraState),
-            mContrib(0)
+            mContrib(0),
+            mCount(0)
         {}
 
         const Vec3f& GetPosition() const { return mCameraPosition; }
 
         const Vec3f& GetContrib() const { return mContrib; }
 
+        int GetCount() const { return mCount; }
+
         void Process(const LightVertex& aLightVertex)
         {
             // Reject if full path length below/above min/max path length
@@ -134,6 +238,8 @@ class VertexCM : public AbstractRenderer
                (aLightVertex.mPathLength + mCameraState.mPathLength < mVertexCM.mMinPathLength))
                  return;
 
+            mCount++;
+
             // Retrieve light incoming direction in world coordinates
             const Vec3f lightDirection = aLightVertex.mBsdf.WorldDirFix();
 
@@ -145,6 +251,9 @@ class VertexCM : public AbstractRenderer
             if(cameraBsdfFactor.IsZero())
                 return;
 
+            // Camera sub-path may be guided
+            cameraBsdfDirPdfW = mVertexCM.GuidedPdf(mCameraBsdf, mCameraPosition,
+                lightDirection, cameraBsdfDirPdfW);
             cameraBsdfDirPdfW *= mCameraBsdf.ContinuationProb();
 
             // Even though this is pdf from camera BSDF, the continuation probability
@@ -154,158 +263,110 @@ class VertexCM : public AbstractRenderer
 
             // Partial light sub-path MIS weight [tech. rep. (38)]
             const float wLight = aLightVertex.dVCM * mVertexCM.mMisVcWeightFactor +
-                aLightVertex.dVM * mVertexCM.Mis(cameraBsdfDirPdfW);
+                mVertexCM.LightDVM(aLightVertex) * mVertexCM.Mis(cameraBsdfDirPdfW);
 
             // Partial eye sub-path MIS weight [tech. rep. (39)]
             const float wCamera = mCameraState.dVCM * mVertexCM.mMisVcWeightFactor +
                 mCameraState.dVM * mVertexCM.Mis(cameraBsdfRevPdfW);
 
             // Full path MIS weight [tech. rep. (37)]. No MIS for PPM
-            const float misWeight = mVertexCM.mPpm ?
+            const float misWeight = kIsPpm ?
                 1.f :
                 1.f / (wLight + 1.f + wCamera);
 
-            mContrib += misWeight * cameraBsdfFactor * aLightVertex.mThroughput;
+            const Vec3f contrib = misWeight * cameraBsdfFactor * aLightVertex.mThroughput;
+            mContrib += contrib;
+
+            // Credit the emission of the light sub-path
+            if(mVertexCM.mEmissionGuide.IsEnabled())
+            {
+                mVertexCM.AddEmissionContrib(mVertexCM.GetLightPathIdx(aLightVertex),
+                    mCameraState.mThroughput * mVertexCM.mVmNormalization * contrib);
+            }
         }
 
     private:
 
-        const VertexCM     &mVertexCM;
+        VertexCM           &mVertexCM;
         const Vec3f        &mCameraPosition;
         const CameraBSDF   &mCameraBsdf;
         const SubPathState &mCameraState;
         Vec3f              mContrib;
-    };
-
-public:
-
-    enum AlgorithmType
-    {
-        // light vertices contribute to camera,
-        // No MIS weights (dVCM, dVM, dVC all ignored)
-        kLightTrace = 0,
-
-        // Camera and light vertices merged on first non-specular surface from camera.
-        // Cannot handle mixed specular + non-specular materials.
-        // No MIS weights (dVCM, dVM, dVC all ignored)
-        kPpm,
-
-        // Camera and light vertices merged on along full path.
-        // dVCM and dVM used for MIS
-        kBpm,
-
-        // Standard bidirectional path tracing
-        // dVCM and dVC used for MIS
-        kBpt,
-
-        // Vertex connection and mering
-        // dVCM, dVM, and dVC used for MIS
-        kVcm
+        int                mCount;    //!< Light vertices found, for per-pixel radius
     };
 
 public:
 
     VertexCM(
         const Scene&  aScene,
-        AlgorithmType aAlgorithm,
         const float   aRadiusFactor,
         const float   aRadiusAlpha,
         int           aSeed = 1234
     ) :
         AbstractRenderer(aScene),
-        mRng(aSeed),
-        mLightTraceOnly(false),
-        mUseVC(false),
-        mUseVM(false),
-        mPpm(false)
+        mCameraPathsPerPixel(1),
+        mDeferMerging(false),
+        mRng(aSeed)
     {
-        switch(aAlgorithm)
-        {
-        case kLightTrace:
-            mLightTraceOnly = true;
-            break;
-        case kPpm:
-            mPpm   = true;
-            mUseVM = true;
-            break;
-        case kBpm:
-            mUseVM = true;
-            break;
-        case kBpt:
-            mUseVC = true;
-            break;
-        case kVcm:
-            mUseVC = true;
-            mUseVM = true;
-            break;
-        default:
-            printf("Unknown algorithm requested\n");
-            break;
-        }
-
-        if(mPpm)
-        {
-            // We will check the scene to make sure it does not contain mixed
-            // specular and non-specular materials
-            for(int i = 0; i < mScene.GetMaterialCount(); ++i)
-            {
-                const Material &mat = mScene.GetMaterial(i);
+        mBaseRadius  = aRadiusFactor * mScene.mSceneSphere.mSceneRadius;
+        mRadiusAlpha = aRadiusAlpha;
+    }
 
-                const bool hasNonSpecular =
-                    (mat.mDiffuseReflectance.Max() > 0) ||
-                    (mat.mPhongReflectance.Max() > 0);
+    // Light sub-paths learn where to be emitted
+    virtual void EnableAdaptiveEmission()
+    {
+        mEmissionGuide.Setup(mScene.GetLightCount());
+    }
 
-                const bool hasSpecular =
-                    (mat.mMirrorReflectance.Max() > 0) ||
-                    (mat.mIOR > 0);
+    // Camera paths of one pixel share light vertices (and the grid)
+    virtual void SetCameraPathsPerPixel(const int aCount)
+    {
+        mCameraPathsPerPixel = std::max(aCount, 1);
+    }
 
-                if(hasNonSpecular && hasSpecular)
-                {
-                    printf(
-                        "*WARNING* Our PPM implementation cannot handle materials mixing\n"
-                        "Specular and NonSpecular BSDFs. The extension would be\n"
-                        "fairly straightforward. In SampleScattering for camera sub-paths\n"
-                        "limit the considered events to Specular only.\n"
-                        "Merging will use non-specular components, scattering will be specular.\n"
-                        "If there is no specular component, the ray will terminate.\n\n");
+    // Merging radius adapts per pixel to the light vertices found there
+    virtual void EnableAdaptiveRadius()
+    {
+        if(!kUseVM)
+            return;
 
-                    printf("We are now switching from *PPM* to *BPM*, which can handle the scene\n\n");
+        PixelStats stats;
+        stats.mRadius = mBaseRadius;
+        stats.mCount  = 0;
 
-                    mPpm = false;
-                    break;
-                }
-            }
-        }
+        const Vec2f &resolution = mScene.mCamera.mResolution;
+        mPixelStats.assign(int(resolution.x) * int(resolution.y), stats);
+    }
 
-        mBaseRadius  = aRadiusFactor * mScene.mSceneSphere.mSceneRadius;
-        mRadiusAlpha = aRadiusAlpha;
+    // Camera vertices are merged in batches, sorted by grid cell
+    virtual void EnableDeferredMerging()
+    {
+        mDeferMerging = kUseVM;
     }
 
     virtual void RunIteration(int aIteration)
     {
         // While we have the same number of pixels (camera paths)
-        // and light paths, we do keep them separate for clarity reasons
-        const int resX = int(mScene.mCamera.mResolution.x);
-        const int resY = int(mScene.mCamera.mResolution.y);
-        const int pathCount = resX * resY;
-        mScreenPixelCount = float(resX * resY);
-        mLightSubPathCount   = float(resX * resY);
+        // and light paths, we do keep them separate for clarity reasons.
+        // Only pixels within the crop window are rendered, and the number
+        // of light paths follows, so the cost scales with the window size.
+        // Preview iterations trace one camera path per block of pixels.
+        const int pathCount = mScene.mCamera.CropBlockCount(mBlockSize);
+        mScreenPixelCount = float(pathCount);
+        mLightSubPathCount   = float(pathCount);
 
         // Setup our radius, 1st iteration has aIteration == 0, thus offset
         float radius = mBaseRadius;
         radius /= std::pow(float(aIteration + 1), 0.5f * (1 - mRadiusAlpha));
         // Purely for numeric stability
         radius = std::max(radius, 1e-7f);
-        const float radiusSqr = Sqr(radius);
+        SetupMergingRadius(radius);
 
-        // Factor used to normalise vertex merging contribution.
-        // We divide the summed up energy by disk radius and number of light paths
-        mVmNormalization = 1.f / (radiusSqr * PI_F * mLightSubPathCount);
+        // Light sub-paths always use the radius of the iteration
+        mLightMisVmWeightFactor = mMisVmWeightFactor;
 
-        // MIS weight constant [tech. rep. (20)], with n_VC = 1 and n_VM = mLightPathCount
-        const float etaVCM = (PI_F * radiusSqr) * mLightSubPathCount;
-        mMisVmWeightFactor = mUseVM ? Mis(etaVCM)       : 0.f;
-        mMisVcWeightFactor = mUseVC ? Mis(1.f / etaVCM) : 0.f;
+        // Grid has to cover the largest radius of pixels
+        const float gridRadius = UsePixelRadius() ? MaxPixelRadius() : radius;
 
         // Clear path ends, nothing ends anywhere
         mPathEnds.resize(pathCount);
@@ -315,13 +376,16 @@ public:
         mLightVertices.reserve(pathCount);
         mLightVertices.clear();
 
+        if(mEmissionGuide.IsEnabled())
+            mEmissionCells.resize(pathCount);
+
         //////////////////////////////////////////////////////////////////////////
         // Generate light paths
         //////////////////////////////////////////////////////////////////////////
         for(int pathIdx = 0; pathIdx < pathCount; pathIdx++)
         {
             SubPathState lightState;
-            GenerateLightSample(lightState);
+            GenerateLightSample(pathIdx, lightState);
 
             //////////////////////////////////////////////////////////////////////////
             // Trace light path
@@ -357,11 +421,12 @@ public:
                     lightState.dVCM /= Mis(std::abs(bsdf.CosThetaFix()));
                     lightState.dVC  /= Mis(std::abs(bsdf.CosThetaFix()));
                     lightState.dVM  /= Mis(std::abs(bsdf.CosThetaFix()));
+                    lightState.dVCEta /= Mis(std::abs(bsdf.CosThetaFix()));
                 }
 
                 // Store vertex, unless BSDF is purely specular, which prevents
                 // vertex connections and merging
-                if(!bsdf.IsDelta() && (mUseVC || mUseVM))
+                if(!bsdf.IsDelta() && (kUseVC || kUseVM))
                 {
                     LightVertex lightVertex;
                     lightVertex.mHitpoint   = hitPoint;
@@ -372,15 +437,16 @@ public:
                     lightVertex.dVCM = lightState.dVCM;
                     lightVertex.dVC  = lightState.dVC;
                     lightVertex.dVM  = lightState.dVM;
+                    lightVertex.dVCEta = lightState.dVCEta;
 
                     mLightVertices.push_back(lightVertex);
                 }
 
                 // Connect to camera, unless BSDF is purely specular
-                if(!bsdf.IsDelta() && (mUseVC || mLightTraceOnly))
+                if(!bsdf.IsDelta() && (kUseVC || kLightTraceOnly))
                 {
                     if(lightState.mPathLength + 1 >= mMinPathLength)
-                        ConnectToCamera(lightState, hitPoint, bsdf);
+                        ConnectToCamera(pathIdx, lightState, hitPoint, bsdf);
                 }
 
                 // Terminate if the path would become too long after scattering
@@ -400,23 +466,59 @@ public:
         //////////////////////////////////////////////////////////////////////////
 
         // Only build grid when merging (VCM, BPM, and PPM)
-        if(mUseVM)
+        if(kUseVM)
         {
             // The number of cells is somewhat arbitrary, but seems to work ok
             mHashGrid.Reserve(pathCount);
-            mHashGrid.Build(mLightVertices, radius);
+            mHashGrid.Build(mLightVertices, gridRadius);
         }
 
         //////////////////////////////////////////////////////////////////////////
         // Generate camera paths
         //////////////////////////////////////////////////////////////////////////
 
-        // Unless rendering with traditional light tracing
-        for(int pathIdx = 0; (pathIdx < pathCount) && (!mLightTraceOnly); ++pathIdx)
+        // Unless rendering with traditional light tracing. Each pixel traces
+        // mCameraPathsPerPixel camera paths, all paired with its light path
+        // for connections, and averages them
+        const int   cameraPathCount  = pathCount * mCameraPathsPerPixel;
+        const float cameraPathWeight = 1.f / mCameraPathsPerPixel;
+        CameraRayBatch cameraRays;
+
+        for(int cameraIdx = 0; (cameraIdx < cameraPathCount) && (!kLightTraceOnly); ++cameraIdx)
         {
+            const int pathIdx = cameraIdx / mCameraPathsPerPixel;
+
+            // Full batch of deferred merges is run between camera paths,
+            // as it changes the merging radius when that is per pixel
+            if(mMergeQueries.size() >= kMergeBatchSize)
+                ProcessMergeQueries(cameraPathWeight);
+
+            // Camera rays are generated a batch at a time
+            const int batchIdx = cameraIdx % CameraRayBatch::kSize;
+            if(batchIdx == 0)
+                GenerateCameraBatch(cameraIdx, cameraPathCount, mCameraPathsPerPixel,
+                    false, mRng, cameraRays);
+
             SubPathState cameraState;
-            const Vec2f screenSample = GenerateCameraSample(pathIdx, cameraState);
+            const Vec2i &blockMin  = cameraRays.mBlockMin[batchIdx];
+            const Vec2i &blockSize = cameraRays.mBlockSize[batchIdx];
+            const Vec2f screenSample = GenerateCameraSample(cameraRays, batchIdx,
+                cameraState);
             Vec3f color(0);
+            Vec3f colorDirect(0), colorVC(0), colorVM(0); // Split by technique, for AOVs
+            float pathDistance = 0;    // Length of the path, for features
+            int   foundCount   = -1;   // Light vertices found by first merge
+
+            // Features not recorded yet, only first path of pixel records them
+            bool  needFeatures = (cameraIdx % mCameraPathsPerPixel == 0);
+
+            // Camera sub-path merges with the radius of its pixel
+            PixelStats *pixelStats = NULL;
+            if(UsePixelRadius())
+            {
+                pixelStats = &mPixelStats[GetPixelIndex(screenSample)];
+                SetupMergingRadius(pixelStats->mRadius);
+            }
 
             //////////////////////////////////////////////////////////////////////
             // Trace camera path
@@ -437,9 +539,12 @@ public:
                     {
                         if(cameraState.mPathLength >= mMinPathLength)
                         {
-                            color += cameraState.mThroughput *
+                            const Vec3f contrib = cameraState.mThroughput *
                                 GetLightRadiance(mScene.GetBackground(), cameraState,
                                 Vec3f(0), ray.dir);
+                            color       += contrib;
+                            colorDirect += contrib;
+                            mGuide.AddPathContrib(contrib);
                         }
                     }
 
@@ -453,6 +558,14 @@ public:
                 if(!bsdf.IsValid())
                     break;
 
+                // Features (AOVs), from first non-specular surface or light
+                pathDistance += isect.dist;
+                if(needFeatures && (!bsdf.IsDelta() || isect.lightID >= 0))
+                {
+                    AddFeatures(screenSample, ray, isect, pathDistance);
+                    needFeatures = false;
+                }
+
                 // Update the MIS quantities, following the initialization in
                 // GenerateLightSample() or SampleScattering(). Implement equations
                 // [tech. rep. (31)-(33)] or [tech. rep. (34)-(36)], respectively.
@@ -471,8 +584,11 @@ public:
                 
                     if(cameraState.mPathLength >= mMinPathLength)
                     {
-                        color += cameraState.mThroughput *
+                        const Vec3f contrib = cameraState.mThroughput *
                             GetLightRadiance(light, cameraState, hitPoint, ray.dir);
+                        color       += contrib;
+                        colorDirect += contrib;
+                        mGuide.AddPathContrib(contrib);
                     }
                     
                     break;
@@ -484,18 +600,21 @@ public:
 
                 ////////////////////////////////////////////////////////////////
                 // Vertex connection: Connect to a light source
-                if(!bsdf.IsDelta() && mUseVC)
+                if(!bsdf.IsDelta() && kUseVC)
                 {
                     if(cameraState.mPathLength + 1>= mMinPathLength)
                     {
-                        color += cameraState.mThroughput *
+                        const Vec3f contrib = cameraState.mThroughput *
                             DirectIllumination(cameraState, hitPoint, bsdf);
+                        color       += contrib;
+                        colorDirect += contrib;
+                        mGuide.AddPathContrib(contrib);
                     }
                 }
 
                 ////////////////////////////////////////////////////////////////
                 // Vertex connection: Connect to light vertices
-                if(!bsdf.IsDelta() && mUseVC)
+                if(!bsdf.IsDelta() && kUseVC)
                 {
                     // For VC, each light sub-path is assigned to a particular eye
                     // sub-path, as in traditional BPT. It is also possible to
@@ -520,31 +639,65 @@ public:
                            cameraState.mPathLength > mMaxPathLength)
                             break;
 
-                        color += cameraState.mThroughput * lightVertex.mThroughput *
+                        const Vec3f contrib = cameraState.mThroughput * lightVertex.mThroughput *
                             ConnectVertices(lightVertex, bsdf, hitPoint, cameraState);
+                        color   += contrib;
+                        colorVC += contrib;
+                        mGuide.AddPathContrib(contrib);
+                        AddEmissionContrib(pathIdx, contrib);
                     }
                 }
 
                 ////////////////////////////////////////////////////////////////
                 // Vertex merging: Merge with light vertices
-                if(!bsdf.IsDelta() && mUseVM)
+                if(!bsdf.IsDelta() && kUseVM && DeferMerging())
+                {
+                    // The first merge updates the pixel radius once it is
+                    // run, zero count keeps the path from doing it
+                    QueueMerge(hitPoint, bsdf, cameraState, screenSample,
+                        blockMin, blockSize, pixelStats, foundCount < 0);
+                    foundCount = 0;
+
+                    // PPM merges only at the first non-specular surface from camera
+                    if(kIsPpm) break;
+                }
+                else if(!bsdf.IsDelta() && kUseVM)
                 {
                     RangeQuery query(*this, hitPoint, bsdf, cameraState);
-                    mHashGrid.Process(mLightVertices, query);
-                    color += cameraState.mThroughput * mVmNormalization * query.GetContrib();
+                    mHashGrid.Process(mLightVertices, query, mRadiusSqr);
+                    if(foundCount < 0)
+                        foundCount = query.GetCount();
+                    const Vec3f contrib = cameraState.mThroughput * mVmNormalization *
+                        query.GetContrib();
+                    color   += contrib;
+                    colorVM += contrib;
+                    mGuide.AddPathContrib(contrib);
 
                     // PPM merges only at the first non-specular surface from camera
-                    if(mPpm) break;
+                    if(kIsPpm) break;
                 }
 
                 if(!SampleScattering(bsdf, hitPoint, cameraState))
                     break;
             }
 
-            mFramebuffer.AddColor(screenSample, color);
+            mGuide.EndPath();
+            AddSampleColor(blockMin, blockSize, screenSample, color * cameraPathWeight);
+            AddTechniqueColors(screenSample, colorDirect * cameraPathWeight,
+                colorVC * cameraPathWeight, colorVM * cameraPathWeight);
+
+            if(pixelStats && foundCount > 0)
+                UpdatePixelRadius(*pixelStats, foundCount);
         }
 
+        if(!mMergeQueries.empty())
+            ProcessMergeQueries(cameraPathWeight);
+
         mIterations++;
+        mGuide.EndIteration();
+
+        if(mEmissionGuide.IsEnabled())
+            mEmissionGuide.Update();
     }
 
 private:
@@ -560,35 +713,25 @@ private:
     // Camera tracing methods
     //////////////////////////////////////////////////////////////////////////
 
-    // Generates new camera sample given a pixel index
+    // Sets up camera sub-path state of a sample in a generated batch,
+    // and returns the sample
     Vec2f GenerateCameraSample(
-        const int    aPixelIndex,
-        SubPathState &oCameraState)
+        const CameraRayBatch &aBatch,
+        const int            aIndex,
+        SubPathState         &oCameraState)
     {
-        const Camera &camera = mScene.mCamera;
-        const int resX = int(camera.mResolution.x);
-        const int resY = int(camera.mResolution.y);
-
-        // Determine pixel (x, y)
-        const int x = aPixelIndex % resX;
-        const int y = aPixelIndex / resX;
-
-        // Jitter pixel position
-        const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
-
-        // Generate ray
-        const Ray primaryRay = camera.GenerateRay(sample);
-
-        // Compute pdf conversion factor from area on image plane to solid angle on ray
-        const float cosAtCamera = Dot(camera.mForward, primaryRay.dir);
-        const float imagePointToCameraDist = camera.mImagePlaneDist / cosAtCamera;
-        const float imageToSolidAngleFactor = Sqr(imagePointToCameraDist) / cosAtCamera;
-
-        // We put the virtual image plane at such a distance from the camera origin
-        // that the pixel area is one and thus the image plane sampling pdf is 1.
-        // The solid angle ray pdf is then equal to the conversion factor from
-        // image plane area density to ray solid angle density
-        const float cameraPdfW = imageToSolidAngleFactor;
+        const Ray primaryRay = aBatch.GetRay(aIndex);
+
+        // The batch has the conversion factor from area on image plane to
+        // solid angle on ray. We put the virtual image plane at such a distance
+        // from the camera origin that the pixel area is one and thus the image
+        // plane sampling pdf is 1. The solid angle ray pdf is then equal
+        // to the conversion factor.
+        // In preview iterations the sample covers a whole block, so its
+        // image plane pdf is 1 / block area instead.
+        const Vec2i &blockSize = aBatch.mBlockSize[aIndex];
+        const float blockArea  = float(blockSize.x * blockSize.y);
+        const float cameraPdfW = aBatch.mPdfW[aIndex] / blockArea;
 
         oCameraState.mOrigin       = primaryRay.org;
         oCameraState.mDirection    = primaryRay.dir;
@@ -599,11 +742,13 @@ private:
 
         // Eye sub-path MIS quantities. Implements [tech. rep. (31)-(33)] partially.
         // The evaluation is completed after tracing the camera ray in the eye sub-path loop.
-        oCameraState.dVCM = Mis(mLightSubPathCount / cameraPdfW);
+        // Camera techniques take mCameraPathsPerPixel samples per pixel.
+        oCameraState.dVCM = Mis(mLightSubPathCount / (cameraPdfW * mCameraPathsPerPixel));
         oCameraState.dVC  = 0;
         oCameraState.dVM  = 0;
+        oCameraState.dVCEta = 0;
 
-        return sample;
+        return aBatch.GetSample(aIndex);
     }
 
     // Returns the radiance of a light source when hit by a random ray,
@@ -639,12 +784,17 @@ private:
         // When using only vertex merging, we want purely specular paths
         // to give radiance (cannot get it otherwise). Rest is handled
         // by merging and we should return 0.
-        if(mUseVM && !mUseVC)
+        if(kUseVM && !kUseVC)
             return aCameraState.mSpecularPath ? radiance : Vec3f(0);
 
         directPdfA   *= lightPickProb;
         emissionPdfW *= lightPickProb;
 
+        // Background is emitted through the scene disc, the camera vertex
+        // lies on the ray
+        emissionPdfW *= EmissionDensity(aLight,
+            aLight->IsFinite() ? aHitpoint : aCameraState.mOrigin, -aRayDirection);
+
         // Partial eye sub-path MIS weight [tech. rep. (43)].
         // If the last hit was specular, then dVCM == 0.
         const float wCamera = Mis(directPdfA) * aCameraState.dVCM +
@@ -686,6 +836,12 @@ private:
         if(radiance.IsZero())
             return Vec3f(0);
 
+        // Infinite lights are emitted through the scene disc,
+        // the hit point lies on the ray
+        emissionPdfW *= EmissionDensity(light,
+            light->IsFinite() ? aHitpoint + directionToLight * distance : aHitpoint,
+            -directionToLight);
+
         float bsdfDirPdfW, bsdfRevPdfW, cosToLight;
         const Vec3f bsdfFactor = aBsdf.Evaluate(mScene,
             directionToLight, cosToLight, &bsdfDirPdfW, &bsdfRevPdfW);
@@ -694,7 +850,10 @@ private:
             return Vec3f(0);
 
         const float continuationProbability = aBsdf.ContinuationProb();
-        
+
+        // Camera sub-path may be guided
+        bsdfDirPdfW = GuidedPdf(aBsdf, aHitpoint, directionToLight, bsdfDirPdfW);
+
         // If the light is delta light, we can never hit it
         // by BSDF sampling, so the probability of this path is 0
         bsdfDirPdfW *= light->IsDelta() ? 0.f : continuationProbability;
@@ -762,6 +921,10 @@ private:
         if(cameraBsdfFactor.IsZero())
             return Vec3f(0);
 
+        // Camera sub-path may be guided
+        cameraBsdfDirPdfW = GuidedPdf(aCameraBsdf, aCameraHitpoint, direction,
+            cameraBsdfDirPdfW);
+
         // Camera continuation probability (for Russian roulette)
         const float cameraCont = aCameraBsdf.ContinuationProb();
         cameraBsdfDirPdfW *= cameraCont;
@@ -776,6 +939,10 @@ private:
         if(lightBsdfFactor.IsZero())
             return Vec3f(0);
 
+        // Reverse pdf at light vertex is of the (guided) camera sub-path
+        lightBsdfRevPdfW = GuidedPdf(aLightVertex.mBsdf, aLightVertex.mHitpoint,
+            aLightVertex.mBsdf.WorldDirFix(), lightBsdfRevPdfW);
+
         // Light continuation probability (for Russian roulette)
         const float lightCont = aLightVertex.mBsdf.ContinuationProb();
         lightBsdfDirPdfW *= lightCont;
@@ -792,7 +959,8 @@ private:
 
         // Partial light sub-path MIS weight [tech. rep. (40)]
         const float wLight = Mis(cameraBsdfDirPdfA) * (
-            mMisVmWeightFactor + aLightVertex.dVCM + aLightVertex.dVC * Mis(lightBsdfRevPdfW));
+            mMisVmWeightFactor + aLightVertex.dVCM +
+            LightDVC(aLightVertex, mMisVmWeightFactor) * Mis(lightBsdfRevPdfW));
 
         // Partial eye sub-path MIS weight [tech. rep. (41)]
         const float wCamera = Mis(lightBsdfDirPdfA) * (
@@ -813,25 +981,35 @@ private:
     // Light tracing methods
     //////////////////////////////////////////////////////////////////////////
 
-    // Samples light emission
-    void GenerateLightSample(SubPathState &oLightState)
+    // Samples light emission of the given light sub-path
+    void GenerateLightSample(
+        const int    aPathIdx,
+        SubPathState &oLightState)
     {
         // We sample lights uniformly
         const int   lightCount    = mScene.GetLightCount();
         const float lightPickProb = 1.f / lightCount;
 
         const int   lightID       = int(mRng.GetFloat() * lightCount);
-        const Vec2f rndDirSamples = mRng.GetVec2f();
-        const Vec2f rndPosSamples = mRng.GetVec2f();
+        Vec2f       rndDirSamples = mRng.GetVec2f();
+        Vec2f       rndPosSamples = mRng.GetVec2f();
 
         const AbstractLight *light = mScene.GetLightPtr(lightID);
 
+        // Adaptive emission warps the random numbers
+        float emissionDensity = 1.f;
+        if(mEmissionGuide.IsEnabled())
+        {
+            emissionDensity = mEmissionGuide.Sample(lightID, light->EmissionSampleMask(),
+                rndDirSamples, rndPosSamples, mEmissionCells[aPathIdx]);
+        }
+
         float emissionPdfW, directPdfW, cosLight;
         oLightState.mThroughput = light->Emit(mScene.mSceneSphere, rndDirSamples, rndPosSamples,
             oLightState.mOrigin, oLightState.mDirection,
             emissionPdfW, &directPdfW, &cosLight);
 
-        emissionPdfW *= lightPickProb;
+        emissionPdfW *= lightPickProb * emissionDensity;
         directPdfW   *= lightPickProb;
 
         oLightState.mThroughput    /= emissionPdfW;
@@ -855,12 +1033,14 @@ private:
             }
 
             oLightState.dVM = oLightState.dVC * mMisVcWeightFactor;
+            oLightState.dVCEta = 0.f;
         }
     }
 
     // Computes contribution of light sample to camera by splatting is onto the
     // framebuffer. Multiplies by throughput (obviously, as nothing is returned).
     void ConnectToCamera(
+        const int          aPathIdx,
         const SubPathState &aLightState,
         const Vec3f        &aHitpoint,
         const LightBSDF    &aBsdf)
@@ -872,9 +1052,10 @@ private:
         if(Dot(camera.mForward, -directionToCamera) <= 0.f)
             return;
 
-        // Check it projects to the screen (and where)
+        // Check it projects to the screen (and where). Splats outside
+        // the crop window are not rendered, so skip them early
         const Vec2f imagePos = camera.WorldToRaster(aHitpoint);
-        if(!camera.CheckRaster(imagePos))
+        if(!camera.CheckRaster(imagePos) || !camera.CheckCrop(imagePos))
             return;
 
         // Compute distance and normalize direction to camera
@@ -890,13 +1071,22 @@ private:
         if(bsdfFactor.IsZero())
             return;
 
+        // Reverse pdf is of the (guided) camera sub-path
+        bsdfRevPdfW  = GuidedPdf(aBsdf, aHitpoint, aBsdf.WorldDirFix(), bsdfRevPdfW);
         bsdfRevPdfW *= aBsdf.ContinuationProb();
 
         // Compute pdf conversion factor from image plane area to surface area
         const float cosAtCamera = Dot(camera.mForward, -directionToCamera);
         const float imagePointToCameraDist = camera.mImagePlaneDist / cosAtCamera;
         const float imageToSolidAngleFactor = Sqr(imagePointToCameraDist) / cosAtCamera;
-        const float imageToSurfaceFactor = imageToSolidAngleFactor * std::abs(cosToCamera) / Sqr(distance);
+        // In preview iterations camera samples are spread over pixel blocks,
+        // so the image plane sampling pdf is 1 / block area (see below)
+        Vec2i blockMin, blockSize;
+        camera.CropRasterToBlock(imagePos, mBlockSize, blockMin, blockSize);
+        const float blockArea = float(blockSize.x * blockSize.y);
+
+        const float imageToSurfaceFactor =
+            imageToSolidAngleFactor * std::abs(cosToCamera) / (Sqr(distance) * blockArea);
 
         // We put the virtual image plane at such a distance from the camera origin
         // that the pixel area is one and thus the image plane sampling pdf is 1.
@@ -904,16 +1094,23 @@ private:
         // the conversion factor from image plane area density to surface area density
         const float cameraPdfA = imageToSurfaceFactor;
 
+        // With per-pixel radius the path is weighted as if sampled from the pixel
+        const float misVmWeightFactor = UsePixelRadius() ?
+            MisVmWeightFactor(mPixelStats[GetPixelIndex(imagePos)].mRadius) :
+            mMisVmWeightFactor;
+
         // Partial light sub-path weight [tech. rep. (46)]. Note the division by
         // mLightPathCount, which is the number of samples this technique uses.
         // This division also appears a few lines below in the framebuffer accumulation.
-        const float wLight = Mis(cameraPdfA / mLightSubPathCount) * (
-            mMisVmWeightFactor + aLightState.dVCM + aLightState.dVC * Mis(bsdfRevPdfW));
+        // Camera techniques use mCameraPathsPerPixel samples per pixel.
+        const float wLight = Mis(cameraPdfA * mCameraPathsPerPixel / mLightSubPathCount) * (
+            misVmWeightFactor + aLightState.dVCM +
+            LightDVC(aLightState, misVmWeightFactor) * Mis(bsdfRevPdfW));
 
         // Partial eye sub-path weight is 0 [tech. rep. (47)]
 
         // Full path MIS weight [tech. rep. (37)]. No MIS for traditional light tracing.
-        const float misWeight = mLightTraceOnly ? 1.f : (1.f / (wLight + 1.f));
+        const float misWeight = kLightTraceOnly ? 1.f : (1.f / (wLight + 1.f));
 
         const float surfaceToImageFactor = 1.f / imageToSurfaceFactor;
 
@@ -929,12 +1126,226 @@ private:
             if(mScene.Occluded(aHitpoint, directionToCamera, distance))
                 return;
 
-            mFramebuffer.AddColor(imagePos, contrib);
+            AddSampleColor(blockMin, blockSize, imagePos, contrib);
+            AddTechniqueColors(imagePos, Vec3f(0), contrib, Vec3f(0));
+            AddEmissionContrib(aPathIdx, contrib);
         }
     }
 
-    // Samples a scattering direction camera/light sample according to BSDF.
-    // Returns false for termination
+    //////////////////////////////////////////////////////////////////////////
+    // Per-pixel radius methods
+    //////////////////////////////////////////////////////////////////////////
+
+    // MIS weight constant [tech. rep. (20)], with n_VC = 1 and n_VM = mLightPathCount
+    float MisVmWeightFactor(const float aRadius) const
+    {
+        const float etaVCM = (PI_F * Sqr(aRadius)) * mLightSubPathCount;
+        return kUseVM ? Mis(etaVCM) : 0.f;
+    }
+
+    // Sets up merging (and MIS weights depending on it) for given radius
+    void SetupMergingRadius(const float aRadius)
+    {
+        const float radiusSqr = Sqr(aRadius);
+        mRadiusSqr = radiusSqr;
+
+        // Factor used to normalise vertex merging contribution.
+        // We divide the summed up energy by disk radius and number of light paths
+        mVmNormalization = 1.f / (radiusSqr * PI_F * mLightSubPathCount);
+
+        // MIS weight constant [tech. rep. (20)], with n_VC = 1 and n_VM = mLightPathCount
+        const float etaVCM = (PI_F * radiusSqr) * mLightSubPathCount;
+        mMisVmWeightFactor = kUseVM ? Mis(etaVCM)       : 0.f;
+        mMisVcWeightFactor = kUseVC ? Mis(1.f / etaVCM) : 0.f;
+    }
+
+    // Light sub-paths are traced with the radius of the iteration, before
+    // the pixel is known. Their dVC is linear in the weight of vertex merging,
+    // so dVCEta (its factor) gives dVC for the radius of any pixel
+    template<typename tLightState>
+    float LightDVC(
+        const tLightState &aLightState,
+        const float       aMisVmWeightFactor) const
+    {
+        if(aMisVmWeightFactor == mLightMisVmWeightFactor)
+            return aLightState.dVC;
+
+        return aLightState.dVC +
+            (aMisVmWeightFactor - mLightMisVmWeightFactor) * aLightState.dVCEta;
+    }
+
+    // As LightDVC(), for the current merging radius. With vertex connection
+    // dVM = dVC * mMisVcWeightFactor, otherwise dVM does not depend on radius
+    float LightDVM(const LightVertex &aLightVertex) const
+    {
+        if(!kUseVC || mMisVmWeightFactor == mLightMisVmWeightFactor)
+            return aLightVertex.dVM;
+
+        return LightDVC(aLightVertex, mMisVmWeightFactor) * mMisVcWeightFactor;
+    }
+
+    // Preview iterations keep one radius, their camera samples span many pixels
+    bool UsePixelRadius() const
+    {
+        return !mPixelStats.empty() && mBlockSize == 1;
+    }
+
+    int GetPixelIndex(const Vec2f &aImagePos) const
+    {
+        return int(aImagePos.x) + int(aImagePos.y) * int(mScene.mCamera.mResolution.x);
+    }
+
+    // Largest radius within the crop window
+    float MaxPixelRadius() const
+    {
+        const Camera &camera = mScene.mCamera;
+        const int    resX    = int(camera.mResolution.x);
+
+        float maxRadius = 0;
+        for(int y = camera.mCropMin.y; y < camera.mCropMax.y; y++)
+            for(int x = camera.mCropMin.x; x < camera.mCropMax.x; x++)
+                maxRadius = std::max(maxRadius, mPixelStats[x + y * resX].mRadius);
+
+        return maxRadius;
+    }
+
+    // Stochastic progressive photon mapping update [Hachisuka and Jensen 2009]:
+    // only fraction alpha of the found light vertices is kept in the count, and
+    // the radius shrinks so the density stays the same
+    void UpdatePixelRadius(
+        PixelStats  &aoStats,
+        const int   aFoundCount) const
+    {
+        const float newCount = aoStats.mCount + mRadiusAlpha * aFoundCount;
+
+        aoStats.mRadius *= std::sqrt(newCount / (aoStats.mCount + aFoundCount));
+        aoStats.mRadius  = std::max(aoStats.mRadius, 1e-7f);
+        aoStats.mCount   = newCount;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Deferred merging methods
+    //////////////////////////////////////////////////////////////////////////
+
+    // Path guide credits merges to the path vertices while tracing, so it
+    // has to merge right away while learning
+    bool DeferMerging() const
+    {
+        return mDeferMerging && !mGuide.IsLearning();
+    }
+
+    void QueueMerge(
+        const Vec3f        &aHitPoint,
+        const CameraBSDF   &aBsdf,
+        const SubPathState &aCameraState,
+        const Vec2f        &aScreenSample,
+        const Vec2i        &aBlockMin,
+        const Vec2i        &aBlockSize,
+        const PixelStats   *aPixelStats,
+        const bool         aFirstMerge)
+    {
+        MergeQuery merge;
+        merge.mHitPoint     = aHitPoint;
+        merge.mBsdf         = aBsdf;
+        merge.mState        = aCameraState;
+        merge.mScreenSample = aScreenSample;
+        merge.mBlockMin     = aBlockMin;
+        merge.mBlockSize    = aBlockSize;
+        merge.mRadius       = aPixelStats ? aPixelStats->mRadius : 0.f;
+        merge.mPixelIdx     = aPixelStats ? GetPixelIndex(aScreenSample) : -1;
+        merge.mUpdatesPixel = aPixelStats && aFirstMerge;
+        mMergeQueries.push_back(merge);
+    }
+
+    // Runs queued merges in Morton order of their grid cells, so consecutive
+    // queries read the same or nearby light vertices, and splats the
+    // contributions to their pixels
+    void ProcessMergeQueries(const float aCameraPathWeight)
+    {
+        mMergeOrder.resize(mMergeQueries.size());
+        for(size_t i=0; i<mMergeQueries.size(); i++)
+        {
+            mMergeOrder[i].first  = mHashGrid.GetMortonKey(mMergeQueries[i].mHitPoint);
+            mMergeOrder[i].second = int(i);
+        }
+
+        std::sort(mMergeOrder.begin(), mMergeOrder.end());
+
+        for(size_t i=0; i<mMergeOrder.size(); i++)
+        {
+            const MergeQuery &merge = mMergeQueries[mMergeOrder[i].second];
+
+            if(merge.mPixelIdx >= 0)
+                SetupMergingRadius(merge.mRadius);
+
+            RangeQuery query(*this, merge.mHitPoint, merge.mBsdf, merge.mState);
+            mHashGrid.Process(mLightVertices, query, mRadiusSqr);
+
+            SplatMerge(merge, query, aCameraPathWeight);
+        }
+
+        mMergeQueries.clear();
+    }
+
+    void SplatMerge(
+        const MergeQuery &aMerge,
+        const RangeQuery &aQuery,
+        const float      aCameraPathWeight)
+    {
+        const Vec3f contrib = aMerge.mState.mThroughput * mVmNormalization *
+            aQuery.GetContrib() * aCameraPathWeight;
+        AddSampleColor(aMerge.mBlockMin, aMerge.mBlockSize, aMerge.mScreenSample, contrib);
+        AddTechniqueColors(aMerge.mScreenSample, Vec3f(0), Vec3f(0), contrib);
+
+        if(aMerge.mUpdatesPixel && aQuery.GetCount() > 0)
+            UpdatePixelRadius(mPixelStats[aMerge.mPixelIdx], aQuery.GetCount());
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Adaptive emission methods
+    //////////////////////////////////////////////////////////////////////////
+
+    // Density of adaptive emission, which multiplies emission pdf of
+    // particle leaving aLight from aPosition in aDirection
+    float EmissionDensity(
+        const AbstractLight *aLight,
+        const Vec3f         &aPosition,
+        const Vec3f         &aDirection) const
+    {
+        if(!mEmissionGuide.IsEnabled())
+            return 1.f;
+
+        int lightID = 0;
+        while(mScene.GetLightPtr(lightID) != aLight)
+            lightID++;
+
+        Vec2f rndDirSamples(0), rndPosSamples(0);
+        aLight->EmissionSamples(mScene.mSceneSphere, aPosition, aDirection,
+            rndDirSamples, rndPosSamples);
+
+        return mEmissionGuide.Pdf(lightID, aLight->EmissionSampleMask(),
+            rndDirSamples, rndPosSamples);
+    }
+
+    // Light sub-path of a stored light vertex
+    int GetLightPathIdx(const LightVertex &aLightVertex) const
+    {
+        const int vertexIdx = int(&aLightVertex - &mLightVertices[0]);
+        return int(std::upper_bound(mPathEnds.begin(), mPathEnds.end(), vertexIdx) -
+            mPathEnds.begin());
+    }
+
+    // Credits emission of the light sub-path with its contribution to the image
+    void AddEmissionContrib(
+        const int   aPathIdx,
+        const Vec3f &aContrib)
+    {
+        if(mEmissionGuide.IsEnabled())
+            mEmissionGuide.AddContrib(mEmissionCells[aPathIdx], Luminance(aContrib));
+    }
+
+    // Samples a scattering direction camera/light sample according to BSDF,
+    // camera samples also according to the path guide. Returns false for termination
     template<bool tLightSample>
     bool SampleScattering(
         const BSDF<tLightSample> &aBsdf,
@@ -946,8 +1357,11 @@ private:
         float bsdfDirPdfW, cosThetaOut;
         uint  sampledEvent;
 
-        Vec3f bsdfFactor = aBsdf.Sample(mScene, rndTriplet, aoState.mDirection,
-            bsdfDirPdfW, cosThetaOut, &sampledEvent);
+        Vec3f bsdfFactor = tLightSample ?
+            aBsdf.Sample(mScene, rndTriplet, aoState.mDirection,
+                bsdfDirPdfW, cosThetaOut, &sampledEvent) :
+            GuidedSample(aBsdf, aHitPoint, rndTriplet, aoState.mDirection,
+                bsdfDirPdfW, cosThetaOut, &sampledEvent);
 
         if(bsdfFactor.IsZero())
             return false;
@@ -955,11 +1369,20 @@ private:
         // If we sampled specular event, then the reverse probability
         // cannot be evaluated, but we know it is exactly the same as
         // forward probability, so just set it. If non-specular event happened,
-        // we evaluate the pdf
+        // we evaluate the pdf. Reverse of light sample is camera sample,
+        // which may be guided
         float bsdfRevPdfW = bsdfDirPdfW;
         if((sampledEvent & LightBSDF::kSpecular) == 0)
+        {
             bsdfRevPdfW = aBsdf.Pdf(mScene, aoState.mDirection, true);
 
+            if(tLightSample)
+                bsdfRevPdfW = GuidedPdf(aBsdf, aHitPoint, aBsdf.WorldDirFix(),
+                    bsdfRevPdfW);
+        }
+
+        const float sampledPdfW = bsdfDirPdfW;
+
         // Russian roulette
         const float contProb = aBsdf.ContinuationProb();
         if(mRng.GetFloat() > contProb)
@@ -981,6 +1404,7 @@ private:
             assert(bsdfDirPdfW == bsdfRevPdfW);
             aoState.dVC *= Mis(cosThetaOut);
             aoState.dVM *= Mis(cosThetaOut);
+            aoState.dVCEta *= Mis(cosThetaOut);
 
             aoState.mSpecularPath &= 1;
         }
@@ -995,6 +1419,9 @@ private:
                 aoState.dVM * Mis(bsdfRevPdfW) +
                 aoState.dVCM * mMisVcWeightFactor + 1.f);
 
+            aoState.dVCEta = Mis(cosThetaOut / bsdfDirPdfW) * (
+                aoState.dVCEta * Mis(bsdfRevPdfW) + 1.f);
+
             aoState.dVCM = Mis(1.f / bsdfDirPdfW);
 
             aoState.mSpecularPath &= 0;
@@ -1002,16 +1429,18 @@ private:
 
         aoState.mOrigin  = aHitPoint;
         aoState.mThroughput *= bsdfFactor * (cosThetaOut / bsdfDirPdfW);
+
+        // Guide learns incident radiance at camera vertices it can guide
+        if(!tLightSample && !aBsdf.IsDelta() && !aBsdf.HasSpecular())
+            mGuide.AddPathVertex(aHitPoint, aoState.mDirection,
+                aoState.mThroughput, sampledPdfW);
         
         return true;
     }
 
 private:
 
-    bool  mUseVM;             // Vertex merging (of some form) is used
-    bool  mUseVC;             // Vertex connection (BPT) is used
-    bool  mLightTraceOnly;    // Do only light tracing
-    bool  mPpm;               // Do PPM, same terminates camera after first merge
+    int   mCameraPathsPerPixel; // Camera paths traced per pixel in one iteration
 
     float mRadiusAlpha;       // Radius reduction rate parameter
     float mBaseRadius;        // Initial merging radius
@@ -1020,6 +1449,8 @@ private:
     float mScreenPixelCount;  // Number of pixels
     float mLightSubPathCount; // Number of light sub-paths
     float mVmNormalization;   // 1 / (Pi * radius^2 * light_path_count)
+    float mRadiusSqr;         // Merging radius squared
+    float mLightMisVmWeightFactor; // mMisVmWeightFactor used by light sub-paths
 
     std::vector<LightVertex> mLightVertices; //!< Stored light vertices
 
@@ -1028,6 +1459,15 @@ private:
     std::vector<int> mPathEnds;
     HashGrid         mHashGrid;
 
+    std::vector<PixelStats> mPixelStats; //!< Per-pixel radius, empty ~ one for all
+
+    bool                    mDeferMerging; //!< Merges are queued, see ProcessMergeQueries()
+    std::vector<MergeQuery> mMergeQueries;
+    std::vector<std::pair<uint, int> > mMergeOrder; //!< Morton key and index of queued merges
+
+    EmissionGuide    mEmissionGuide;
+    std::vector<EmissionGuide::Cells> mEmissionCells; //!< Of light paths, for adaptive emission
+
     Rng              mRng;
 };
 
@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __WAVEFRONT_HXX__
+#define __WAVEFRONT_HXX__
+
+#include <vector>
+#include <cmath>
+#include "pathtracer.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Wavefront variant of PathTracer. Instead of tracing one path at a time
+// to completion, it keeps a pool of in-flight paths and advances all of
+// them one bounce at a time, running each stage as a kernel over a queue:
+//
+//   Extend  - intersects rays of all active paths as one batch (see
+//             AbstractGeometry::IntersectBatch), misses see background
+//   Shade   - paths sorted by material: emission, light sampling, and
+//             the shadow ray, paths that stop go to accumulate
+//   Shadow  - tests all shadow rays as one batch, adds unoccluded
+//             contributions
+//   Scatter - same material order: samples the next direction and
+//             Russian roulette, survivors return to extend
+//   Accumulate - splats colors of finished paths, freeing their slots
+//
+// Freed slots are refilled with new camera paths before each extend.
+// The estimator is the same as of PathTracer, whose MIS weights and
+// random numbers it uses, they are just consumed in a different order.
+class WavefrontPathTracer : public PathTracer
+{
+    // State of one in-flight camera path
+    struct PathState
+    {
+        Ray         mRay;
+        Isect       mIsect;
+        BSDF<false> mBsdf;
+        Vec3f       mHitPoint;
+        Vec3f       mWeight;       //!< Path throughput
+        Vec3f       mColor;        //!< Gathered so far
+        Vec2f       mSample;       //!< Raster position
+        Vec2i       mBlockMin;     //!< Pixel block of the sample
+        Vec2i       mBlockSize;
+        uint        mPathLength;
+        bool        mLastSpecular;
+        float       mLastPdfW;
+        float       mDistance;     //!< Length of the path, for features
+        bool        mNeedFeatures; //!< Features not recorded yet
+        PathGuide::PathVertices mGuideVertices;
+    };
+
+    // Shadow ray of next event estimation
+    struct ShadowRay
+    {
+        int   mPathIdx;
+        Vec3f mOrg;
+        Vec3f mDir;
+        float mDist;
+        Vec3f mContrib; //!< Already multiplied by path throughput
+    };
+
+public:
+
+    WavefrontPathTracer(
+        const Scene& aScene,
+        int aSeed = 1234
+    ) :
+        PathTracer(aScene, aSeed)
+    {
+        mPoolSize = 1 << 12;
+    }
+
+    virtual void RunIteration(int /*aIteration*/)
+    {
+        // Only pixels within the crop window are traced,
+        // in preview iterations one path per block of pixels
+        const int pixelCount = mScene.mCamera.CropBlockCount(mBlockSize);
+        int       nextPixel  = 0;
+
+        const int poolSize = std::min(mPoolSize, pixelCount);
+        mPaths.resize(poolSize);
+        mFreeSlots.clear();
+        for(int i = poolSize - 1; i >= 0; i--)
+            mFreeSlots.push_back(i);
+
+        mExtendQueue.clear();
+
+        for(;;)
+        {
+            while(nextPixel < pixelCount && !mFreeSlots.empty())
+            {
+                const int pathIdx = mFreeSlots.back();
+                mFreeSlots.pop_back();
+                GeneratePath(pathIdx, nextPixel++);
+                mExtendQueue.push_back(pathIdx);
+            }
+
+            if(mExtendQueue.empty())
+                break;
+
+            Extend();
+            Shade();
+            Shadow();
+            Scatter();
+            Accumulate();
+        }
+
+        mIterations++;
+        mGuide.EndIteration();
+    }
+
+private:
+
+    //////////////////////////////////////////////////////////////////////////
+    // Stage kernels
+
+    void GeneratePath(const int aPathIdx, const int aPixelIdx)
+    {
+        PathState &path = mPaths[aPathIdx];
+
+        mScene.mCamera.CropIndexToBlock(aPixelIdx, mBlockSize,
+            path.mBlockMin, path.mBlockSize);
+
+        path.mSample = Vec2f(float(path.mBlockMin.x), float(path.mBlockMin.y)) +
+            Vec2f(float(path.mBlockSize.x), float(path.mBlockSize.y)) * mRng.GetVec2f();
+
+        path.mRay          = mScene.mCamera.GenerateRay(path.mSample);
+        path.mIsect.dist   = 1e36f;
+        path.mWeight       = Vec3f(1.f);
+        path.mColor        = Vec3f(0.f);
+        path.mPathLength   = 1;
+        path.mLastSpecular = true;
+        path.mLastPdfW     = 1;
+        path.mDistance     = 0;
+        path.mNeedFeatures = true;
+        path.mGuideVertices.clear();
+    }
+
+    // Intersects all active paths, only hits go on to shading
+    void Extend()
+    {
+        mShadeQueue.clear();
+
+        const int count = (int)mExtendQueue.size();
+        mRays.resize(count);
+        mIsects.resize(count);
+        mHits.resize(count);
+
+        for(int i = 0; i < count; i++)
+        {
+            mRays[i]   = mPaths[mExtendQueue[i]].mRay;
+            mIsects[i] = mPaths[mExtendQueue[i]].mIsect;
+        }
+
+        if(count > 0)
+            mScene.IntersectBatch(&mRays[0], &mIsects[0], &mHits[0], count);
+
+        for(int i = 0; i < count; i++)
+        {
+            const int pathIdx = mExtendQueue[i];
+            PathState &path = mPaths[pathIdx];
+            path.mIsect = mIsects[i];
+
+            if(mHits[i])
+            {
+                mShadeQueue.push_back(pathIdx);
+                continue;
+            }
+
+            mFinishQueue.push_back(pathIdx);
+
+            if(path.mPathLength < mMinPathLength)
+                continue;
+
+            const BackgroundLight* background = mScene.GetBackground();
+            if(!background)
+                continue;
+            // For background we cheat with the A/W suffixes,
+            // and GetRadiance actually returns W instead of A
+            float directPdfW;
+            Vec3f contrib = background->GetRadiance(mScene.mSceneSphere,
+                path.mRay.dir, Vec3f(0), &directPdfW);
+            if(contrib.IsZero())
+                continue;
+
+            float misWeight = 1.f;
+            if(path.mPathLength > 1 && !path.mLastSpecular)
+            {
+                misWeight = Mis2(path.mLastPdfW, directPdfW * LightPickProb());
+            }
+
+            AddContrib(path, path.mWeight * misWeight * contrib);
+        }
+    }
+
+    // Shades hits in material order. Paths that continue get their shadow
+    // ray queued, and go on to Scatter() in the same order.
+    void Shade()
+    {
+        SortByMaterial(mShadeQueue, mSortedQueue);
+
+        const int lightCount = mScene.GetLightCount();
+
+        mShadowQueue.clear();
+        mScatterQueue.clear();
+
+        for(size_t i = 0; i < mSortedQueue.size(); i++)
+        {
+            const int pathIdx = mSortedQueue[i];
+            PathState &path  = mPaths[pathIdx];
+            Isect     &isect = path.mIsect;
+
+            path.mHitPoint = path.mRay.org + path.mRay.dir * isect.dist;
+            isect.dist += EPS_RAY;
+
+            BSDF<false> &bsdf = path.mBsdf;
+            bsdf.Setup(path.mRay, isect, mScene);
+            if(!bsdf.IsValid())
+            {
+                mFinishQueue.push_back(pathIdx);
+                continue;
+            }
+
+            // Features (AOVs), from first non-specular surface or light
+            path.mDistance += isect.dist;
+            if(path.mNeedFeatures && (!bsdf.IsDelta() || isect.lightID >= 0))
+            {
+                AddFeatures(path.mSample, path.mRay, isect, path.mDistance);
+                path.mNeedFeatures = false;
+            }
+
+            // directly hit some light, lights do not reflect
+            if(isect.lightID >= 0)
+            {
+                mFinishQueue.push_back(pathIdx);
+
+                if(path.mPathLength < mMinPathLength)
+                    continue;
+
+                const AbstractLight *light = mScene.GetLightPtr(isect.lightID);
+                float directPdfA;
+                Vec3f contrib = light->GetRadiance(mScene.mSceneSphere,
+                    path.mRay.dir, path.mHitPoint, &directPdfA);
+                if(contrib.IsZero())
+                    continue;
+
+                float misWeight = 1.f;
+                if(path.mPathLength > 1 && !path.mLastSpecular)
+                {
+                    const float directPdfW = PdfAtoW(directPdfA, isect.dist,
+                        bsdf.CosThetaFix());
+                    misWeight = Mis2(path.mLastPdfW, directPdfW * LightPickProb());
+                }
+
+                AddContrib(path, path.mWeight * misWeight * contrib);
+                continue;
+            }
+
+            if(path.mPathLength >= mMaxPathLength || bsdf.ContinuationProb() == 0)
+            {
+                mFinishQueue.push_back(pathIdx);
+                continue;
+            }
+
+            mScatterQueue.push_back(pathIdx);
+
+            // next event estimation
+            if(bsdf.IsDelta() || path.mPathLength + 1 < mMinPathLength)
+                continue;
+
+            int lightID = int(mRng.GetFloat() * lightCount);
+            const AbstractLight *light = mScene.GetLightPtr(lightID);
+
+            Vec3f directionToLight;
+            float distance, directPdfW;
+            Vec3f radiance = light->Illuminate(mScene.mSceneSphere, path.mHitPoint,
+                mRng.GetVec2f(), directionToLight, distance, directPdfW);
+
+            if(radiance.IsZero())
+                continue;
+
+            float bsdfPdfW, cosThetaOut;
+            const Vec3f factor = bsdf.Evaluate(mScene,
+                directionToLight, cosThetaOut, &bsdfPdfW);
+
+            if(factor.IsZero())
+                continue;
+
+            float weight = 1.f;
+            if(!light->IsDelta())
+            {
+                bsdfPdfW = GuidedPdf(bsdf, path.mHitPoint, directionToLight, bsdfPdfW);
+                const float contProb = bsdf.ContinuationProb();
+                bsdfPdfW *= contProb;
+                weight = Mis2(directPdfW * LightPickProb(), bsdfPdfW);
+            }
+
+            ShadowRay shadowRay;
+            shadowRay.mPathIdx = pathIdx;
+            shadowRay.mOrg     = path.mHitPoint;
+            shadowRay.mDir     = directionToLight;
+            shadowRay.mDist    = distance;
+            shadowRay.mContrib = path.mWeight *
+                ((weight * cosThetaOut / (LightPickProb() * directPdfW)) *
+                (radiance * factor));
+            mShadowQueue.push_back(shadowRay);
+        }
+    }
+
+    // Has to run before Scatter(), so that the guide credits the light
+    // sample only to the vertices before the shaded one
+    void Shadow()
+    {
+        const int count = (int)mShadowQueue.size();
+        mRays.resize(count);
+        mIsects.resize(count);
+        mHits.resize(count);
+
+        for(int i = 0; i < count; i++)
+        {
+            const ShadowRay &shadowRay = mShadowQueue[i];
+            Scene::OcclusionRay(shadowRay.mOrg, shadowRay.mDir, shadowRay.mDist,
+                mRays[i], mIsects[i]);
+        }
+
+        if(count > 0)
+            mScene.OccludedBatch(&mRays[0], &mIsects[0], &mHits[0], count);
+
+        for(int i = 0; i < count; i++)
+        {
+            if(!mHits[i])
+                AddContrib(mPaths[mShadowQueue[i].mPathIdx], mShadowQueue[i].mContrib);
+        }
+    }
+
+    // Continues random walk of shaded paths
+    void Scatter()
+    {
+        mExtendQueue.clear();
+
+        for(size_t i = 0; i < mScatterQueue.size(); i++)
+        {
+            const int pathIdx = mScatterQueue[i];
+            PathState   &path = mPaths[pathIdx];
+            BSDF<false> &bsdf = path.mBsdf;
+
+            Vec3f rndTriplet = mRng.GetVec3f();
+            float pdf, cosThetaOut;
+            uint  sampledEvent;
+
+            Vec3f factor = GuidedSample(bsdf, path.mHitPoint, rndTriplet, path.mRay.dir,
+                pdf, cosThetaOut, &sampledEvent);
+
+            if(factor.IsZero())
+            {
+                mFinishQueue.push_back(pathIdx);
+                continue;
+            }
+
+            // Russian roulette
+            const float contProb = bsdf.ContinuationProb();
+
+            path.mLastSpecular = (sampledEvent & BSDF<true>::kSpecular) != 0;
+            path.mLastPdfW     = pdf * contProb;
+            const float dirPdfW = pdf;
+
+            if(contProb < 1.f)
+            {
+                if(mRng.GetFloat() > contProb)
+                {
+                    mFinishQueue.push_back(pathIdx);
+                    continue;
+                }
+                pdf *= contProb;
+            }
+
+            path.mWeight *= factor * (cosThetaOut / pdf);
+
+            // Guide learns incident radiance at vertices it can guide
+            if(!bsdf.IsDelta() && !bsdf.HasSpecular())
+                mGuide.AddPathVertex(path.mHitPoint, path.mRay.dir, path.mWeight,
+                    dirPdfW, path.mGuideVertices);
+
+            // We offset ray origin instead of setting tmin due to numeric
+            // issues in ray-sphere intersection. The isect.dist has to be
+            // extended by this EPS_RAY after hitpoint is determined
+            path.mRay.org    = path.mHitPoint + EPS_RAY * path.mRay.dir;
+            path.mRay.tmin   = 0.f;
+            path.mIsect.dist = 1e36f;
+            path.mPathLength++;
+
+            mExtendQueue.push_back(pathIdx);
+        }
+    }
+
+    // Splats finished paths and frees their slots
+    void Accumulate()
+    {
+        for(size_t i = 0; i < mFinishQueue.size(); i++)
+        {
+            const int pathIdx = mFinishQueue[i];
+            PathState &path = mPaths[pathIdx];
+
+            mGuide.EndPath(path.mGuideVertices);
+            AddSampleColor(path.mBlockMin, path.mBlockSize, path.mSample, path.mColor);
+            // Path tracing uses only camera paths hitting or sampling lights
+            AddTechniqueColors(path.mSample, path.mColor, Vec3f(0), Vec3f(0));
+
+            mFreeSlots.push_back(pathIdx);
+        }
+
+        mFinishQueue.clear();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Utilities
+
+    // Counting sort of path indices by material of their hit
+    void SortByMaterial(
+        const std::vector<int> &aQueue,
+        std::vector<int>       &oSorted)
+    {
+        mMaterialOffsets.assign(mScene.GetMaterialCount() + 1, 0);
+
+        for(size_t i = 0; i < aQueue.size(); i++)
+            mMaterialOffsets[mPaths[aQueue[i]].mIsect.matID + 1]++;
+
+        for(size_t m = 1; m < mMaterialOffsets.size(); m++)
+            mMaterialOffsets[m] += mMaterialOffsets[m - 1];
+
+        oSorted.resize(aQueue.size());
+        for(size_t i = 0; i < aQueue.size(); i++)
+            oSorted[mMaterialOffsets[mPaths[aQueue[i]].mIsect.matID]++] = aQueue[i];
+    }
+
+    void AddContrib(PathState &aoPath, const Vec3f &aContrib)
+    {
+        aoPath.mColor += aContrib;
+        mGuide.AddPathContrib(aContrib, aoPath.mGuideVertices);
+    }
+
+    // We sample lights uniformly
+    float LightPickProb() const
+    {
+        return 1.f / mScene.GetLightCount();
+    }
+
+private:
+
+    int mPoolSize; //!< Maximum number of in-flight paths
+
+    std::vector<PathState> mPaths;
+    std::vector<int>       mFreeSlots;    //!< Path slots available to new paths
+    std::vector<int>       mExtendQueue;  //!< Paths with a ray to intersect
+    std::vector<int>       mShadeQueue;   //!< Paths with a hit to shade
+    std::vector<int>       mSortedQueue;  //!< mShadeQueue sorted by material
+    std::vector<int>       mScatterQueue; //!< Shaded paths that continue
+    std::vector<int>       mFinishQueue;  //!< Terminated paths to accumulate
+    std::vector<int>       mMaterialOffsets;
+    std::vector<ShadowRay> mShadowQueue;
+
+    // Batch of the extend or shadow stage
+    std::vector<Ray>       mRays;
+    std::vector<Isect>     mIsects;
+    std::vector<int>       mHits;
+};
+
+#endif //__WAVEFRONT_HXX__
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+// Sweeps the approximations of fastmath.hxx against the standard library
+// in double, and the batch samplers of utils.hxx against the same mappings
+// in double, and checks the maximum errors against the bounds documented
+// there. Returns nonzero when any check fails. Run by "make test".
+
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "../src/utils.hxx"
+
+static int g_Failures = 0;
+
+static void Check(
+    const char   *aName,
+    const double aMaxError,
+    const double aBound)
+{
+    const bool ok = aMaxError <= aBound;
+    printf("%-44s max error %9.3g, bound %9.3g  %s\n",
+        aName, aMaxError, aBound, ok ? "ok" : "FAILED");
+
+    if(!ok)
+        g_Failures++;
+}
+
+// Relative error, absolute where the reference is below 1
+static double MixedError(const double aValue, const double aReference)
+{
+    return std::abs(aValue - aReference) / std::max(1.0, std::abs(aReference));
+}
+
+static double RelativeError(const double aValue, const double aReference)
+{
+    return std::abs(aValue - aReference) / std::abs(aReference);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Scalar approximations
+
+static void TestSinCos()
+{
+    const int kCount = 1 << 22;
+    std::vector<float> x(kCount), s(kCount), c(kCount);
+    double scalarError = 0, batchError = 0;
+
+    for(int i=0; i<kCount; i++)
+    {
+        x[i] = -64.f + 128.f * float(i) / float(kCount);
+
+        float sinX, cosX;
+        FastSinCos(x[i], sinX, cosX);
+        scalarError = std::max(scalarError, std::abs(sinX - std::sin(double(x[i]))));
+        scalarError = std::max(scalarError, std::abs(cosX - std::cos(double(x[i]))));
+    }
+
+    FastSinCos(&x[0], &s[0], &c[0], kCount);
+    for(int i=0; i<kCount; i++)
+    {
+        batchError = std::max(batchError, std::abs(s[i] - std::sin(double(x[i]))));
+        batchError = std::max(batchError, std::abs(c[i] - std::cos(double(x[i]))));
+    }
+
+    Check("FastSinCos, |x| < 64 (absolute)", scalarError, 8e-8);
+    Check("FastSinCos batch, |x| < 64 (absolute)", batchError, 8e-8);
+}
+
+// All positive normal floats, through their bit patterns
+static void TestLog2()
+{
+    double error = 0, logError = 0;
+
+    for(unsigned bits = 0x00800000u; bits < 0x7f800000u; bits += 61)
+    {
+        float x;
+        memcpy(&x, &bits, sizeof(x));
+
+        error    = std::max(error, MixedError(FastLog2(x), std::log2(double(x))));
+        logError = std::max(logError, MixedError(FastLog(x), std::log(double(x))));
+    }
+
+    Check("FastLog2, normal x (abs. |r| <= 1, rel.)", error, 1.4e-7);
+    Check("FastLog, normal x (abs. |r| <= 1, rel.)", logError, 1.5e-7);
+    Check("FastLog2(0) is -126", std::abs(FastLog2(0.f) + 126.f), 0.0);
+}
+
+static void TestExp2()
+{
+    const int kCount = 1 << 22;
+    double error = 0, expError = 0, clampError = 0;
+
+    for(int i=0; i<=kCount; i++)
+    {
+        const float x = -126.f + (127.49f + 126.f) * float(i) / float(kCount);
+        error = std::max(error, RelativeError(FastExp2(x), std::exp2(double(x))));
+
+        const float y = -87.f + 175.f * float(i) / float(kCount);
+        expError = std::max(expError, RelativeError(FastExp(y), std::exp(double(y))));
+    }
+
+    // Beyond the range results stay finite, or flush to zero below
+    for(int i=0; i<=kCount; i++)
+    {
+        const float x = 127.49f + 1000.f * float(i) / float(kCount);
+        const float y = -127.f  - 1000.f * float(i) / float(kCount);
+
+        if(!(FastExp2(x) <= 2.4e38f) || FastExp2(x) < 2.3e38f || FastExp2(y) != 0.f)
+            clampError = 1;
+    }
+
+    Check("FastExp2, -126 <= x <= 127.49 (relative)", error, 1e-7);
+    Check("FastExp, -87 <= x <= 88 (relative)", expError, 1.1e-7);
+    Check("FastExp2 clamped outside", clampError, 0.0);
+}
+
+// Where |y log2(x)| < 8, x in (0, 4], y in (0, 64]
+static void TestPow()
+{
+    const int kCountX = 2048;
+    const int kCountY = 2048;
+    std::vector<float> x(kCountX), pow(kCountX);
+    double scalarError = 0, batchError = 0;
+
+    for(int i=0; i<kCountX; i++)
+        x[i] = 4.f * float(i + 1) / float(kCountX);
+
+    for(int j=0; j<kCountY; j++)
+    {
+        const float y = 64.f * float(j + 1) / float(kCountY);
+        FastPow(&x[0], y, &pow[0], kCountX);
+
+        for(int i=0; i<kCountX; i++)
+        {
+            if(std::abs(y * std::log2(double(x[i]))) >= 8.0)
+                continue;
+
+            const double reference = std::pow(double(x[i]), double(y));
+            scalarError = std::max(scalarError, RelativeError(FastPow(x[i], y), reference));
+            batchError  = std::max(batchError,  RelativeError(pow[i], reference));
+        }
+    }
+
+    Check("FastPow, |y log2 x| < 8 (relative)", scalarError, 1.5e-6);
+    Check("FastPow batch, |y log2 x| < 8 (relative)", batchError, 1.5e-6);
+    Check("FastPow(0, y) is 0", std::abs(FastPow(0.f, 2.f)), 0.0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Batch samplers against the same mappings in double
+
+static const double kPi = 3.14159265358979323846;
+
+// Random numbers over a grid of [0, 1)^2
+static void GetSamples(
+    std::vector<float> &oSamplesX,
+    std::vector<float> &oSamplesY)
+{
+    const int kRes = 1024;
+    oSamplesX.resize(kRes * kRes);
+    oSamplesY.resize(kRes * kRes);
+
+    for(int i=0; i<kRes * kRes; i++)
+    {
+        oSamplesX[i] = float(i % kRes) / float(kRes);
+        oSamplesY[i] = float(i / kRes) / float(kRes);
+    }
+}
+
+// Distance of the direction from the one at azimuth 2 PI aSampleX with
+// the given cosine to the z axis
+static double DirError(
+    const float  aDirX,
+    const float  aDirY,
+    const float  aDirZ,
+    const float  aSampleX,
+    const double aCosTheta)
+{
+    const double phi      = 2.0 * kPi * aSampleX;
+    const double sinTheta = std::sqrt(std::max(0.0, 1.0 - aCosTheta * aCosTheta));
+
+    return std::sqrt(Sqr(aDirX - std::cos(phi) * sinTheta) +
+        Sqr(aDirY - std::sin(phi) * sinTheta) + Sqr(aDirZ - aCosTheta));
+}
+
+static void TestHemisphereSamplers()
+{
+    std::vector<float> u, v;
+    GetSamples(u, v);
+
+    const int count = (int)u.size();
+    std::vector<float> x(count), y(count), z(count), pdf(count);
+
+    double dirError = 0, pdfError = 0;
+    SampleCosHemisphereW(&u[0], &v[0], count, &x[0], &y[0], &z[0], &pdf[0]);
+    for(int i=0; i<count; i++)
+    {
+        const double cosTheta = std::sqrt(double(v[i]));
+        dirError = std::max(dirError, DirError(x[i], y[i], z[i], u[i], cosTheta));
+        pdfError = std::max(pdfError, MixedError(pdf[i], cosTheta / kPi));
+    }
+    Check("SampleCosHemisphereW batch, direction", dirError, 1e-6);
+    Check("SampleCosHemisphereW batch, pdf", pdfError, 1e-6);
+
+    const float powers[] = {1.f, 10.f, 100.f, 1000.f};
+    dirError = pdfError = 0;
+    for(int p=0; p<4; p++)
+    {
+        const double n = powers[p];
+
+        SamplePowerCosHemisphereW(&u[0], &v[0], powers[p], count,
+            &x[0], &y[0], &z[0], &pdf[0]);
+        for(int i=0; i<count; i++)
+        {
+            const double cosTheta = std::pow(double(v[i]), 1.0 / (n + 1.0));
+            const double pdfW = (n + 1.0) * std::pow(double(v[i]), n / (n + 1.0)) * 0.5 / kPi;
+
+            dirError = std::max(dirError, DirError(x[i], y[i], z[i], u[i], cosTheta));
+            if(pdfW > 0.0)
+                pdfError = std::max(pdfError, RelativeError(pdf[i], pdfW));
+        }
+    }
+    Check("SamplePowerCosHemisphereW batch, direction", dirError, 2e-5);
+    Check("SamplePowerCosHemisphereW batch, pdf (rel.)", pdfError, 2e-6);
+
+    dirError = pdfError = 0;
+    SampleUniformSphereW(&u[0], &v[0], count, &x[0], &y[0], &z[0], &pdf[0]);
+    for(int i=0; i<count; i++)
+    {
+        dirError = std::max(dirError, DirError(x[i], y[i], z[i], u[i], 1.0 - 2.0 * v[i]));
+        pdfError = std::max(pdfError, MixedError(pdf[i], 0.25 / kPi));
+    }
+    Check("SampleUniformSphereW batch, direction", dirError, 1e-6);
+    Check("SampleUniformSphereW batch, pdf", pdfError, 1e-6);
+}
+
+// Concentric mapping of the square to the disc, by region
+static void ConcentricDisc(
+    const double aSampleX,
+    const double aSampleY,
+    double       &oPointX,
+    double       &oPointY)
+{
+    const double a = 2.0 * aSampleX - 1.0;
+    const double b = 2.0 * aSampleY - 1.0;
+    double r, phi;
+
+    if(a > -b)
+    {
+        if(a > b) { r =  a; phi = (kPi / 4.0) * (b / a); }
+        else      { r =  b; phi = (kPi / 4.0) * (2.0 - a / b); }
+    }
+    else
+    {
+        if(a < b) { r = -a; phi = (kPi / 4.0) * (4.0 + b / a); }
+        else      { r = -b; phi = (b != 0.0) ? (kPi / 4.0) * (6.0 - a / b) : 0.0; }
+    }
+
+    oPointX = r * std::cos(phi);
+    oPointY = r * std::sin(phi);
+}
+
+static double Fresnel(
+    const double aCosInc,
+    const double aIOR)
+{
+    if(aIOR < 0.0)
+        return 1.0;
+
+    const double eta      = (aCosInc < 0.0) ? aIOR : 1.0 / aIOR;
+    const double cosInc   = std::abs(aCosInc);
+    const double cosTrans = std::sqrt(std::max(0.0, 1.0 - eta * eta * (1.0 - cosInc * cosInc)));
+
+    const double rParallel      = (cosInc - eta * cosTrans) / (cosInc + eta * cosTrans);
+    const double rPerpendicular = (eta * cosInc - cosTrans) / (eta * cosInc + cosTrans);
+
+    return 0.5 * (rParallel * rParallel + rPerpendicular * rPerpendicular);
+}
+
+static void TestOtherSamplers()
+{
+    std::vector<float> u, v;
+    GetSamples(u, v);
+
+    const int count = (int)u.size();
+    std::vector<float> x(count), y(count);
+
+    double pointError = 0;
+    SampleConcentricDisc(&u[0], &v[0], count, &x[0], &y[0]);
+    for(int i=0; i<count; i++)
+    {
+        double pointX, pointY;
+        ConcentricDisc(u[i], v[i], pointX, pointY);
+        pointError = std::max(pointError,
+            std::sqrt(Sqr(x[i] - pointX) + Sqr(y[i] - pointY)));
+    }
+    Check("SampleConcentricDisc batch", pointError, 1e-6);
+
+    // Both sides of the surface, with total internal reflection, and
+    // the perfect mirror
+    const float iors[] = {1.6f, 1.f / 1.6f, -1.f};
+    double fresnelError = 0;
+    for(int k=0; k<3; k++)
+    {
+        for(int i=0; i<count; i++)
+            x[i] = 2.f * u[i] - 1.f;
+
+        FresnelDielectric(&x[0], iors[k], count, &y[0]);
+        for(int i=0; i<count; i++)
+            fresnelError = std::max(fresnelError,
+                std::abs(y[i] - Fresnel(x[i], iors[k])));
+    }
+    Check("FresnelDielectric batch", fresnelError, 3e-6);
+}
+
+int main()
+{
+    TestSinCos();
+    TestLog2();
+    TestExp2();
+    TestPow();
+    TestHemisphereSamplers();
+    TestOtherSamplers();
+
+    if(g_Failures > 0)
+        printf("%d check(s) FAILED\n", g_Failures);
+    else
+        printf("All checks passed\n");
+
+    return g_Failures > 0 ? 1 : 0;
+}